@@ -212,3 +212,9 @@ int jutil::count_occurences(const std::string &s, char c)
     }
     return count;
 }
+
+int jutil::num_cpus()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
@@ -14,6 +14,7 @@
 
 #include <stdlib.h>     // for getenv
 #include <string.h>     // for strncpy
+#include <pthread.h>
 
 namespace jutil
 {
@@ -158,6 +159,40 @@ namespace jutil
     /// Count number of occurences of char in string
     int count_occurences(const std::string &s, char c);
 
+    
+    // ------------------------------------------------------------
+    // Thread helpers
+    // ------------------------------------------------------------
+
+    /// Thin wrapper around a pthread mutex
+    class Mutex
+    {
+    public:
+	Mutex() { pthread_mutex_init(&_mutex, NULL); }
+	~Mutex() { pthread_mutex_destroy(&_mutex); }
+	void lock() { pthread_mutex_lock(&_mutex); }
+	void unlock() { pthread_mutex_unlock(&_mutex); }
+    private:
+	Mutex(const Mutex &other);
+	const Mutex &operator=(const Mutex &other);
+	pthread_mutex_t _mutex;
+    };
+
+    /// Holds a mutex locked for the lifetime of the object
+    class MutexLock
+    {
+    public:
+	MutexLock(Mutex &mutex) : _mutex(mutex) { _mutex.lock(); }
+	~MutexLock() { _mutex.unlock(); }
+    private:
+	MutexLock(const MutexLock &other);
+	const MutexLock &operator=(const MutexLock &other);
+	Mutex &_mutex;
+    };
+
+    /// Number of cpus currently online (at least 1)
+    int num_cpus();
+
 };
 
 #endif
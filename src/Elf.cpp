@@ -3,20 +3,59 @@
  */
 #include "Elf.hpp"
 
+#include <algorithm>
 #include <sstream>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h> // getpagesize()
 
 using namespace std;
 using namespace jutil;
 using namespace Elf;
 
+namespace Elf
+{
+    /// The structures of each ELF class, to instantiate the loading
+    /// code with
+    template <int ELF_CLASS> struct ClassTypes;
+
+    template <> struct ClassTypes<ELFCLASS32>
+    {
+	typedef Elf32_Ehdr Ehdr;
+	typedef Elf32_Phdr Phdr;
+	typedef Elf32_Shdr Shdr;
+	typedef Elf32_Sym Sym;
+    };
+
+    template <> struct ClassTypes<ELFCLASS64>
+    {
+	typedef Elf64_Ehdr Ehdr;
+	typedef Elf64_Phdr Phdr;
+	typedef Elf64_Shdr Shdr;
+	typedef Elf64_Sym Sym;
+    };
+}
+
+typedef ClassTypes<ELFCLASS32> Types32;
+typedef ClassTypes<ELFCLASS64> Types64;
+
+/// Copy out the structure at p, which needn't be aligned
+template <typename Struct>
+static inline Struct read_struct(const char *p)
+{
+    Struct result;
+    memcpy(&result, p, sizeof(result));
+    return result;
+}
 
-static bool load_table(std::istream &is,
+static const char *find_table(const Mapping &map,
 	const std::string &table_name,
 	unsigned long offset,
-	short num_chunks,
-	short chunksize,
-	std::list<std::string> &entries);
+	unsigned long num_chunks,
+	unsigned long chunksize);
 
 int Elf::page_size()
 {
@@ -40,13 +79,148 @@ Address Elf::page_align_up(const Address &addr)
 
 // ------------------------------------------------------------
 
+Mapping::Mapping()
+    : _data(NULL),
+      _size(0)
+{ }
+
+Mapping::~Mapping()
+{
+    unmap();
+}
+
+bool Mapping::map(int fd)
+{
+    unmap();
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	return false;
+    }
+    // An empty file has nothing to map, and nothing in it either
+    if (st.st_size == 0) {
+	return true;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+	return false;
+    }
+    _data = (const char *) data;
+    _size = st.st_size;
+    return true;
+}
+
+void Mapping::unmap()
+{
+    if (_data != NULL) {
+	munmap((void *) _data, _size);
+    }
+    _data = NULL;
+    _size = 0;
+}
+
+// ------------------------------------------------------------
+
+MappingPool *MappingPool::_instance = NULL;
+
+MappingPool &MappingPool::instance()
+{
+    if (_instance == NULL) {
+	_instance = new MappingPool;
+    }
+    return *_instance;
+}
+
+MappingPool::MappingPool()
+    : _limit(64)
+{
+    const char *cp = getenv("EXMAP_MAPPED_FILES");
+    if (cp != NULL && atoi(cp) > 0) {
+	_limit = atoi(cp);
+    }
+}
+
+unsigned long MappingPool::limit()
+{
+    MutexLock lock(_lock);
+    return _limit;
+}
+
+void MappingPool::set_limit(unsigned long limit)
+{
+    MutexLock lock(_lock);
+    _limit = std::max(limit, 1UL);
+    shrink();
+}
+
+unsigned long MappingPool::size()
+{
+    MutexLock lock(_lock);
+    return _positions.size();
+}
+
+void MappingPool::add(File *file)
+{
+    MutexLock lock(_lock);
+    map<File *, list<File *>::iterator>::iterator it = _positions.find(file);
+    if (it != _positions.end()) {
+	_files.splice(_files.begin(), _files, it->second);
+	return;
+    }
+    _files.push_front(file);
+    _positions[file] = _files.begin();
+    shrink();
+}
+
+void MappingPool::touch(File *file)
+{
+    MutexLock lock(_lock);
+    map<File *, list<File *>::iterator>::iterator it = _positions.find(file);
+    if (it != _positions.end() && it->second != _files.begin()) {
+	_files.splice(_files.begin(), _files, it->second);
+    }
+}
+
+void MappingPool::remove(File *file)
+{
+    MutexLock lock(_lock);
+    map<File *, list<File *>::iterator>::iterator it = _positions.find(file);
+    if (it != _positions.end()) {
+	_files.erase(it->second);
+	_positions.erase(it);
+    }
+}
+
+/// Unmap the least recently used files until there are few enough
+void MappingPool::shrink()
+{
+    while (_positions.size() > _limit) {
+	File *file = _files.back();
+	_files.pop_back();
+	_positions.erase(file);
+	file->drop_mapping();
+    }
+}
+
+// ------------------------------------------------------------
+
 File::File()
-    : _started_lazy_load_sections(false)
+    : _started_lazy_load_sections(false),
+      _elf_class(ELFCLASSNONE),
+      _file_type(ET_NONE),
+      _shoff(0),
+      _shnum(0),
+      _shentsize(0),
+      _shstrndx(0)
 { }
 
+File::~File()
+{
+    unload();
+}
+
 unsigned long File::elf_file_type()
 {
-    return _filestruct->type();
+    return _file_type;
 }
 
 bool File::load(const string &fname, bool warn_if_non_elf)
@@ -54,39 +228,95 @@ bool File::load(const string &fname, bool warn_if_non_elf)
     unload();
     _fname = fname;
 
-    if (!is_regular_file(fname)) {
+    struct stat st;
+    if (stat(fname.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
 	return false;
     }
+    _key = FileKey(st);
+
+    HeaderCache &cache = HeaderCache::instance();
+    const char *headers;
+    unsigned long len;
+    switch (cache.find(_key, headers, len)) {
+	case HeaderCache::NOT_ELF:
+	    if (warn_if_non_elf) {
+		warn << "File::load - failed to load header: " << fname << "\n";
+	    }
+	    return false;
+	case HeaderCache::ELF:
+	    if (load_cached_headers(headers, len)) {
+		return true;
+	    }
+	    // Read the file instead
+	    _segments.clear();
+	    _elf_class = ELFCLASSNONE;
+	    break;
+	default:
+	    break;
+    }
     
-    if (!open_file()) {
+    if (!map_file()) {
 	warn << "File::load - can't open file: " << fname << "\n";
 	return false;
     }
 
-    if (!load_file_header()) {
+    const char *ident = _map->at(0, EI_NIDENT);
+    if (ident == NULL
+	|| memcmp(ident, "\x7f\x45\x4c\x46", 4) != 0) {
+	/* Not an ELF file */
+	cache.add(_key, NULL, 0);
 	if (warn_if_non_elf) {
 	    warn << "File::load - failed to load header: " << fname << "\n";
 	}
 	return false;
     }
 
-    if (!load_segments()) {
-	warn << "File::load - failed to load segment info: " << fname << "\n";
+    int elf_class = ident[EI_CLASS];
+    switch (elf_class) {
+	case ELFCLASS32:
+	    _elf_class = elf_class;
+	    return load_headers<Types32>();
+	case ELFCLASS64:
+	    _elf_class = elf_class;
+	    return load_headers<Types64>();
+	default:
+	    warn << "Unrecognised ELF class: " << elf_class << "\n";
+	    return false;
+    }
+}
+
+bool File::load_cached_headers(const char *headers, unsigned long len)
+{
+    if (len < EI_NIDENT) {
 	return false;
     }
-    return true;
+    switch (headers[EI_CLASS]) {
+	case ELFCLASS32:
+	    _elf_class = ELFCLASS32;
+	    return read_cached_headers<Types32>(headers, len);
+	case ELFCLASS64:
+	    _elf_class = ELFCLASS64;
+	    return read_cached_headers<Types64>(headers, len);
+	default:
+	    return false;
+    }
 }
      
 void File::unload(void)
 {
+    if (_map) {
+	MappingPool::instance().remove(this);
+    }
     _started_lazy_load_sections = false;
-    _ifs.clear();
-    _ifs.close();
+    _map.reset();
     _fname.clear();
     _segments.clear();
     _sections.clear();
     _symbol_table_section.reset();
-    _filestruct.reset();
+    _elf_class = ELFCLASSNONE;
+    _file_type = ET_NONE;
+    _shoff = _shnum = _shentsize = _shstrndx = 0;
+    _key = FileKey();
 }
 
 
@@ -101,14 +331,20 @@ list<SymbolPtr> File::find_symbols_in_mem_range(const RangePtr &mrange)
 
 list<SymbolPtr> File::defined_symbols()
 {
-    list<SymbolPtr> syms;
     list<SymbolPtr> result;
-    list<SymbolPtr>::iterator it;
-    
-    syms = all_symbols();
-    for (it = syms.begin(); it != syms.end(); ++it) {
-	if ((*it)->is_defined()) {
-	    result.push_back(*it);
+    if (!lazy_load_sections() || !_symbol_table_section) {
+	return result;
+    }
+
+    const SymbolTablePtr &table = _symbol_table_section->symbol_table();
+    if (!table) {
+	return result;
+    }
+    vector<Symbol> &symbols = table->symbols();
+    vector<Symbol>::iterator it;
+    for (it = symbols.begin(); it != symbols.end(); ++it) {
+	if (it->is_defined()) {
+	    result.push_back(SymbolPtr(table, &*it));
 	}
     }
     return result;
@@ -126,14 +362,16 @@ list<SymbolPtr> File::all_symbols()
 
 SymbolPtr File::symbol(const string &symname)
 {
-    list<SymbolPtr> syms = all_symbols();
-    list<SymbolPtr>::iterator it;
-    for (it = syms.begin(); it != syms.end(); ++it) {
-	if ((*it)->name() == symname) {
-	    return *it;
-	}
+    if (!lazy_load_sections() || !_symbol_table_section) {
+	return SymbolPtr((Symbol *) 0);
+    }
+
+    const SymbolTablePtr &table = _symbol_table_section->symbol_table();
+    long i = table ? table->find(symname.c_str()) : -1;
+    if (i < 0) {
+	return SymbolPtr((Symbol *) 0);
     }
-    return SymbolPtr((Symbol *) 0);
+    return SymbolPtr(table, &table->symbols()[i]);
 }
 
 list<SymbolPtr> File::symbols_in_section(const SectionPtr &section)
@@ -252,14 +490,27 @@ bool File::lazy_load_sections()
 {
     // Stop possible recursion
     if (_started_lazy_load_sections) {
+	if (_map) {
+	    MappingPool::instance().touch(this);
+	}
 	return true;
     }
     _started_lazy_load_sections = true;
-    if (!load_sections()) { return false; }
-    return correlate_string_sections();
+    if (_elf_class == ELFCLASSNONE) {
+	return false;
+    }
+    if (!_map && !map_file()) {
+	return false;
+    }
+    if (_elf_class == ELFCLASS64) {
+	return load_sections<Types64>()
+	    && correlate_string_sections<Types64>();
+    }
+    return load_sections<Types32>()
+	&& correlate_string_sections<Types32>();
 }
 
-bool File::open_file()
+bool File::open_file(int &fd)
 {
     uid_t new_euid = 0, orig_euid = 0;
 
@@ -273,12 +524,8 @@ bool File::open_file()
 	seteuid(new_euid);
     }
     
-    if (_ifs.is_open()) {
-	_ifs.close();
-    }
-    _ifs.clear();
-    _ifs.open(_fname.c_str());
-    if (!_ifs.is_open()) {
+    fd = open(_fname.c_str(), O_RDONLY);
+    if (fd < 0) {
 	warn << "Can't open file: " << _fname << "\n";
     }
 
@@ -286,15 +533,50 @@ bool File::open_file()
 	seteuid(orig_euid); // ok, it will always be 0...
     }
     
-    return _ifs.is_open();
+    return fd >= 0;
+}
+
+bool File::map_file()
+{
+    int fd;
+    if (!open_file(fd)) {
+	return false;
+    }
+    // The headers may have come from the cache, so make sure they
+    // are this file's
+    struct stat st;
+    if (fstat(fd, &st) < 0 || FileKey(st) != _key) {
+	warn << "File changed since it was loaded: " << _fname << "\n";
+	close(fd);
+	return false;
+    }
+    _map.reset(new Mapping);
+    bool mapped = _map->map(fd);
+    close(fd);
+    if (!mapped) {
+	warn << "Can't map file: " << _fname << "\n";
+	_map.reset();
+	return false;
+    }
+    MappingPool::instance().add(this);
+    return true;
+}
+
+void File::drop_mapping()
+{
+    _started_lazy_load_sections = false;
+    _map.reset();
+    _sections.clear();
+    _symbol_table_section.reset();
 }
 
+template <typename T>
 bool File::correlate_string_sections()
 {
     list<SectionPtr>::iterator it;
     SectionPtr string_table;
-    int string_table_index = _filestruct->shstrndx();
-    if (string_table_index >= num_sections()) {
+    unsigned long string_table_index = _shstrndx;
+    if (string_table_index >= _sections.size()) {
 	warn << "correlate_string_sections - invalid string index\n";
 	return false;
     }
@@ -305,102 +587,115 @@ bool File::correlate_string_sections()
     }
 
     for (it = _sections.begin(); it != _sections.end(); ++it) {
-	(*it)->set_name(_ifs, string_table);
+	(*it)->set_name(_map, string_table);
 	SectionPtr &sect = *it;
 	if (sect->is_symbol_table()) {
 	    if (!sect->is_dynsym_table() || !_symbol_table_section) {
 		_symbol_table_section = sect;
 	    }
 	    SectionPtr string_table = section(sect->link());
-	    sect->load_symbols(_ifs, string_table);
+	    if (string_table) {
+		sect->load_symbols<typename T::Sym>(_map, string_table);
+	    }
 	}
     }
     return true;
 }
 
-bool File::load_file_header()
+template <typename T>
+bool File::load_headers()
 {
-    char ident_buf[EI_NIDENT];
-
-    memset(ident_buf, '\0', sizeof(ident_buf));
-    binary_read(_ifs, ident_buf);
-    _ifs.clear();
-    _ifs.seekg(0, ios::beg);
-
-    if (memcmp(ident_buf, "\x7f\x45\x4c\x46", 4) != 0) {
-	/* Not an ELF file */
+    typedef typename T::Ehdr Ehdr;
+    const char *buffer = _map->at(0, sizeof(Ehdr));
+    if (buffer == NULL) {
 	return false;
     }
+    Ehdr header = read_struct<Ehdr>(buffer);
 
-    char e_class = ident_buf[EI_CLASS];
-    switch (e_class) {
-	case ELFCLASS32:
-	    _filestruct.reset(new FileStruct<Elf32_Ehdr>(_ifs));
-	    break;
-	case ELFCLASS64:
-	    _filestruct.reset(new FileStruct<Elf64_Ehdr>(_ifs));
-	    break;
-	default:
-	    warn << "Unrecognised ELF class: " << e_class << "\n";
-	    return false;
-	    break;
+    const char *table = NULL;
+    if (header.e_phentsize != sizeof(typename T::Phdr)) {
+	warn << "Invalid segment size: " << header.e_phentsize << "\n";
+    }
+    else {
+	table = find_table(*_map,
+			   "segment header table",
+			   header.e_phoff,
+			   header.e_phnum,
+			   header.e_phentsize);
+    }
+    if (table == NULL) {
+	warn << "File::load - failed to load segment info: " << _fname << "\n";
+	return false;
     }
+    set_headers<T>(header, table);
 
-    return _ifs.good();
+    // Cache the file header followed by the segment table
+    string headers(buffer, sizeof(Ehdr));
+    headers.append(table, header.e_phnum * header.e_phentsize);
+    HeaderCache::instance().add(_key, headers.data(), headers.size());
+    return true;
 }
 
-bool File::load_sections()
+/// The headers are as load_headers caches them
+template <typename T>
+bool File::read_cached_headers(const char *headers, unsigned long len)
 {
-    list<string> entries;
-    list<string>::iterator it;
-    
-    if (!load_table(_ifs,
-		    "section header table",
-		    _filestruct->shoff(),
-		    _filestruct->shnum(),
-		    _filestruct->shentsize(),
-		    entries)
-	|| entries.empty()) {
+    typedef typename T::Ehdr Ehdr;
+    if (len < sizeof(Ehdr)) {
+	return false;
+    }
+    Ehdr header = read_struct<Ehdr>(headers);
+    if (header.e_phentsize != sizeof(typename T::Phdr)
+	|| header.e_phnum < 1
+	|| len != sizeof(Ehdr) + header.e_phnum * header.e_phentsize) {
 	return false;
     }
+    set_headers<T>(header, headers + sizeof(Ehdr));
+    return true;
+}
 
-    for (it = entries.begin(); it != entries.end(); ++it) {
-	SectionPtr s(new Section);
-	if (s->init(*it)) {
-	    _sections.push_back(s);
-	}
-	else {
-	    warn << "Failed to init section\n";
-	}
+/// Take what we need from the file header, and the segments from its
+/// table (which has been checked to be all there)
+template <typename T>
+void File::set_headers(const typename T::Ehdr &header,
+		       const char *segment_table)
+{
+    _file_type = header.e_type;
+    _shoff = header.e_shoff;
+    _shnum = header.e_shnum;
+    _shentsize = header.e_shentsize;
+    _shstrndx = header.e_shstrndx;
+
+    for (unsigned long i = 0; i < header.e_phnum; ++i) {
+	SegmentPtr s(new Segment);
+	s->init(read_struct<typename T::Phdr>(segment_table
+					      + i * header.e_phentsize));
+	_segments.push_back(s);
     }
-    return !_sections.empty();
 }
 
-bool File::load_segments()
+template <typename T>
+bool File::load_sections()
 {
-    list<string> entries;
-    list<string>::iterator it;
-    
-    if (!load_table(_ifs,
-		    "segment header table",
-		    _filestruct->phoff(),
-		    _filestruct->phnum(),
-		    _filestruct->phentsize(),
-		    entries)
-	|| entries.empty()) {
+    if (_shentsize != sizeof(typename T::Shdr)) {
+	warn << "Invalid section size: " << _shentsize << "\n";
+	return false;
+    }
+    const char *table = find_table(*_map,
+				   "section header table",
+				   _shoff,
+				   _shnum,
+				   _shentsize);
+    if (table == NULL) {
 	return false;
     }
 
-    for (it = entries.begin(); it != entries.end(); ++it) {
-	SegmentPtr s(new Segment);
-	if (s->init(*it)) {
-	    _segments.push_back(s);
-	}
-	else {
-	    warn << "Failed to init segment\n";
-	}
+    for (unsigned long i = 0; i < _shnum; ++i) {
+	SectionPtr s(new Section);
+	s->init(read_struct<typename T::Shdr>(table + i * _shentsize));
+	_sections.push_back(s);
     }
-    return !_segments.empty();
+    return !_sections.empty();
 }
 
 // ------------------------------------------------------------
@@ -419,37 +714,28 @@ typedef struct
 } Elf32_Phdr;
 */
 
-bool Segment::init(const string &buffer)
+template <typename Phdr>
+void Segment::init(const Phdr &header)
 {
-    switch (buffer.size()) {
-	case sizeof(Elf32_Phdr):
-	    _segstruct.reset(new SegmentStruct<Elf32_Phdr>(buffer));
-	    break;
-	case sizeof(Elf64_Phdr):
-	    _segstruct.reset(new SegmentStruct<Elf64_Phdr>(buffer));
-	    break;
-	default:
-	    warn << "Invalid segment size: " << buffer.size();
-	    return false;
-	    break;
-    }
-
-    _mem_range.reset(new Range(_segstruct->vaddr(),
-			       _segstruct->vaddr() + _segstruct->memsz()));
-    _file_range.reset(new Range(_segstruct->offset(),
-				_segstruct->offset() + _segstruct->filesz()));
-    return true;
+    _offset = header.p_offset;
+    _align = header.p_align;
+    _type = header.p_type;
+    _flags = header.p_flags;
+    _mem_range.reset(new Range(header.p_vaddr,
+			       header.p_vaddr + header.p_memsz));
+    _file_range.reset(new Range(header.p_offset,
+				header.p_offset + header.p_filesz));
 }
 
 
 Address Segment::offset()
 {
-    return _segstruct->offset();
+    return _offset;
 }
 
 Address Segment::align()
 {
-    return _segstruct->align();
+    return _align;
 }
 
 RangePtr Segment::mem_range()
@@ -464,7 +750,7 @@ RangePtr Segment::file_range()
 
 bool Segment::is_load()
 {
-    return _segstruct->type() == PT_LOAD;
+    return _type == PT_LOAD;
 }
 
 bool Segment::is_readable()
@@ -484,7 +770,7 @@ bool Segment::is_executable()
 
 bool Segment::flag_is_set(int flag)
 {
-    return _segstruct->flags() & flag;
+    return _flags & flag;
 }
 
 // ------------------------------------------------------------
@@ -505,27 +791,28 @@ typedef struct
 } Elf32_Shdr;
 */
 
-bool Section::init(const string &buffer)
-{
-    switch (buffer.size()) {
-	case sizeof(Elf32_Shdr):
-	    _sectstruct.reset(new SectionStruct<Elf32_Shdr>(buffer));
-	    break;
-	case sizeof(Elf64_Shdr):
-	    _sectstruct.reset(new SectionStruct<Elf64_Shdr>(buffer));
-	    break;
-	default:
-	    warn << "Invalid section size: " << buffer.size();
-	    return false;
-	    break;
-    }
-
-    _file_range.reset(new Range(_sectstruct->offset(),
-				_sectstruct->offset() + _sectstruct->size()));
-    _mem_range.reset(new Range(_sectstruct->addr(),
-			       _sectstruct->addr() + _sectstruct->size()));
+Section::Section()
+    : _name_index(0),
+      _link(0),
+      _addr(0),
+      _size(0),
+      _offset(0),
+      _type(SHT_NULL),
+      _entsize(0)
+{ }
 
-    return true;
+template <typename Shdr>
+void Section::init(const Shdr &header)
+{
+    _name_index = header.sh_name;
+    _link = header.sh_link;
+    _addr = header.sh_addr;
+    _size = header.sh_size;
+    _offset = header.sh_offset;
+    _type = header.sh_type;
+    _entsize = header.sh_entsize;
+    _file_range.reset(new Range(_offset, _offset + _size));
+    _mem_range.reset(new Range(_addr, _addr + _size));
 }
 
 string Section::name()
@@ -533,11 +820,12 @@ string Section::name()
     return _name;
 }
 
-bool Section::set_name(istream &is, const SectionPtr &string_table)
+bool Section::set_name(const MappingPtr &map,
+		       const SectionPtr &string_table)
 {
-    int name_index = _sectstruct->name();
-    _name = string_table->find_string(is, name_index);
-    return is.good();
+    const char *name = string_table->find_string(*map, _name_index);
+    _name = name == NULL ? "" : name;
+    return name != NULL;
 }
 
 RangePtr Section::file_range()
@@ -552,123 +840,133 @@ RangePtr Section::mem_range()
 
 bool Section::is_null()
 {
-    return _sectstruct->type() == SHT_NULL;
+    return _type == SHT_NULL;
 }
 
 bool Section::is_string_table()
 {
-    return _sectstruct->type() == SHT_STRTAB;
+    return _type == SHT_STRTAB;
 }
 
 bool Section::is_symbol_table()
 {
-    return _sectstruct->type() == SHT_SYMTAB || is_dynsym_table();
+    return _type == SHT_SYMTAB || is_dynsym_table();
 }
 
 bool Section::is_dynsym_table()
 {
-    return _sectstruct->type() == SHT_DYNSYM;
+    return _type == SHT_DYNSYM;
 }
 
 bool Section::is_nobits()
 {
-    return _sectstruct->type() == SHT_NOBITS;
+    return _type == SHT_NOBITS;
 }
 
-std::string Section::find_string(istream &is, int index)
+const char *Section::find_string(const Mapping &map, unsigned long index)
 {
-    if (!is_string_table() || index < 0) {
-	return "";
+    if (!is_string_table() || index >= _size) {
+	return NULL;
     }
 
-    int offset = _sectstruct->offset() + index;
-    is.seekg(offset, ios_base::beg);
-    // Symbols are null-terminated.
-    const int MAX_SYMBOL_SIZE = 1024;
-    char *buf = (char *)alloca(MAX_SYMBOL_SIZE);
-    is.getline(buf, MAX_SYMBOL_SIZE, '\0');
-    string result(buf);
-    if (!is) {
-	result.clear();
+    const char *table = map.at(_offset, _size);
+    if (table == NULL) {
+	return NULL;
     }
-    return result;
+    // Strings are null-terminated, and the last must end in the table
+    const char *str = table + index;
+    if (memchr(str, '\0', _size - index) == NULL) {
+	return NULL;
+    }
+    return str;
 }
 
 std::list<SymbolPtr> Section::symbols()
 {
-    return _symbols;
+    list<SymbolPtr> result;
+    if (!_symbol_table) {
+	return result;
+    }
+    vector<Symbol> &symbols = _symbol_table->symbols();
+    vector<Symbol>::iterator it;
+    for (it = symbols.begin(); it != symbols.end(); ++it) {
+	result.push_back(SymbolPtr(_symbol_table, &*it));
+    }
+    return result;
+}
+
+const SymbolTablePtr &Section::symbol_table()
+{
+    return _symbol_table;
 }
 
 std::list<SymbolPtr> Section::find_symbols_in_mem_range(const RangePtr &mrange)
 {
     list<SymbolPtr> result;
-    list<SymbolPtr>::iterator it;
-
-    for (it = _symbols.begin(); it != _symbols.end(); ++it) {
-	if ((*it)->is_defined() && mrange->overlaps(*(*it)->range())) {
-	    result.push_back(*it);
-	}
+    if (!_symbol_table) {
+	return result;
+    }
+    vector<unsigned int> indices;
+    _symbol_table->find_overlapping(*mrange, indices);
+    vector<Symbol> &symbols = _symbol_table->symbols();
+    vector<unsigned int>::iterator it;
+    for (it = indices.begin(); it != indices.end(); ++it) {
+	result.push_back(SymbolPtr(_symbol_table, &symbols[*it]));
     }
     return result;
 }
 
 unsigned long Section::addr()
 {
-    return _sectstruct->addr();
+    return _addr;
 }
 
 unsigned long Section::link()
 {
-    return _sectstruct->link();
+    return _link;
 }
 
 unsigned long Section::size()
 {
-    return _sectstruct->size();
+    return _size;
 }
 
-bool Section::load_symbols(std::istream &is,
+template <typename Sym>
+bool Section::load_symbols(const MappingPtr &map,
 			   const SectionPtr &string_table)
 {
     if (!is_symbol_table()) {
 	warn << "Can't load symbols from non-symbol-table section\n";
 	return false;
     }
-    unsigned int symentry_size = _sectstruct->entsize();
-    if (symentry_size <= 0) {
-	warn << "Invalid symbol entry table size " << symentry_size << "\n";
+    if (_entsize != sizeof(Sym)) {
+	warn << "Invalid symbol entry table size " << _entsize << "\n";
 	return false;
     }
 
-    int total_size = _sectstruct->size();
-    if (total_size % symentry_size != 0) {
-	warn << "Section::load_symbols - size mismatch " << symentry_size
-	     << ", " << total_size << "\n";
+    if (_size % _entsize != 0) {
+	warn << "Section::load_symbols - size mismatch " << _entsize
+	     << ", " << _size << "\n";
 	return false;
     }
 
-    list<string> entries;
-    if (!load_table(is,
-		"symbol table",
-		_sectstruct->offset(),
-		(total_size / symentry_size),
-		symentry_size,
-		entries)
-	|| entries.empty()) {
+    unsigned long num = _size / _entsize;
+    const char *table = find_table(*map,
+				   "symbol table",
+				   _offset,
+				   num,
+				   _entsize);
+    if (table == NULL) {
 	return false;
     }
     
-    _symbols.clear();
-    list<string>::iterator it;
-    for(it = entries.begin(); it != entries.end(); ++it) {
-	SymbolPtr symbol(new Symbol);
-	if (symbol->init(*it)) {
-	    symbol->set_name(is, string_table);
-	    _symbols.push_back(symbol);
-	}
-	else {
-	    warn << "Failed to init symbol from buffer\n";
-	}
+    _symbol_table.reset(new SymbolTable(map));
+    vector<Symbol> &symbols = _symbol_table->symbols();
+    symbols.reserve(num);
+    for (unsigned long i = 0; i < num; ++i) {
+	Sym sym = read_struct<Sym>(table + i * _entsize);
+	const char *name = string_table->find_string(*map, sym.st_name);
+	symbols.push_back(Symbol(sym, name == NULL ? "" : name));
     }
 
     return true;
@@ -677,34 +975,6 @@ bool Section::load_symbols(std::istream &is,
 
 // ------------------------------------------------------------
 
-bool Symbol::init(const string &buffer)
-{
-    switch (buffer.size()) {
-	case sizeof(Elf32_Sym):
-	    _symstruct.reset(new SymbolStruct<Elf32_Sym>(buffer));
-	    break;
-	case sizeof(Elf64_Sym):
-	    _symstruct.reset(new SymbolStruct<Elf64_Sym>(buffer));
-	    break;
-	default:
-	    warn << "Invalid symbol size: " << buffer.size() << "\n";
-	    return false;
-	    break;
-    }
-
-    _range.reset(new Range(_symstruct->value(),
-			   _symstruct->value() + _symstruct->size()));
-
-    return true;
-}
-
-bool Symbol::set_name(istream &is, const SectionPtr &string_table)
-{
-    int name_index = _symstruct->name();
-    _name = string_table->find_string(is, name_index);
-    return is.good();
-}
-
 string Symbol::name()
 {
     return _name;
@@ -712,22 +982,22 @@ string Symbol::name()
 
 int Symbol::size()
 {
-    return _symstruct->size();
+    return _size;
 }
 
 RangePtr Symbol::range()
 {
-    return _range;
+    return RangePtr(new Range(start(), end()));
 }
 
 bool Symbol::is_defined()
 {
-    return _symstruct->value() != 0 && !_name.empty();
+    return _value != 0 && _name[0] != '\0';
 }
 
 int Symbol::type()
 {
-    return _symstruct->info() & 0xf;
+    return ELF64_ST_TYPE(_info);
 }
 
 bool Symbol::is_func()
@@ -752,44 +1022,152 @@ bool Symbol::is_section()
 
 // ------------------------------------------------------------
 
-bool load_table(istream &is,
+/// Orders symbol positions by start address, then file order
+struct StartIsLess
+{
+    StartIsLess(const vector<Symbol> &symbols) : _symbols(symbols) { }
+    bool operator()(unsigned int lhs, unsigned int rhs) const {
+	Address lstart = _symbols[lhs].start(), rstart = _symbols[rhs].start();
+	return lstart < rstart || (lstart == rstart && lhs < rhs);
+    }
+    const vector<Symbol> &_symbols;
+};
+
+/// Compares a symbol position's start address with an address
+struct StartIsAfter
+{
+    StartIsAfter(const vector<Symbol> &symbols) : _symbols(symbols) { }
+    bool operator()(Address addr, unsigned int pos) const {
+	return addr < _symbols[pos].start();
+    }
+    const vector<Symbol> &_symbols;
+};
+
+size_t SymbolTable::hash(const char *name)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (const unsigned char *cp = (const unsigned char *) name; *cp; ++cp) {
+	h ^= *cp;
+	h *= 16777619u;
+    }
+    return h;
+}
+
+void SymbolTable::build_index()
+{
+    _indexed = true;
+
+    _by_start.clear();
+    for (unsigned int i = 0; i < _symbols.size(); ++i) {
+	if (_symbols[i].is_defined()) {
+	    _by_start.push_back(i);
+	}
+    }
+    sort(_by_start.begin(), _by_start.end(), StartIsLess(_symbols));
+    _max_end.resize(_by_start.size());
+    Address max_end = 0;
+    for (size_t i = 0; i < _by_start.size(); ++i) {
+	max_end = std::max(max_end, _symbols[_by_start[i]].end());
+	_max_end[i] = max_end;
+    }
+
+    // At most half full. Only the first symbol of each name goes in.
+    size_t num_slots = 16;
+    while (num_slots < 2 * _symbols.size()) {
+	num_slots *= 2;
+    }
+    _by_name.assign(num_slots, 0);
+    size_t mask = num_slots - 1;
+    for (unsigned int i = 0; i < _symbols.size(); ++i) {
+	const char *name = _symbols[i].c_name();
+	size_t slot = hash(name) & mask;
+	while (_by_name[slot] != 0
+	       && strcmp(_symbols[_by_name[slot] - 1].c_name(), name) != 0) {
+	    slot = (slot + 1) & mask;
+	}
+	if (_by_name[slot] == 0) {
+	    _by_name[slot] = i + 1;
+	}
+    }
+}
+
+void SymbolTable::find_overlapping(const Range &range,
+				   vector<unsigned int> &indices)
+{
+    indices.clear();
+    if (!_indexed) {
+	build_index();
+    }
+
+    // A symbol overlaps if it starts within the range, or starts at
+    // or below the range start and ends above it. Either way it ends
+    // at or above the range start, so it can't come before the first
+    // symbol whose running max end does. And it starts at or below
+    // the range start or the last address in the range.
+    vector<unsigned int>::iterator it = _by_start.begin();
+    Address start = range.start();
+    Address last = ~(Address) 0;
+    // Check all the symbols against a range with its ends swapped
+    if (range.end() >= start) {
+	last = std::max(start, range.end() == 0 ? 0 : range.end() - 1);
+	it += lower_bound(_max_end.begin(), _max_end.end(), start)
+	    - _max_end.begin();
+    }
+    vector<unsigned int>::iterator end
+	= upper_bound(it, _by_start.end(), last, StartIsAfter(_symbols));
+    for (; it != end; ++it) {
+	const Symbol &symbol = _symbols[*it];
+	if (range.overlaps(Range(symbol.start(), symbol.end()))) {
+	    indices.push_back(*it);
+	}
+    }
+    sort(indices.begin(), indices.end());
+}
+
+long SymbolTable::find(const char *name)
+{
+    if (!_indexed) {
+	build_index();
+    }
+    size_t mask = _by_name.size() - 1;
+    size_t slot = hash(name) & mask;
+    while (_by_name[slot] != 0) {
+	unsigned int pos = _by_name[slot] - 1;
+	if (strcmp(_symbols[pos].c_name(), name) == 0) {
+	    return pos;
+	}
+	slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+// ------------------------------------------------------------
+
+/// The start of a table of num_chunks entries of chunksize bytes at
+/// offset in the file, NULL (with a warning) if it isn't all there
+const char *find_table(const Mapping &map,
 	const std::string &table_name,
 	unsigned long offset,
-	short num_chunks,
-	short chunksize,
-	list<string> &entries)
+	unsigned long num_chunks,
+	unsigned long chunksize)
 {
-    entries.clear();
-    
     if (offset == 0) {
 	warn << "No " << table_name << " present\n";
-	return false;
+	return NULL;
     }
     if (num_chunks < 1) {
 	warn << "Invalid number of chunks " << num_chunks
 	     << " in " << table_name << "\n";
-	return false;
-    }
-
-    is.seekg(offset, ios_base::beg);
-    if (!is.good()) {
-	warn << "Can't seek to offset: " << offset << "\n";
-	return false;
+	return NULL;
     }
 
     unsigned long read_size = num_chunks * chunksize;
-    char *buffer = (char *) alloca(read_size);
-    is.read(buffer, read_size);
-    if (!is.good()) {
-	warn << "Can't read " << read_size << " bytes\n";
-	return false;
-    }
-
-    for (unsigned int i = 0; i < read_size; i += chunksize) {
-	string s(buffer + i, chunksize);
-	entries.push_back(s);
+    const char *table = map.at(offset, read_size);
+    if (table == NULL) {
+	warn << "Can't read " << read_size << " bytes at offset "
+	     << offset << "\n";
+	return NULL;
     }
-
-    return true;
+    return table;
 }
-
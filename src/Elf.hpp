@@ -5,13 +5,15 @@
 #define _ELF_CPP_H
 
 #include <list>
+#include <map>
 #include <string>
-#include <fstream>
+#include <vector>
 
 #include <elf.h>
 
 #include <boost/shared_ptr.hpp>
 
+#include "ElfCache.hpp"
 #include "Range.hpp"
 #include "jutil.hpp"
 
@@ -26,39 +28,52 @@ namespace Elf
     Address page_align_down(const Address &addr);
     Address page_align_up(const Address &addr);
 
-    class SymbolStructBase
+    /// A whole file mapped read only. It doesn't need the file to
+    /// stay open once it is mapped.
+    class Mapping
     {
-	public:
-	    virtual ~SymbolStructBase() { };
-	    virtual unsigned long size() = 0;
-	    virtual unsigned long value() = 0;
-	    virtual unsigned long name() = 0;
-	    virtual unsigned long info() = 0;
-    };
-    typedef boost::shared_ptr<SymbolStructBase> SymbolStructPtr;
-
-    template <typename StructType>
-	class SymbolStruct : public SymbolStructBase
-    {
-	public:
-	    SymbolStruct(const std::string &buffer) {
-		memcpy(&_data, buffer.data(), sizeof(_data));
+    public:
+	Mapping();
+	~Mapping();
+	/// Map the file open on fd (which is left open). False if
+	/// it can't be mapped.
+	bool map(int fd);
+	/// Unmap the file
+	void unmap();
+	/// Size of the mapped file
+	unsigned long size() const { return _size; }
+	/// The len bytes at offset in the file, NULL if they are not
+	/// all within it
+	const char *at(unsigned long offset, unsigned long len) const {
+	    if (offset > _size || len > _size - offset) {
+		return NULL;
 	    }
-	    unsigned long size() { return _data.st_size; }
-	    unsigned long value() { return _data.st_value; }
-	    unsigned long name() { return _data.st_name; }
-	    unsigned long info() { return _data.st_info; }
-	private:
-	    StructType _data;
+	    return _data + offset;
+	}
+    private:
+	Mapping(const Mapping &other);
+	const Mapping &operator=(const Mapping &other);
+	const char *_data;
+	unsigned long _size;
     };
+    typedef boost::shared_ptr<Mapping> MappingPtr;
 
     class Section;
     typedef boost::shared_ptr<Section> SectionPtr;
-    /// Hold information on a single ELF symbol
+    /// Hold information on a single ELF symbol. Symbols are small
+    /// values, kept in an array in their SymbolTable.
     class Symbol
     {
     public:
-	bool init(const std::string &data);
+	Symbol() : _value(0), _size(0), _info(0), _name("") { }
+	/// Set up from a symbol table entry (Elf32_Sym or Elf64_Sym)
+	/// and its name, which must outlive the symbol
+	template <typename Sym>
+	Symbol(const Sym &sym, const char *name)
+	    : _value(sym.st_value),
+	      _size(sym.st_size),
+	      _info(sym.st_info),
+	      _name(name) { }
 	int size();
 	/// True if the symbol has a name and a non-zero value
 	bool is_defined();
@@ -67,55 +82,67 @@ namespace Elf
 	bool is_file();
 	bool is_section();
 	std::string name();
-	bool set_name(std::istream &is, const SectionPtr &string_table);
+	/// The name, pointing into the mapped string table
+	const char *c_name() const { return _name; }
 	RangePtr range();
+	/// The symbol value, i.e. its start address
+	Address start() const { return _value; }
+	/// The end of the symbol's range
+	Address end() const { return _value + _size; }
     private:
 	int type();
-	SymbolStructPtr _symstruct;
-	std::string _name;
-	RangePtr _range;
+	Address _value;
+	unsigned long _size;
+	unsigned char _info;
+	const char *_name;
     };
     typedef boost::shared_ptr<Symbol> SymbolPtr;
-    
-    class SectionStructBase
-    {
-	public:
-	    virtual ~SectionStructBase() { };
-	    virtual unsigned long size() = 0;
-	    virtual unsigned long offset() = 0;
-	    virtual unsigned long addr() = 0;
-	    virtual unsigned long name() = 0;
-	    virtual unsigned long type() = 0;
-	    virtual unsigned long entsize() = 0;
-	    virtual unsigned long link() = 0;
-    };
-    typedef boost::shared_ptr<SectionStructBase> SectionStructPtr;
 
-    template <typename StructType>
-	class SectionStruct : public SectionStructBase
+    /// The symbols of one symbol table section, in file order. Their
+    /// names point into the mapped file, which the table keeps
+    /// mapped. A SymbolPtr to one of them shares ownership of the
+    /// whole table.
+    ///
+    /// Address and name lookups use indexes built the first time
+    /// either is needed, rather than scanning every symbol.
+    class SymbolTable
     {
-	public:
-	    SectionStruct(const std::string &buffer) {
-		memcpy(&_data, buffer.data(), sizeof(_data));
-	    }
-	    unsigned long size() { return _data.sh_size; }
-	    unsigned long offset() { return _data.sh_offset; }
-	    unsigned long addr() { return _data.sh_addr; }
-	    unsigned long name() { return _data.sh_name; }
-	    unsigned long type() { return _data.sh_type; }
-	    unsigned long entsize() { return _data.sh_entsize; }
-	    unsigned long link() { return _data.sh_link; }
-	private:
-	    StructType _data;
+    public:
+	SymbolTable(const MappingPtr &map) : _map(map), _indexed(false) { }
+	/// The symbols, in file order
+	std::vector<Symbol> &symbols() { return _symbols; }
+	/// Set indices to the positions in symbols() of the defined
+	/// symbols which overlap range, in file order
+	void find_overlapping(const Range &range,
+			      std::vector<unsigned int> &indices);
+	/// The position of the first symbol with this name, -1 if none
+	long find(const char *name);
+    private:
+	void build_index();
+	static size_t hash(const char *name);
+	MappingPtr _map;
+	std::vector<Symbol> _symbols;
+	bool _indexed;
+	/// Positions of the defined symbols, by start address
+	std::vector<unsigned int> _by_start;
+	/// The greatest end of the symbols in _by_start up to each one
+	std::vector<Address> _max_end;
+	/// Open addressing table of the position (plus one, so zero is
+	/// an empty slot) of the first symbol of each name
+	std::vector<unsigned int> _by_name;
     };
-
+    typedef boost::shared_ptr<SymbolTable> SymbolTablePtr;
+    
     /// Hold information on a single ELF section (program header)
     class Section
     {
     public:
-	bool init(const std::string &buffer);
+	Section();
+	/// Set up from a section header (Elf32_Shdr or Elf64_Shdr)
+	template <typename Shdr>
+	void init(const Shdr &header);
 	std::string name();
-	bool set_name(std::istream &is, const SectionPtr &string_table);
+	bool set_name(const MappingPtr &map, const SectionPtr &string_table);
 	RangePtr file_range();
 	RangePtr mem_range();
 	/// Returns the sh_type value. See elf.h
@@ -125,65 +152,42 @@ namespace Elf
 	bool is_dynsym_table();
 	bool is_nobits();
 	std::list<SymbolPtr> symbols();
+	/// The symbols, if this is a symbol table (null o/w)
+	const SymbolTablePtr &symbol_table();
 	std::list<SymbolPtr> find_symbols_in_mem_range(const RangePtr &mrange);
-	bool load_symbols(std::istream &is,
+	/// Load the symbols of a symbol table section, whose entries
+	/// are Syms (Elf32_Sym or Elf64_Sym)
+	template <typename Sym>
+	bool load_symbols(const MappingPtr &map,
 			  const SectionPtr &string_table);
-	std::string find_string(std::istream &is, int index);
+	/// The string at index in this string table, in place in the
+	/// mapped file. NULL if this isn't a string table or the string
+	/// doesn't end within it.
+	const char *find_string(const Mapping &map, unsigned long index);
 	unsigned long addr();
 	unsigned long link();
 	unsigned long size();
     private:
-	SectionStructPtr _sectstruct;
 	RangePtr _mem_range;
 	RangePtr _file_range;
-	std::list<SymbolPtr> _symbols;
+	SymbolTablePtr _symbol_table;
 	std::string _name;
 	unsigned long _name_index;
 	unsigned long _link;
 	unsigned long _addr;
 	unsigned long _size;
 	unsigned long _offset;
-	char _type;
+	unsigned long _type;
 	unsigned long _entsize;
     };
 
-    class SegmentStructBase
-    {
-	public:
-	    virtual ~SegmentStructBase() { };
-	    virtual unsigned long vaddr() = 0;
-	    virtual unsigned long memsz() = 0;
-	    virtual unsigned long offset() = 0;
-	    virtual unsigned long filesz() = 0;
-	    virtual unsigned long type() = 0;
-	    virtual unsigned long flags() = 0;
-	    virtual unsigned long align() = 0;
-    };
-    typedef boost::shared_ptr<SegmentStructBase> SegmentStructPtr;
-
-    template <typename StructType>
-	class SegmentStruct : public SegmentStructBase
-    {
-	public:
-	    SegmentStruct(const std::string &buffer) {
-		memcpy(&_data, buffer.data(), sizeof(_data));
-	    }
-	    unsigned long vaddr() { return _data.p_vaddr; }
-	    unsigned long memsz() { return _data.p_memsz; }
-	    unsigned long offset() { return _data.p_offset; }
-	    unsigned long filesz() { return _data.p_filesz; }
-	    unsigned long type() { return _data.p_type; }
-	    unsigned long flags() { return _data.p_flags; }
-	    unsigned long align() { return _data.p_align; }
-	private:
-	    StructType _data;
-    };
-
     /// Hold information on a single ELF segment
     class Segment
     {
     public:
-	bool init(const std::string &buffer);
+	/// Set up from a program header (Elf32_Phdr or Elf64_Phdr)
+	template <typename Phdr>
+	void init(const Phdr &header);
 	RangePtr mem_range();
 	RangePtr file_range();
 	Address offset();
@@ -196,49 +200,74 @@ namespace Elf
 	RangePtr _mem_range;
 	RangePtr _file_range;
 	bool flag_is_set(int flag);
-	SegmentStructPtr _segstruct;
+	Address _offset;
+	unsigned long _align;
+	unsigned long _type;
+	unsigned long _flags;
     };
     typedef boost::shared_ptr<Segment> SegmentPtr;
     
-    class FileStructBase
-    {
-	public:
-	    virtual ~FileStructBase() { };
-	    virtual unsigned long type() = 0;
-	    virtual unsigned long shoff() = 0;
-	    virtual unsigned long shnum() = 0;
-	    virtual unsigned long shentsize() = 0;
-	    virtual unsigned long phoff() = 0;
-	    virtual unsigned long phnum() = 0;
-	    virtual unsigned long phentsize() = 0;
-	    virtual unsigned long shstrndx() = 0;
-    };
-    typedef boost::shared_ptr<FileStructBase> FileStructPtr;
+    class File;
 
-    template <typename StructType>
-	class FileStruct : public FileStructBase
+    /// Keeps count of the Elf::Files which have their file mapped, and
+    /// stops more than limit() of them doing so at once. When another
+    /// file is mapped, the least recently used one lets go of its
+    /// mapping and the sections and symbols read from it, to map and
+    /// read them again if they are wanted. SymbolPtrs which are still
+    /// held keep their table mapped until they go.
+    ///
+    /// The limit is 64 files, or EXMAP_MAPPED_FILES.
+    ///
+    /// The lock only covers the pool's own list. Mapping one file can
+    /// unmap another, whose members aren't locked, so Elf::Files must
+    /// not be used from several threads at once (the snapshot loader
+    /// threads only read page info; the Files are made afterwards,
+    /// on one thread).
+    class MappingPool
     {
-	public:
-	    FileStruct(std::istream &is) {
-		jutil::binary_read(is, _data);
-	    }
-	    unsigned long type() { return _data.e_type; }
-	    unsigned long shoff() { return _data.e_shoff; }
-	    unsigned long shnum() { return _data.e_shnum; }
-	    unsigned long shentsize() { return _data.e_shentsize; }
-	    unsigned long phoff() { return _data.e_phoff; }
-	    unsigned long phnum() { return _data.e_phnum; }
-	    unsigned long phentsize() { return _data.e_phentsize; }
-	    unsigned long shstrndx() { return _data.e_shstrndx; }
-	private:
-	    StructType _data;
+    public:
+	/// The pool all Elf::Files use
+	static MappingPool &instance();
+	/// Most files mapped at once
+	unsigned long limit();
+	/// Change the limit (at least 1), unmapping files if need be
+	void set_limit(unsigned long limit);
+	/// Number of files mapped
+	unsigned long size();
+	/// file has mapped its file
+	void add(File *file);
+	/// file has used its mapping
+	void touch(File *file);
+	/// file has let go of its mapping
+	void remove(File *file);
+    private:
+	MappingPool();
+	MappingPool(const MappingPool &other);
+	const MappingPool &operator=(const MappingPool &other);
+	void shrink();
+	static MappingPool *_instance;
+	jutil::Mutex _lock;
+	unsigned long _limit;
+	/// The files with a mapping, most recently used first
+	std::list<File *> _files;
+	std::map<File *, std::list<File *>::iterator> _positions;
     };
 
-    /// Hold information on a single ELF file, 32- or 64-bit
+    /// Hold information on a single ELF file, 32- or 64-bit. The file
+    /// is mapped, and the headers and tables are read in place. The
+    /// class of the file is looked at once, to pick the instance of
+    /// the templated loading code (T is a ClassTypes, in Elf.cpp) for
+    /// its structures.
+    ///
+    /// The file and program headers come from the HeaderCache if it
+    /// has them, in which case the file isn't mapped until the
+    /// sections are needed. The MappingPool may unmap the file when it
+    /// isn't being used.
     class File
     {
     public:
 	File();
+	~File();
 	/// Load information from the specified file. Returns false if not
 	/// an elf file (or does not exist). Will also warn unless
 	/// 'warn_if_non_elf' is false.
@@ -281,20 +310,40 @@ namespace Elf
 	/// Syntactic sugar for elf_file_type() == ET_DYN
 	bool is_shared_object();
     private:
+	friend class MappingPool;
+	File(const File &other);
+	const File &operator=(const File &other);
 	bool lazy_load_sections();
-	bool open_file();
-	bool correlate_string_sections();
-	bool load_file_header();
-	bool load_sections();
-	bool load_segments();
+	bool open_file(int &fd);
+	bool map_file();
+	/// Let go of the mapping and everything read from it, for the
+	/// MappingPool
+	void drop_mapping();
+	bool load_cached_headers(const char *headers, unsigned long len);
+	template <typename T> bool correlate_string_sections();
+	template <typename T> bool load_headers();
+	template <typename T> bool read_cached_headers(const char *headers,
+						       unsigned long len);
+	template <typename T> void set_headers(const typename T::Ehdr &header,
+					       const char *segment_table);
+	template <typename T> bool load_sections();
 
 	bool _started_lazy_load_sections;
-	std::ifstream _ifs;
+	MappingPtr _map;
 	std::string _fname;
+	/// The version of the file the headers came from
+	FileKey _key;
 	std::list<Elf::SegmentPtr> _segments;
 	std::list<Elf::SectionPtr> _sections;
 	SectionPtr _symbol_table_section;
-	FileStructPtr _filestruct;
+	/// ELFCLASS32 or ELFCLASS64
+	int _elf_class;
+	/// What we need from the file header
+	unsigned long _file_type;
+	unsigned long _shoff;
+	unsigned long _shnum;
+	unsigned long _shentsize;
+	unsigned long _shstrndx;
     };
     typedef boost::shared_ptr<File> FilePtr;
 };
@@ -0,0 +1,382 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#include "ElfCache.hpp"
+#include "Elf.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace jutil;
+using namespace Elf;
+
+FileKey::FileKey()
+    : dev(0), inode(0), size(0), mtime(0), ctime(0)
+{ }
+
+FileKey::FileKey(const struct stat &st)
+    : dev(st.st_dev),
+      inode(st.st_ino),
+      size(st.st_size),
+      mtime((uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec),
+      ctime((uint64_t) st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec)
+{ }
+
+bool FileKey::operator<(const FileKey &other) const
+{
+    if (dev != other.dev) {
+	return dev < other.dev;
+    }
+    if (inode != other.inode) {
+	return inode < other.inode;
+    }
+    if (size != other.size) {
+	return size < other.size;
+    }
+    if (mtime != other.mtime) {
+	return mtime < other.mtime;
+    }
+    return ctime < other.ctime;
+}
+
+bool FileKey::operator==(const FileKey &other) const
+{
+    return dev == other.dev
+	&& inode == other.inode
+	&& size == other.size
+	&& mtime == other.mtime
+	&& ctime == other.ctime;
+}
+
+// ------------------------------------------------------------
+
+/*
+ * The cache file is a header, then the entries sorted by key, then
+ * the headers of the ELF files one after another. It is only ever
+ * read on the machine which wrote it, so is in native byte order.
+ */
+
+static const char CACHE_MAGIC[8] = { 'E', 'X', 'M', 'A', 'P', 'E', 'H', 'C' };
+static const uint32_t CACHE_VERSION = 1;
+static const char *CACHE_FILE = "elf-headers";
+/// Entries not used in a run are dropped when there are more than this
+static const unsigned long MAX_ENTRIES = 20000;
+/// Files changed more recently than this (in seconds) aren't added,
+/// since another change within the same timestamp tick wouldn't
+/// change the key
+static const uint64_t MIN_AGE = 2;
+
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t num_entries;
+    uint64_t blob_bytes;
+};
+
+struct HeaderCache::Entry
+{
+    enum {
+	IS_ELF = 1,
+    };
+    FileKey key;
+    /// Where the headers are, from the start of the blobs
+    uint64_t offset;
+    uint32_t len;
+    uint32_t flags;
+};
+
+/// Orders entries by key
+struct EntryKeyIsLess
+{
+    template <typename Entry>
+    bool operator()(const Entry &entry, const FileKey &key) const {
+	return entry.key < key;
+    }
+};
+
+/// Make dir and any missing parents
+static bool make_dirs(const string &dir)
+{
+    string::size_type pos = 0;
+    while (pos != string::npos) {
+	pos = dir.find('/', pos + 1);
+	string path = dir.substr(0, pos);
+	if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+/// True if path is owned by the effective user
+static bool owned_by_us(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && st.st_uid == geteuid();
+}
+
+HeaderCache *HeaderCache::_instance = NULL;
+
+HeaderCache::HeaderCache(const string &dir)
+    : _dir(dir),
+      _loaded(false),
+      _entries(NULL),
+      _num_entries(0),
+      _blobs(NULL),
+      _blob_bytes(0),
+      _hits(0)
+{ }
+
+HeaderCache::~HeaderCache()
+{ }
+
+HeaderCache &HeaderCache::instance()
+{
+    if (_instance == NULL) {
+	_instance = new HeaderCache(default_dir());
+    }
+    return *_instance;
+}
+
+void HeaderCache::use_dir(const string &dir)
+{
+    delete _instance;
+    _instance = new HeaderCache(dir);
+}
+
+string HeaderCache::default_dir()
+{
+    const char *cp = getenv("EXMAP_CACHE_DIR");
+    if (cp != NULL) {
+	return cp;
+    }
+    // Under sudo, HOME may still be the invoking user's. Root
+    // mustn't leave a directory there the user can't write, nor
+    // trust a cache the user could have written, so the default is
+    // only used if it is ours.
+    string base, dir;
+    cp = getenv("XDG_CACHE_HOME");
+    if (cp != NULL && *cp != '\0') {
+	base = cp;
+	dir = base + "/exmap";
+    }
+    else if ((cp = getenv("HOME")) != NULL && *cp != '\0') {
+	base = cp;
+	dir = base + "/.cache/exmap";
+    }
+    if (dir.empty() || !owned_by_us(base)
+	|| (file_exists(dir) && !owned_by_us(dir))) {
+	return "";
+    }
+    return dir;
+}
+
+string HeaderCache::cache_file()
+{
+    return _dir + "/" + CACHE_FILE;
+}
+
+bool HeaderCache::load()
+{
+    _loaded = true;
+    _map.reset();
+    _entries = NULL;
+    _num_entries = 0;
+    _blobs = NULL;
+    _blob_bytes = 0;
+    _used.clear();
+    if (_dir.empty()) {
+	return false;
+    }
+
+    string fname = cache_file();
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+	// Nothing cached yet
+	return false;
+    }
+    MappingPtr map(new Mapping);
+    bool mapped = map->map(fd);
+    close(fd);
+    const char *cp = mapped ? map->at(0, sizeof(CacheHeader)) : NULL;
+    if (cp == NULL) {
+	warn << "Ignoring unreadable ELF header cache " << fname << "\n";
+	return false;
+    }
+
+    CacheHeader header;
+    memcpy(&header, cp, sizeof(header));
+    unsigned long max_entries
+	= (map->size() - sizeof(header)) / sizeof(Entry);
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+	|| header.version != CACHE_VERSION
+	|| header.entry_size != sizeof(Entry)
+	|| header.num_entries > max_entries
+	|| header.blob_bytes != map->size() - sizeof(header)
+	                        - header.num_entries * sizeof(Entry)) {
+	warn << "Ignoring invalid ELF header cache " << fname << "\n";
+	return false;
+    }
+
+    _map = map;
+    _num_entries = header.num_entries;
+    _entries = (const Entry *) map->at(sizeof(header),
+				       _num_entries * sizeof(Entry));
+    _blob_bytes = header.blob_bytes;
+    _blobs = map->at(sizeof(header) + _num_entries * sizeof(Entry),
+		     _blob_bytes);
+    _used.assign(_num_entries, false);
+    return true;
+}
+
+HeaderCache::Result HeaderCache::find(const FileKey &key,
+				      const char *&headers,
+				      unsigned long &len)
+{
+    MutexLock lock(_lock);
+    headers = NULL;
+    len = 0;
+    if (_dir.empty()) {
+	return MISSING;
+    }
+    if (!_loaded) {
+	load();
+    }
+
+    map<FileKey, string>::iterator added = _added.find(key);
+    if (added != _added.end()) {
+	++_hits;
+	if (added->second.empty()) {
+	    return NOT_ELF;
+	}
+	headers = added->second.data();
+	len = added->second.size();
+	return ELF;
+    }
+
+    const Entry *end = _entries + _num_entries;
+    const Entry *entry = lower_bound(_entries, end, key, EntryKeyIsLess());
+    if (entry == end || entry->key != key) {
+	return MISSING;
+    }
+    if (!(entry->flags & Entry::IS_ELF)) {
+	++_hits;
+	_used[entry - _entries] = true;
+	return NOT_ELF;
+    }
+    if (entry->offset > _blob_bytes
+	|| entry->len > _blob_bytes - entry->offset) {
+	return MISSING;
+    }
+    ++_hits;
+    _used[entry - _entries] = true;
+    headers = _blobs + entry->offset;
+    len = entry->len;
+    return ELF;
+}
+
+void HeaderCache::add(const FileKey &key,
+		      const char *headers,
+		      unsigned long len)
+{
+    MutexLock lock(_lock);
+    if (_dir.empty()
+	|| key.ctime / 1000000000 + MIN_AGE > (uint64_t) time(NULL)) {
+	return;
+    }
+    _added[key] = headers == NULL ? string() : string(headers, len);
+}
+
+bool HeaderCache::save()
+{
+    MutexLock lock(_lock);
+    if (_dir.empty() || _added.empty()) {
+	return true;
+    }
+    if (!_loaded) {
+	load();
+    }
+
+    // The new entries, and the old ones which are still wanted
+    map<FileKey, string> entries;
+    entries.swap(_added);
+    bool keep_unused = _num_entries + entries.size() <= MAX_ENTRIES;
+    for (unsigned long i = 0; i < _num_entries; ++i) {
+	const Entry &entry = _entries[i];
+	if (!keep_unused && !_used[i]) {
+	    continue;
+	}
+	if (entry.flags & Entry::IS_ELF) {
+	    if (entry.offset > _blob_bytes
+		|| entry.len > _blob_bytes - entry.offset) {
+		continue;
+	    }
+	    entries.insert(make_pair(entry.key,
+				     string(_blobs + entry.offset,
+					    entry.len)));
+	}
+	else {
+	    entries.insert(make_pair(entry.key, string()));
+	}
+    }
+
+    CacheHeader header;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.entry_size = sizeof(Entry);
+    header.num_entries = entries.size();
+    header.blob_bytes = 0;
+
+    vector<Entry> table;
+    table.reserve(entries.size());
+    map<FileKey, string>::iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it) {
+	Entry entry;
+	entry.key = it->first;
+	entry.offset = header.blob_bytes;
+	entry.len = it->second.size();
+	entry.flags = it->second.empty() ? 0 : Entry::IS_ELF;
+	table.push_back(entry);
+	header.blob_bytes += it->second.size();
+    }
+
+    // Write a new file and move it over the old one, so a reader
+    // never sees it half written
+    if (!make_dirs(_dir)) {
+	warn << "Can't make cache directory " << _dir << "\n";
+	return false;
+    }
+    stringstream tmp_name;
+    tmp_name << cache_file() << ".tmp." << getpid();
+    ofstream out(tmp_name.str().c_str(), ios::out | ios::binary);
+    out.write((const char *) &header, sizeof(header));
+    if (!table.empty()) {
+	out.write((const char *) &table[0], table.size() * sizeof(Entry));
+    }
+    for (it = entries.begin(); it != entries.end(); ++it) {
+	out.write(it->second.data(), it->second.size());
+    }
+    out.close();
+    if (out.fail()
+	|| rename(tmp_name.str().c_str(), cache_file().c_str()) < 0) {
+	warn << "Can't write ELF header cache " << cache_file() << "\n";
+	unlink(tmp_name.str().c_str());
+	return false;
+    }
+
+    // The entries just saved are now in the file
+    load();
+    return true;
+}
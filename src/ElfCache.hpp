@@ -0,0 +1,115 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#ifndef _ELFCACHE_H
+#define _ELFCACHE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <boost/shared_ptr.hpp>
+
+#include "jutil.hpp"
+
+namespace Elf
+{
+    class Mapping;
+
+    /// Identifies one version of a file. The change time is in there
+    /// as it can't be set back, unlike the modification time, so a
+    /// file changed in place never has the key it had before.
+    struct FileKey
+    {
+	FileKey();
+	FileKey(const struct stat &st);
+	uint64_t dev;
+	uint64_t inode;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t ctime;
+	bool operator<(const FileKey &other) const;
+	bool operator==(const FileKey &other) const;
+	bool operator!=(const FileKey &other) const {
+	    return !(*this == other);
+	}
+    };
+
+    /// A cache on disk of the headers Elf::File::load reads (the file
+    /// header and program header table), so that loading the hundreds
+    /// of files a snapshot maps needn't open them. Files which aren't
+    /// ELF are remembered too.
+    ///
+    /// Entries are keyed on the FileKey of the file, so a file which
+    /// has changed is never found. The cache is one file, in
+    /// $EXMAP_CACHE_DIR, or else exmap under $XDG_CACHE_HOME or
+    /// ~/.cache. It is mapped when first used, and the entries are
+    /// binary searched in place. Set EXMAP_CACHE_DIR to the empty
+    /// string to turn the cache off. The default directory is only
+    /// used if it (and the home or XDG cache directory) belongs to
+    /// the effective user, so e.g. a run under sudo has no cache
+    /// unless EXMAP_CACHE_DIR is set.
+    class HeaderCache
+    {
+    public:
+	/// A cache kept in dir (off if dir is empty)
+	HeaderCache(const std::string &dir);
+	~HeaderCache();
+
+	/// The cache Elf::File uses
+	static HeaderCache &instance();
+
+	/// Make instance() use the cache in dir, e.g. for testing
+	static void use_dir(const std::string &dir);
+
+	enum Result {
+	    MISSING,
+	    NOT_ELF,
+	    ELF,
+	};
+
+	/// Look up a file. If it is ELF, headers and len are set to
+	/// its cached headers, which stay valid until the next save()
+	Result find(const FileKey &key, const char *&headers,
+		    unsigned long &len);
+
+	/// Remember the headers of a file (NULL for one that isn't
+	/// ELF), unless it has only just changed
+	void add(const FileKey &key, const char *headers, unsigned long len);
+
+	/// Write the cache out, if anything has been added. Entries
+	/// which weren't used since the cache was loaded are dropped
+	/// if there are too many.
+	bool save();
+
+	/// Number of lookups found since the cache was made
+	unsigned long hits() { return _hits; }
+    private:
+	HeaderCache(const HeaderCache &other);
+	const HeaderCache &operator=(const HeaderCache &other);
+	struct Entry;
+	static std::string default_dir();
+	static HeaderCache *_instance;
+	bool load();
+	std::string cache_file();
+	jutil::Mutex _lock;
+	std::string _dir;
+	bool _loaded;
+	/// The cache file, and the entries and headers in it
+	boost::shared_ptr<Mapping> _map;
+	const Entry *_entries;
+	unsigned long _num_entries;
+	const char *_blobs;
+	unsigned long _blob_bytes;
+	/// Which of the loaded entries have been found
+	std::vector<bool> _used;
+	/// The headers added since the cache was loaded. Not ELF if empty.
+	std::map<FileKey, std::string> _added;
+	unsigned long _hits;
+    };
+}
+
+#endif
@@ -4,13 +4,23 @@
 #include "jutil.hpp"
 #include "Exmap.hpp"
 #include "Elf.hpp"
+#include "SizesKernel.hpp"
+
+#include <boost/make_shared.hpp>
 
 #include <sstream>
 #include <set>
+#include <algorithm>
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
+#include <linux/fs.h>
 
 using namespace Exmap;
 using namespace std;
@@ -34,8 +44,46 @@ ostream &operator<<(ostream &os, const Exmap::Map &map)
 Snapshot::Snapshot(SysInfoPtr &sys_info)
     : _page_pool(new PagePool),
       _file_pool(new FilePool),
-      _sys_info(sys_info)
+      _sys_info(sys_info),
+      _num_threads(default_num_threads()),
+      _summary_only(false),
+      _count_mode(COUNT_ATOMIC)
+{
+}
+
+void Snapshot::set_num_threads(int num_threads)
+{
+    _num_threads = num_threads < 1 ? 1 : num_threads;
+}
+
+int Snapshot::num_threads()
+{
+    return _num_threads;
+}
+
+int Snapshot::default_num_threads()
+{
+    const char *cp = getenv("EXMAP_THREADS");
+    if (cp == NULL) {
+	return 1;
+    }
+    int n = atoi(cp);
+    return n > 0 ? n : num_cpus();
+}
+
+void Snapshot::set_count_mode(CountMode mode)
+{
+    _count_mode = mode;
+}
+
+void Snapshot::set_summary_only(bool summary_only)
+{
+    _summary_only = summary_only;
+}
+
+bool Snapshot::summary_only()
 {
+    return _summary_only;
 }
 
 const list<ProcessPtr> Snapshot::procs()
@@ -74,9 +122,12 @@ const FilePtr Snapshot::file(const std::string &fname)
 
 bool Snapshot::load()
 {
+    // Let go of the names of the last snapshot's vmas
+    _sys_info->prune_names();
     list<pid_t> pids = _sys_info->accessible_pids();
 
-    if (!_sys_info->sanity_check()) {
+    // Summaries come from smaps, which any backend can read
+    if (!_summary_only && !_sys_info->sanity_check()) {
 	warn << "Can't get system info\n";
 	exit(-1);
     }
@@ -86,6 +137,16 @@ bool Snapshot::load()
 	return false;
     }
 
+    // Counting by pfn is quicker than hashing, if we know the range,
+    // but only worth the memory if much of the range gets counted
+    _page_pool->clear();
+    PageCookie max_pfn = _sys_info->max_pfn();
+    if (!_summary_only
+	&& max_pfn > 0
+	&& PagePool::dense_is_smaller(max_pfn, _sys_info->mapped_pages())) {
+	_page_pool->set_dense_limit(max_pfn);
+    }
+
     if (!load_procs(pids)) {
 	warn << "Snapshot::load - failed to load: processe\n";
 	return false;
@@ -95,36 +156,143 @@ bool Snapshot::load()
     	warn << "Snapshot::load - failed to load: calculate file mappings\n";
     	return false;
     }
+
+    // Keep the headers of any new files for next time
+    Elf::HeaderCache::instance().save();
     return true;
 }
 
 bool Snapshot::load_procs(const list<pid_t> &pids)
 {
     list<pid_t>::const_iterator it;
-    pid_t mypid = getpid();
 
     _procs.clear();
-    _page_pool->clear();
+
+    if (_num_threads > 1 && _sys_info->is_thread_safe()) {
+	load_procs_threaded(pids);
+	return !_procs.empty();
+    }
     
     for (it = pids.begin(); it != pids.end(); ++it) {
-	if (*it == mypid) {
-	    // Don't monitor ourselves
-	    continue;
+	ProcessPtr proc = load_proc(*it);
+	if (proc) {
+	    _procs[*it] = proc;
 	}
+    }
+    
+    return !_procs.empty();
+}
 
-	ProcessPtr proc(new Process(_page_pool, *it));
-	proc->selfptr(proc);
-	if (!proc->load(_sys_info)) {
-	    warn << "Snapshot::load_procs - can't load pid " << *it << "\n";
-	    continue;
+ProcessPtr Snapshot::load_proc(pid_t pid, PageCountTable *counts)
+{
+    ProcessPtr null_proc;
+
+    if (pid == getpid()) {
+	// Don't monitor ourselves
+	return null_proc;
+    }
+
+    ProcessPtr proc = boost::make_shared<Process>(_page_pool, pid);
+    bool loaded = _summary_only
+	? proc->load_summary(_sys_info)
+	: _count_mode == COUNT_SHARDED
+	? proc->load(_sys_info, counts)
+	: proc->load(_sys_info, NULL, counts);
+    if (!loaded) {
+	warn << "Snapshot::load_procs - can't load pid " << pid << "\n";
+	return null_proc;
+    }
+
+    if (!proc->has_mm()) {
+	return null_proc;
+    }
+    return proc;
+}
+
+struct Snapshot::LoadWork
+{
+    Snapshot *snapshot;
+    vector<pid_t> pids;
+    vector<ProcessPtr> procs;
+    size_t next;
+    Mutex lock;
+};
+
+struct Snapshot::LoadThread
+{
+    LoadWork *work;
+    /// The thread's own page counts, merged after the join
+    PageCountTable *counts;
+};
+
+void *Snapshot::load_worker(void *arg)
+{
+    LoadThread *thread = (LoadThread *) arg;
+    LoadWork *work = thread->work;
+
+    while (true) {
+	size_t i;
+	{
+	    MutexLock lock(work->lock);
+	    i = work->next++;
+	}
+	if (i >= work->pids.size()) {
+	    break;
 	}
+	// Each slot is only written by one thread
+	work->procs[i] = work->snapshot->load_proc(work->pids[i],
+						   thread->counts);
+    }
+    return NULL;
+}
 
-	if (proc->has_mm()) {
-	    _procs[*it] = proc;
+void Snapshot::load_procs_threaded(const list<pid_t> &pids)
+{
+    LoadWork work;
+    work.snapshot = this;
+    work.pids.assign(pids.begin(), pids.end());
+    work.procs.resize(work.pids.size());
+    work.next = 0;
+
+    // Either way, pages the pool can't count atomically are counted
+    // per thread, so the threads never wait for each other
+    vector<PageCountTable> shards(_num_threads);
+    vector<LoadThread> thread_info(_num_threads);
+    for (int i = 0; i < _num_threads; ++i) {
+	thread_info[i].work = &work;
+	thread_info[i].counts = &shards[i];
+    }
+
+    vector<pthread_t> threads;
+    for (int i = 0; i < _num_threads; ++i) {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, load_worker, &thread_info[i]) != 0) {
+	    warn << "Snapshot::load_procs - can't start thread " << i << "\n";
+	    break;
+	}
+	threads.push_back(thread);
+    }
+
+    // Do any remaining work ourselves if no threads could start
+    if (threads.empty()) {
+	load_worker(&thread_info[0]);
+    }
+
+    vector<pthread_t>::iterator thread_it;
+    for (thread_it = threads.begin(); thread_it != threads.end(); ++thread_it) {
+	pthread_join(*thread_it, NULL);
+    }
+
+    vector<PageCountTable>::iterator shard_it;
+    for (shard_it = shards.begin(); shard_it != shards.end(); ++shard_it) {
+	_page_pool->merge(*shard_it);
+    }
+
+    for (size_t i = 0; i < work.pids.size(); ++i) {
+	if (work.procs[i]) {
+	    _procs[work.pids[i]] = work.procs[i];
 	}
     }
-    
-    return !_procs.empty();
 }
 
 bool Snapshot::calculate_file_mappings()
@@ -134,7 +302,10 @@ bool Snapshot::calculate_file_mappings()
 
     bool all_worked = true;
     for (it = processes.begin(); it != processes.end(); ++it) {
-	if (!(*it)->calculate_maps(_file_pool)) {
+	bool calculated = _summary_only
+	    ? (*it)->calculate_summary_maps(_file_pool)
+	    : (*it)->calculate_maps(_file_pool);
+	if (!calculated) {
 	    warn << "Failed to process maps for pid " << (*it)->pid() << "\n";
 	    all_worked = false;
 	}
@@ -147,44 +318,316 @@ bool Snapshot::calculate_file_mappings()
 
 void PagePool::clear()
 {
-    _counts.clear();
+    _table.clear();
+    vector<int>().swap(_dense);
+}
+
+void PagePool::set_dense_limit(PageCookie limit)
+{
+    if (_table.size() > 0) {
+	warn << "PagePool::set_dense_limit - pool already in use\n";
+	return;
+    }
+    _dense.assign(limit, 0);
+}
+
+bool PagePool::dense_is_smaller(PageCookie limit, PageCookie num_cookies)
+{
+    // The table is between a quarter and half full
+    const PageCookie hashed_bytes = 3 * sizeof(PageCountTable::Slot);
+    return limit * sizeof(int) <= num_cookies * hashed_bytes;
+}
+
+size_t PagePool::counts(const Page *pages,
+			size_t n,
+			int32_t *counts) const
+{
+    size_t num_invalid = 0;
+    for (size_t i = 0; i < n; ++i) {
+	if (!pages[i].is_mapped()) {
+	    counts[i] = 0;
+	    continue;
+	}
+	counts[i] = count(pages[i]);
+	if (counts[i] <= 0) {
+	    ++num_invalid;
+	}
+    }
+    return num_invalid;
+}
+
+void PagePool::inc_pages_count(const Page *pages, size_t count)
+{
+    // Count the dense pages without a lock, and see if there are any
+    // others.
+    size_t num_hashed = 0;
+    for (size_t i = 0; i < count; ++i) {
+	PageCookie cookie = pages[i].cookie();
+	if (cookie == 0) {
+	    continue;
+	}
+	if (cookie < _dense.size()) {
+	    __sync_fetch_and_add(&_dense[cookie], 1);
+	}
+	else {
+	    ++num_hashed;
+	}
+    }
+    if (num_hashed == 0) {
+	return;
+    }
+
+    jutil::MutexLock lock(_lock);
+    for (size_t i = 0; i < count; ++i) {
+	PageCookie cookie = pages[i].cookie();
+	if (cookie != 0 && cookie >= _dense.size()) {
+	    _table.increment(cookie);
+	}
+    }
+}
+
+void PagePool::inc_pages_count(const Page *pages,
+			       size_t count,
+			       PageCountTable &overflow)
+{
+    for (size_t i = 0; i < count; ++i) {
+	PageCookie cookie = pages[i].cookie();
+	if (cookie == 0) {
+	    continue;
+	}
+	if (cookie < _dense.size()) {
+	    __sync_fetch_and_add(&_dense[cookie], 1);
+	}
+	else {
+	    overflow.increment(cookie);
+	}
+    }
+}
+
+void PagePool::merge(const PageCountTable &shard)
+{
+    vector<PageCountTable::Slot>::const_iterator it;
+    for (it = shard._slots.begin(); it != shard._slots.end(); ++it) {
+	if (it->cookie == 0) {
+	    continue;
+	}
+	if (it->cookie < _dense.size()) {
+	    _dense[it->cookie] += it->count;
+	}
+	else {
+	    _table.add(it->cookie, it->count);
+	}
+    }
+}
+
+// ------------------------------------------------------------
+
+// Number of slots a table starts with. Must be a power of 2.
+static const int PAGE_COUNT_TABLE_BITS = 10;
+
+PageCountTable::PageCountTable()
+{
+    clear();
+}
+
+void PageCountTable::clear()
+{
+    Slot empty = { 0, 0 };
+    _slots.assign(1 << PAGE_COUNT_TABLE_BITS, empty);
+    _size = 0;
+    _mask = _slots.size() - 1;
+    _shift = 64 - PAGE_COUNT_TABLE_BITS;
+}
+
+void PageCountTable::grow()
+{
+    vector<Slot> old_slots;
+    old_slots.swap(_slots);
+
+    Slot empty = { 0, 0 };
+    _slots.assign(old_slots.size() * 2, empty);
+    _mask = _slots.size() - 1;
+    --_shift;
+
+    vector<Slot>::const_iterator it;
+    for (it = old_slots.begin(); it != old_slots.end(); ++it) {
+	if (it->cookie == 0) {
+	    continue;
+	}
+	size_t i = slot(it->cookie);
+	while (_slots[i].cookie != 0) {
+	    i = (i + 1) & _mask;
+	}
+	_slots[i] = *it;
+    }
+}
+
+// ------------------------------------------------------------
+
+// Number of slots a name pool starts with. Must be a power of 2.
+static const size_t NAME_POOL_SLOTS = 256;
+
+NamePool::NamePool()
+    : _slots(NAME_POOL_SLOTS),
+      _size(0)
+{ }
+
+size_t NamePool::hash(const char *name, size_t len)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+	h ^= (unsigned char) name[i];
+	h *= 16777619u;
+    }
+    return h;
+}
+
+NamePtr NamePool::intern(const char *name, size_t len)
+{
+    jutil::MutexLock lock(_lock);
+    size_t mask = _slots.size() - 1;
+    size_t i = hash(name, len) & mask;
+    while (_slots[i]) {
+	const string &slot = *_slots[i];
+	if (slot.length() == len && memcmp(slot.data(), name, len) == 0) {
+	    return _slots[i];
+	}
+	i = (i + 1) & mask;
+    }
+
+    NamePtr interned(new string(name, len));
+    _slots[i] = interned;
+    // Keep the table no more than half full
+    if (++_size * 2 > _slots.size()) {
+	vector<NamePtr> old_slots(_slots.size() * 2);
+	old_slots.swap(_slots);
+	vector<NamePtr>::const_iterator it;
+	for (it = old_slots.begin(); it != old_slots.end(); ++it) {
+	    if (*it) {
+		insert(*it);
+	    }
+	}
+    }
+    return interned;
+}
+
+void NamePool::insert(const NamePtr &name)
+{
+    size_t mask = _slots.size() - 1;
+    size_t i = hash(name->data(), name->length()) & mask;
+    while (_slots[i]) {
+	i = (i + 1) & mask;
+    }
+    _slots[i] = name;
+}
+
+void NamePool::prune()
+{
+    jutil::MutexLock lock(_lock);
+    vector<NamePtr> old_slots(_slots.size());
+    old_slots.swap(_slots);
+    _size = 0;
+    vector<NamePtr>::const_iterator it;
+    for (it = old_slots.begin(); it != old_slots.end(); ++it) {
+	if (*it && !it->unique()) {
+	    insert(*it);
+	    ++_size;
+	}
+    }
+}
+
+size_t NamePool::size()
+{
+    jutil::MutexLock lock(_lock);
+    return _size;
 }
 
 // ------------------------------------------------------------
 
 void FilePool::clear()
 {
+    _by_id.clear();
+    _by_shared_name.clear();
+    _by_name.clear();
     _files.clear();
 }
 
 FilePtr FilePool::name_to_file(const string &name)
 {
-    return _files[name];
+    map<string, FilePtr>::iterator it = _by_name.find(name);
+    if (it == _by_name.end()) {
+	return FilePtr();
+    }
+    return it->second;
+}
+
+FilePtr FilePool::make_file(const NamePtr &name)
+{
+    FilePtr file = boost::make_shared<File>(name);
+    _files.push_back(file);
+    _by_name.insert(make_pair(*name, file));
+    return file;
 }
 
 FilePtr FilePool::get_or_make_file(const string &name)
 {
-    map<string, FilePtr>::iterator it;
+    FilePtr file = name_to_file(name);
+    if (!file) {
+	file = make_file(NamePtr(new string(name)));
+    }
+    return file;
+}
+
+FilePtr FilePool::get_or_make_file(const VmaPtr &vma)
+{
+    const NamePtr &name = vma->shared_name();
+    if (vma->inode() == 0) {
+	map<NamePtr, FilePtr>::iterator it = _by_shared_name.find(name);
+	if (it != _by_shared_name.end()) {
+	    return it->second;
+	}
+	FilePtr file = get_or_make_file(*name);
+	_by_shared_name[name] = file;
+	return file;
+    }
 
-    it = _files.find(name);
-    if (it == _files.end()) {
-	FilePtr f(new File(name));
-	_files[name] = f;
-	it = _files.find(name);
+    FileId id = { vma->dev(), vma->inode() };
+    map<FileId, FilePtr>::iterator it = _by_id.find(id);
+    if (it == _by_id.end()) {
+	FilePtr file = make_file(name);
+	_by_id[id] = file;
+	return file;
     }
-    return it->second;
+
+    // Another path to a file we already have. Still worth knowing,
+    // so the file can be looked up by either.
+    const FilePtr &file = it->second;
+    if (name != file->shared_name() && *name != file->name()) {
+	_by_name.insert(make_pair(*name, file));
+    }
+    return file;
+}
+
+static bool fileptr_name_is_less(const FilePtr &lhs, const FilePtr &rhs)
+{
+    return lhs->name() < rhs->name();
 }
 
 list<FilePtr> FilePool::files()
 {
-    return map_values(_files);
+    list<FilePtr> files = _files;
+    files.sort(fileptr_name_is_less);
+    return files;
 }
 
 // ------------------------------------------------------------
 
 Process::Process(const PagePoolPtr &page_pool,
 		 pid_t pid)
-    : _pid(pid),
+    : _shard(NULL),
+      _overflow(NULL),
+      _pid(pid),
       _page_pool(page_pool)
 { }
 
@@ -193,17 +636,8 @@ const PagePoolPtr &Process::page_pool()
     return _page_pool;
 }
 
-boost::shared_ptr<Process> Process::selfptr()
-{
-    return _selfptr.lock();
-}
-
-void Process::selfptr(boost::shared_ptr<Process> &p)
-{
-    _selfptr = p;
-}
 
-bool Process::load(SysInfoPtr &sys_info)
+void Process::load_cmdline(SysInfoPtr &sys_info)
 {
     _cmdline = sys_info->read_cmdline(_pid);
     if (_cmdline.empty()) {
@@ -213,6 +647,15 @@ bool Process::load(SysInfoPtr &sys_info)
     if (space != string::npos) {
         _cmdline.erase(space);
     }
+}
+
+bool Process::load(SysInfoPtr &sys_info,
+		   PageCountTable *shard,
+		   PageCountTable *overflow)
+{
+    _shard = shard;
+    _overflow = overflow;
+    load_cmdline(sys_info);
 
     if (!sys_info->read_vmas(_page_pool, _pid, _vmas)) {
 	warn << "Process::load - can't load vmas: " << _pid << "\n";
@@ -232,11 +675,48 @@ bool Process::load(SysInfoPtr &sys_info)
     return true;
 }
 
+bool Process::load_summary(SysInfoPtr &sys_info)
+{
+    load_cmdline(sys_info);
+
+    if (!sys_info->read_vmas(_page_pool, _pid, _vmas)) {
+	warn << "Process::load_summary - can't load vmas: " << _pid << "\n";
+	return false;
+    }
+
+    if (!has_mm()) { return true; }
+
+    map<Address, SizesPtr> vma_sizes;
+    if (!sys_info->read_vma_sizes(_pid, vma_sizes)) {
+	warn << "Process::load_summary - can't load vma sizes: "
+	     << _pid << "\n";
+	return false;
+    }
+
+    vector<VmaPtr>::iterator it;
+    for (it = _vmas.begin(); it != _vmas.end(); ++it) {
+	map<Address, SizesPtr>::iterator vs_it;
+	vs_it = vma_sizes.find((*it)->start());
+	if (vs_it == vma_sizes.end()) {
+	    // The process can change its mappings between our reads
+	    dbg << _pid << ": no sizes for vma " << (*it)->to_string() << "\n";
+	    SizesPtr sizes(new Sizes);
+	    sizes->increase(Sizes::VM, (*it)->vm_size());
+	    (*it)->set_summary_sizes(sizes);
+	}
+	else {
+	    (*it)->set_summary_sizes(vs_it->second);
+	}
+    }
+
+    return true;
+}
+
 void Process::remove_ignorable_if_nopages()
 {
     stringstream pref;
     pref << pid() << " remove_ignorable_if_nopages: ";
-    list<VmaPtr>::iterator it;
+    vector<VmaPtr>::iterator it;
     
     for (it = _vmas.begin(); it != _vmas.end(); ++it) {
 	if ((*it)->is_ignorable() && (*it)->num_pages() == 0) {
@@ -258,112 +738,299 @@ list<FilePtr> Process::files()
     return files;
 }
 
-list<MapPtr> Process::maps()
+const list<MapPtr> &Process::maps()
 {
     return _maps;
 }
 
-
-pid_t Process::pid()
+const vector<VmaPtr> &Process::vmas()
 {
-    return _pid;
+    return _vmas;
 }
 
-SizesPtr Process::sizes()
+/// For upper_bound: true if addr is below the start of vma
+static bool starts_after(Address addr, const VmaPtr &vma)
 {
-    return Map::sum_sizes(_page_pool, _maps);
+    return addr < vma->start();
 }
 
-SizesPtr Process::sizes(const FilePtr &file)
+/// For lower_bound: true if vma starts below addr
+static bool starts_before(const VmaPtr &vma, Address addr)
 {
-    list<MapPtr> maps;
-    maps = restrict_maps_to_file(file);
-    return Map::sum_sizes(_page_pool, maps);
+    return vma->start() < addr;
 }
 
-SizesPtr Process::sizes(const FilePtr &file,
-			const RangePtr &elf_range)
+vector<VmaPtr>::iterator Process::find_vma_containing(Address addr)
 {
-    list<MapPtr> maps;
-    list<MapPtr>::iterator it;
-    maps = restrict_maps_to_file(file);
-    SizesPtr sizes(new Sizes);
-
-    for (it = maps.begin(); it != maps.end(); ++it) {
-	RangePtr map_elf_range = (*it)->elf_range();
-	if (map_elf_range) {
-	    RangePtr subrange = elf_range->intersect(*map_elf_range);
-	    if (subrange) {
-		RangePtr mem_range = (*it)->elf_to_mem_range(subrange);
-		SizesPtr subsizes = (*it)->sizes_for_mem_range(_page_pool,
-							       mem_range);
-		if (subsizes) {
-		    sizes->add(subsizes);
-		}
-	    }
-	}
+    // The last vma starting at or below addr is the only candidate
+    vector<VmaPtr>::iterator it;
+    it = upper_bound(_vmas.begin(), _vmas.end(), addr, starts_after);
+    if (it == _vmas.begin()) {
+	return _vmas.end();
     }
-    return sizes;
+    --it;
+    return (*it)->range()->contains(addr) ? it : _vmas.end();
 }
 
-list<MapPtr> Process::restrict_maps_to_file(const FilePtr &file)
+VmaPtr Process::vma_at(Address addr)
 {
-    list<MapPtr> file_maps = file->maps();
-    list<MapPtr> proc_maps = _maps;
-    list<MapPtr> result = Map::intersect_lists(file_maps, proc_maps);
-    if (result.size() == 0) {
-	warn << _pid << ": empty restriction to file " << file->name() << "\n";
-    }
-    return result;
+    vector<VmaPtr>::iterator it = find_vma_containing(addr);
+    return it == _vmas.end() ? VmaPtr() : *it;
 }
 
 
-
-void Process::add_file(const FilePtr &file)
-{
-    _files.insert(file);
-}
-
-bool Process::calculate_maps(FilePoolPtr &file_pool)
+pid_t Process::pid()
 {
-    MapCalculator mc(_vmas, file_pool, selfptr());
-
-    return mc.calc_maps(_maps) && !_maps.empty();
+    return _pid;
 }
 
+/// Sizes a list of elf ranges against maps, visiting only the
+/// ranges which overlap each map.
+class ElfRangeSweep
+{
+public:
+    ElfRangeSweep(const vector<Range> &elf_ranges);
+    /// Add the sizes of each range within the maps to results
+    void add_sizes(const PagePoolPtr &pp,
+		   const list<MapPtr> &maps,
+		   vector<Sizes> &results);
+private:
+    const vector<Range> &_ranges;
+    /// Indices into _ranges, in order of range start
+    vector<size_t> _order;
+    /// _max_ends[i] is the highest end of the first i + 1 ranges in
+    /// _order. Non-decreasing, so we can search it even though
+    /// overlapping ranges don't have ordered ends.
+    vector<Address> _max_ends;
+};
 
+/// Orders range indices by range start
+class RangeStartLess
+{
+public:
+    RangeStartLess(const vector<Range> &ranges) : _ranges(ranges) { }
+    bool operator()(size_t a, size_t b) const
+    {
+	return _ranges[a].start() < _ranges[b].start();
+    }
+private:
+    const vector<Range> &_ranges;
+};
 
-bool Process::load_page_info(SysInfoPtr &sys_info)
+ElfRangeSweep::ElfRangeSweep(const vector<Range> &elf_ranges)
+    : _ranges(elf_ranges)
 {
-    map<Address, list<Page> > page_info;
-    stringstream pref;
-    pref << pid() << " load_page_info: ";
+    _order.reserve(_ranges.size());
+    bool sorted = true;
+    for (size_t i = 0; i < _ranges.size(); ++i) {
+	_order.push_back(i);
+	sorted = sorted
+	    && (i == 0 || _ranges[i - 1].start() <= _ranges[i].start());
+    }
+    if (!sorted) {
+	stable_sort(_order.begin(), _order.end(), RangeStartLess(_ranges));
+    }
 
-    if (!sys_info->read_page_info(_pid, page_info)) {
-	warn << pref.str() << "can't read page info for " << _pid;
-	return false;
+    _max_ends.reserve(_order.size());
+    Address max_end = 0;
+    vector<size_t>::const_iterator it;
+    for (it = _order.begin(); it != _order.end(); ++it) {
+	if (_ranges[*it].end() > max_end) {
+	    max_end = _ranges[*it].end();
+	}
+	_max_ends.push_back(max_end);
     }
+}
 
-    map<Address, list<Page> >::iterator pi_it;
-    for (pi_it = page_info.begin(); pi_it != page_info.end(); ++pi_it) {
-	Address start_address = pi_it->first;
-	VmaPtr vma;
-	if (!find_vma_by_addr(start_address, vma)) {
-	    // This can happen, a process can alloc whilst we are
-	    // running
-	    warn << pref.str() << "can't find vma at "
-		 << hex << start_address << dec << ": pid " << _pid << "\n";
+void ElfRangeSweep::add_sizes(const PagePoolPtr &pp,
+			      const list<MapPtr> &maps,
+			      vector<Sizes> &results)
+{
+    list<MapPtr>::const_iterator map_it;
+    Range subrange, mem_range;
+    for (map_it = maps.begin(); map_it != maps.end(); ++map_it) {
+	const RangePtr &map_elf_range = (*map_it)->elf_range();
+	if (!map_elf_range) {
 	    continue;
 	}
-	
-	if (pi_it->second.size() == 0) {
-	    warn << pref.str() << "VMA with no pages " << start_address << "\n";
+	// Skip the ranges which end before the map...
+	size_t i = upper_bound(_max_ends.begin(), _max_ends.end(),
+			       map_elf_range->start()) - _max_ends.begin();
+	// ...and stop at the first which starts after it
+	for (; i < _order.size(); ++i) {
+	    const Range &elf_range = _ranges[_order[i]];
+	    if (elf_range.start() >= map_elf_range->end()) {
+		break;
+	    }
+	    if (elf_range.intersect(*map_elf_range, subrange)
+		&& (*map_it)->elf_to_mem_range(subrange, mem_range)) {
+		(*map_it)->add_sizes_for_mem_range(pp, mem_range,
+						   results[_order[i]]);
+	    }
 	}
-	vma->add_pages(pi_it->second);
-	_page_pool->inc_pages_count(pi_it->second);
     }
-
-    return true;
+}
+
+SizesPtr Process::sizes()
+{
+    SizesPtr sizes(new Sizes);
+    add_sizes<Sizes::ALL_MEASURES>(*sizes);
+    return sizes;
+}
+
+SizesPtr Process::sizes(const FilePtr &file)
+{
+    SizesPtr sizes(new Sizes);
+    add_sizes<Sizes::ALL_MEASURES>(file, *sizes);
+    return sizes;
+}
+
+template <unsigned MEASURES>
+void Process::add_sizes(Sizes &sizes)
+{
+    Map::add_sum_sizes<MEASURES>(_page_pool, _maps, sizes);
+}
+
+template <unsigned MEASURES>
+void Process::add_sizes(const FilePtr &file, Sizes &sizes)
+{
+    Map::add_sum_sizes<MEASURES>(_page_pool,
+				 restrict_maps_to_file(file),
+				 sizes);
+}
+
+SizesPtr Process::sizes(const FilePtr &file,
+			const RangePtr &elf_range)
+{
+    const list<MapPtr> &maps = restrict_maps_to_file(file);
+    list<MapPtr>::const_iterator it;
+    SizesPtr sizes(new Sizes);
+
+    Range subrange, mem_range;
+    for (it = maps.begin(); it != maps.end(); ++it) {
+	const RangePtr &map_elf_range = (*it)->elf_range();
+	if (map_elf_range
+	    && elf_range->intersect(*map_elf_range, subrange)
+	    && (*it)->elf_to_mem_range(subrange, mem_range)) {
+	    SizesPtr subsizes = (*it)->sizes_for_mem_range(_page_pool,
+							   mem_range);
+	    if (subsizes) {
+		sizes->add(subsizes);
+	    }
+	}
+    }
+    return sizes;
+}
+
+bool Process::sizes(const FilePtr &file,
+		    const vector<Range> &elf_ranges,
+		    vector<Sizes> &results)
+{
+    results.assign(elf_ranges.size(), Sizes());
+    ElfRangeSweep sweep(elf_ranges);
+    sweep.add_sizes(_page_pool, restrict_maps_to_file(file), results);
+    return true;
+}
+
+const list<MapPtr> &Process::restrict_maps_to_file(const FilePtr &file)
+{
+    const list<MapPtr> &result = file->maps(_pid);
+    if (result.empty()) {
+	warn << _pid << ": empty restriction to file " << file->name() << "\n";
+    }
+    return result;
+}
+
+
+
+void Process::add_file(const FilePtr &file)
+{
+    _files.insert(file);
+}
+
+bool Process::calculate_maps(FilePoolPtr &file_pool)
+{
+    MapCalculator mc(_vmas, file_pool, shared_from_this());
+
+    return mc.calc_maps(_maps) && !_maps.empty();
+}
+
+bool Process::calculate_summary_maps(FilePoolPtr &file_pool)
+{
+    RangePtr null_range;
+    vector<VmaPtr>::iterator it;
+
+    _maps.clear();
+    for (it = _vmas.begin(); it != _vmas.end(); ++it) {
+	VmaPtr &vma = *it;
+	FilePtr file = file_pool->get_or_make_file(vma);
+	file->add_proc(shared_from_this());
+	add_file(file);
+
+	MapPtr map = boost::make_shared<Map>(vma, vma->range(), null_range);
+	_maps.push_back(map);
+	file->add_map(_pid, map);
+    }
+
+    return !_maps.empty();
+}
+
+
+
+bool Process::load_page_info(SysInfoPtr &sys_info)
+{
+    _sink_vma = _vmas.begin();
+    if (!sys_info->read_page_info(_pid, *this)) {
+	warn << pid() << " load_page_info: can't read page info for " << _pid;
+	return false;
+    }
+
+    vector<VmaPtr>::iterator it;
+    for (it = _vmas.begin(); it != _vmas.end(); ++it) {
+	(*it)->shrink_pages();
+    }
+    return true;
+}
+
+void Process::add_pages(Address start, const Page *pages, size_t count)
+{
+    // Both the page runs and the vmas are in address order, so the
+    // run is usually in the vma we used last time or the next one.
+    if (_sink_vma != _vmas.end() && (*_sink_vma)->end() <= start) {
+	++_sink_vma;
+    }
+    if (_sink_vma == _vmas.end() || !(*_sink_vma)->range()->contains(start)) {
+	_sink_vma = find_vma_containing(start);
+    }
+
+    VmaPtr vma;
+    if (_sink_vma != _vmas.end()) {
+	vma = *_sink_vma;
+    }
+    else if (find_vma_by_addr(start, vma)) {
+	// The run starts at an untrimmed stack vma start
+	start = vma->start();
+    }
+    else {
+	// This can happen, a process can alloc whilst we are
+	// running
+	warn << pid() << " add_pages: can't find vma at "
+	     << hex << start << dec << ": pid " << _pid << "\n";
+	return;
+    }
+
+    // Only count the pages the vma took, or the counts won't match
+    // the pages we can find
+    count = vma->add_pages(start, pages, count);
+    if (_shard) {
+	_shard->add_pages(pages, count);
+    }
+    else if (_overflow) {
+	_page_pool->inc_pages_count(pages, count, *_overflow);
+    }
+    else {
+	_page_pool->inc_pages_count(pages, count);
+    }
 }
 
 
@@ -375,24 +1042,27 @@ bool Process::has_mm()
 bool Process::find_vma_by_addr(Address start,
 				VmaPtr &vma)
 {
-    list<VmaPtr>::const_iterator it;
-
     static Address page_size = 0;
     if (page_size == 0) {
         page_size = getpagesize();
     }
 
-    for (it = _vmas.begin(); it != _vmas.end(); ++it) {
-        // More recent kernels (how recent?) trim the stack guard page
-        // from the vma. Assume we can't have VMAs of size 1 page and so
-        // allow a one-page slack (being slack allows us to work on both
-        // old and new kernels. If this causes problems, we could do this
-        // only if the vma has the name 'stack' or similar.
-        Address vma_start = (*it)->start();
-	if (vma_start == start || vma_start == start + page_size) {
-	    vma = *it;
-	    return true;
-	}
+    // More recent kernels (how recent?) trim the stack guard page
+    // from the vma. Assume we can't have VMAs of size 1 page and so
+    // allow a one-page slack (being slack allows us to work on both
+    // old and new kernels. If this causes problems, we could do this
+    // only if the vma has the name 'stack' or similar.
+    // Vma starts are distinct, so the first vma starting at or after
+    // start is the only one which can match.
+    vector<VmaPtr>::iterator it;
+    it = lower_bound(_vmas.begin(), _vmas.end(), start, starts_before);
+    if (it == _vmas.end()) {
+	return false;
+    }
+    Address vma_start = (*it)->start();
+    if (vma_start == start || vma_start == start + page_size) {
+	vma = *it;
+	return true;
     }
     return false;
 }
@@ -416,9 +1086,31 @@ void Process::print(ostream &os) const
 Vma::Vma(Elf::Address start,
 	 Elf::Address end,
 	 off_t offset,
-	 const std::string &fname)
+	 const std::string &fname,
+	 unsigned int perms,
+	 dev_t dev,
+	 ino_t inode)
     : _offset(offset),
-      _fname(fname)
+      _fname(new string(fname)),
+      _perms(perms),
+      _dev(dev),
+      _inode(inode)
+{
+    _range = RangePtr(new Range(start, end));
+}
+
+Vma::Vma(Elf::Address start,
+	 Elf::Address end,
+	 off_t offset,
+	 const NamePtr &fname,
+	 unsigned int perms,
+	 dev_t dev,
+	 ino_t inode)
+    : _offset(offset),
+      _fname(fname),
+      _perms(perms),
+      _dev(dev),
+      _inode(inode)
 {
     _range = RangePtr(new Range(start, end));
 }
@@ -429,34 +1121,184 @@ Elf::Address Vma::end() { return _range->end(); }
 
 RangePtr Vma::range() { return _range; }
 
-std::string Vma::fname() { return _fname; }
-
 off_t Vma::offset() { return _offset; }
 
 Elf::Address Vma::vm_size() { return _range->size(); }
 
+unsigned int Vma::perms() { return _perms; }
+
+bool Vma::is_readable() { return _perms & PERM_READ; }
+
+bool Vma::is_writable() { return _perms & PERM_WRITE; }
+
+bool Vma::is_executable() { return _perms & PERM_EXEC; }
+
+bool Vma::is_shared() { return _perms & PERM_SHARED; }
+
+dev_t Vma::dev() { return _dev; }
+
+ino_t Vma::inode() { return _inode; }
+
 int Vma::num_pages()
 {
-    return _pages.size();
+    int num = 0;
+    vector<PageExtent>::const_iterator it;
+    for (it = _extents.begin(); it != _extents.end(); ++it) {
+	num += it->count;
+    }
+    return num;
+}
+
+void Vma::shrink_pages()
+{
+    // The swap trick, as there is no shrink_to_fit
+    vector<PageExtent>(_extents).swap(_extents);
+    vector<Page>(_pages).swap(_pages);
 }
 
-boost::shared_ptr<Vma> Vma::selfptr()
+size_t Vma::page_storage_bytes()
 {
-    return _selfptr.lock();
+    return _extents.capacity() * sizeof(PageExtent)
+	+ _pages.capacity() * sizeof(Page)
+	+ _totals.capacity() * sizeof(PageTotals)
+	+ _extent_ordinals.capacity() * sizeof(unsigned long);
+}
+
+Page Vma::page_at(Address addr)
+{
+    unsigned long pgnum;
+    if (!addr_to_pgnum(addr, pgnum)) {
+	return Page(0, false, false);
+    }
+    return pgnum_to_page(pgnum);
 }
 
-void Vma::selfptr(boost::shared_ptr<Vma> &p)
+Page Vma::pgnum_to_page(unsigned long pgnum)
 {
-    _selfptr = p;
+    // Find the last extent starting at or before pgnum
+    size_t lo = 0, hi = _extents.size();
+    while (lo < hi) {
+	size_t mid = (lo + hi) / 2;
+	if (_extents[mid].pgnum <= pgnum) {
+	    lo = mid + 1;
+	}
+	else {
+	    hi = mid;
+	}
+    }
+    if (lo > 0) {
+	const PageExtent &ext = _extents[lo - 1];
+	if (pgnum < ext.pgnum + ext.count) {
+	    if (ext.contiguous) {
+		return _pages[ext.index].offset_by(pgnum - ext.pgnum);
+	    }
+	    return _pages[ext.index + (pgnum - ext.pgnum)];
+	}
+    }
+    return Page(0, false, false);
 }
 
+void Vma::set_summary_sizes(const SizesPtr &sizes)
+{
+    _summary_sizes = sizes;
+}
+
+SizesPtr Vma::summary_sizes()
+{
+    return _summary_sizes;
+}
+
+
     
-void Vma::add_pages(const list<Page> &pages)
+size_t Vma::add_pages(Address start, const Page *pages, size_t count)
+{
+    // Any totals are out of date now
+    _totals.clear();
+    _extent_ordinals.clear();
+
+    unsigned long pgnum;
+    if (!addr_to_pgnum(start, pgnum)) {
+	warn << "Vma::add_pages - pages not within vma " << to_string() << "\n";
+	return 0;
+    }
+    if (!_extents.empty()) {
+	const PageExtent &last = _extents.back();
+	if (pgnum < last.pgnum + last.count) {
+	    warn << "Vma::add_pages - pages added out of order "
+		 << to_string() << "\n";
+	    return 0;
+	}
+    }
+
+    const unsigned long vm_pages = vm_size() / Elf::page_size();
+    if (count > vm_pages - pgnum) {
+	warn << "Vma::add_pages - more pages than vma " << to_string() << "\n";
+	count = vm_pages - pgnum;
+    }
+    for (size_t i = 0; i < count; ++i, ++pgnum) {
+	if (pages[i].is_mapped()) {
+	    append_page(pgnum, pages[i]);
+	}
+    }
+    return count;
+}
+
+// Consecutive cookies are only worth a contiguous extent (an extent
+// and a page) once there are this many of them
+static const unsigned long MIN_CONTIGUOUS_RUN = 8;
+
+void Vma::append_page(unsigned long pgnum, const Page &page)
 {
-    list<Page>::const_iterator it;
-    for (it = pages.begin(); it != pages.end(); ++it) {
-	_pages.push_back(*it);
+    bool adjacent = !_extents.empty()
+	&& _extents.back().pgnum + _extents.back().count == pgnum;
+
+    if (adjacent && _extents.back().contiguous) {
+	PageExtent &last = _extents.back();
+	if (page.follows(_pages[last.index].offset_by(last.count - 1))) {
+	    last.count++;
+	    return;
+	}
     }
+    else if (adjacent) {
+	PageExtent &last = _extents.back();
+	_pages.push_back(page);
+	last.count++;
+
+	// Turn the tail of the extent into a contiguous extent once it
+	// is a long enough run
+	if (last.count < MIN_CONTIGUOUS_RUN) {
+	    return;
+	}
+	size_t end = _pages.size();
+	for (size_t i = end - MIN_CONTIGUOUS_RUN + 1; i < end; ++i) {
+	    if (!_pages[i].follows(_pages[i - 1])) {
+		return;
+	    }
+	}
+	Page first = _pages[end - MIN_CONTIGUOUS_RUN];
+	_pages.erase(_pages.end() - MIN_CONTIGUOUS_RUN, _pages.end());
+	last.count -= MIN_CONTIGUOUS_RUN;
+	if (last.count == 0) {
+	    _extents.pop_back();
+	}
+
+	PageExtent ext;
+	ext.pgnum = pgnum + 1 - MIN_CONTIGUOUS_RUN;
+	ext.count = MIN_CONTIGUOUS_RUN;
+	ext.contiguous = true;
+	ext.index = _pages.size();
+	_extents.push_back(ext);
+	_pages.push_back(first);
+	return;
+    }
+
+    PageExtent ext;
+    ext.pgnum = pgnum;
+    ext.count = 1;
+    ext.contiguous = false;
+    ext.index = _pages.size();
+    _extents.push_back(ext);
+    _pages.push_back(page);
 }
 
 bool Vma::is_ignorable()
@@ -466,17 +1308,18 @@ bool Vma::is_ignorable()
 
 bool Vma::is_file_backed()
 {
-    string::size_type pos = _fname.length();
+    const string &name = fname();
+    string::size_type pos = name.length();
     if (pos == 0) {
 	warn << "Zero length file name in vma\n";
 	return false;
     }
     // Names like [vdso], [anon], [stack] etc
-    return !(_fname[0] == '[' && _fname[pos-1] == ']');
+    return !(name[0] == '[' && name[pos-1] == ']');
 }
 
 
-bool Vma::addr_to_pgnum(Address addr, unsigned int &pgnum)
+bool Vma::addr_to_pgnum(Address addr, unsigned long &pgnum)
 {
     if (addr > end()) {
 	warn << hex << addr << " is beyond vma end " << end() << dec << "\n";
@@ -493,28 +1336,31 @@ bool Vma::addr_to_pgnum(Address addr, unsigned int &pgnum)
     return true;
 }
 
-bool Vma::get_pages_for_range(const RangePtr &mrange,
-			      std::list<PartialPageInfo> &ppinfo)
+bool Vma::_check_ranges = getenv("EXMAP_CHECK_RANGES") != NULL;
+
+void Vma::set_check_ranges(bool check)
 {
-    ppinfo.clear();
-    
-    if (mrange->size() <= 0) {
-	warn << "Vma::get_pages_for_range - invalid range\n";
+    _check_ranges = check;
+}
+
+bool Vma::valid_range(const Range &mrange)
+{
+    if (mrange.size() <= 0) {
+	warn << "Vma::visit_pages - invalid range\n";
 	return false;
     }
-    if (!range()->contains(mrange)) {
-	warn << "Vma::get_pages_for_range - range "
-	    << mrange->to_string() << " outside vma " << to_string() << "\n";
+    if (!_range->contains(mrange)) {
+	warn << "Vma::visit_pages - range "
+	    << mrange.to_string() << " outside vma " << to_string() << "\n";
 	return false;
     }
-
-    unsigned int start_pgnum, end_pgnum;
-    if (!addr_to_pgnum(mrange->start(), start_pgnum)) {
-	warn << "Vma::get_pages_for_range - can't get start pgnum\n";
+    unsigned long start_pgnum, end_pgnum;
+    if (!addr_to_pgnum(mrange.start(), start_pgnum)) {
+	warn << "Vma::visit_pages - can't get start pgnum\n";
 	return false;
     }
-    if (!addr_to_pgnum(mrange->end() - 1, end_pgnum)) {
-	warn << "Vma::get_pages_for_range - can't get end pgnum\n";
+    if (!addr_to_pgnum(mrange.end() - 1, end_pgnum)) {
+	warn << "Vma::visit_pages - can't get end pgnum\n";
 	return false;
     }
     if (start_pgnum > end_pgnum) {
@@ -522,137 +1368,370 @@ bool Vma::get_pages_for_range(const RangePtr &mrange,
 	     << start_pgnum << ", " << end_pgnum << "\n";
 	return false;
     }
-    if (start_pgnum >= _pages.size()) {
-	warn << "Vma::get_pages_for_range - start pgnum out of range: "
-	     << start_pgnum << ", " << _pages.size() << " " << _fname << "\n";
-	return false;
-    }
-    if (end_pgnum >= _pages.size()) {
-	warn << "Vma::get_pages_for_range - end pgnum out of range: "
-	     << end_pgnum << ", " << _pages.size() << "\n";
+    return true;
+}
+
+bool Vma::visit_pages(const Range &mrange, PageVisitor &visitor)
+{
+    if (_check_ranges && !valid_range(mrange)) {
 	return false;
     }
-
-    if (start_pgnum == end_pgnum) {
-	ppinfo.push_back(PartialPageInfo(_pages[start_pgnum], mrange->size()));
+    if (mrange.size() == 0) {
 	return true;
     }
 
-    Address bytes = Elf::page_size()
-	- (mrange->start() - Elf::page_align_down(mrange->start()));
-    ppinfo.push_back(PartialPageInfo(_pages[start_pgnum], bytes));
+    const Address page_size = Elf::page_size();
+    unsigned long pgnum = (mrange.start() - start()) / page_size;
+    unsigned long end_pgnum = (mrange.end() - start()) / page_size;
+    Address head = mrange.start() % page_size;
+    Address tail = mrange.end() % page_size;
 
-    bytes = mrange->end() - Elf::page_align_down(mrange->end() - 1);
-    if (bytes > 0) {
-	ppinfo.push_back(PartialPageInfo(_pages[end_pgnum], bytes));
+    if (head != 0) {
+	if (pgnum == end_pgnum) {
+	    // All within one page
+	    visitor.partial_page(pgnum_to_page(pgnum), mrange.size());
+	    return true;
+	}
+	visitor.partial_page(pgnum_to_page(pgnum), page_size - head);
+	++pgnum;
     }
 
-    bytes = Elf::page_size();
-    for (unsigned int pgnum = start_pgnum + 1; pgnum < end_pgnum; ++pgnum) {
-	ppinfo.push_back(PartialPageInfo(_pages[pgnum], bytes));
+    // Find the first extent which ends after pgnum
+    size_t lo = 0, hi = _extents.size();
+    while (lo < hi) {
+	size_t mid = (lo + hi) / 2;
+	if (_extents[mid].pgnum + _extents[mid].count <= pgnum) {
+	    lo = mid + 1;
+	}
+	else {
+	    hi = mid;
+	}
+    }
+    for (size_t i = lo; i < _extents.size() && pgnum < end_pgnum; ++i) {
+	const PageExtent &ext = _extents[i];
+	if (ext.pgnum >= end_pgnum) {
+	    break;
+	}
+	if (ext.pgnum > pgnum) {
+	    visitor.unmapped_pages(ext.pgnum - pgnum);
+	    pgnum = ext.pgnum;
+	}
+	unsigned long offset = pgnum - ext.pgnum;
+	unsigned long ext_end = ext.pgnum + ext.count;
+	unsigned long count = (ext_end < end_pgnum ? ext_end : end_pgnum) - pgnum;
+	if (ext.contiguous) {
+	    visitor.contiguous_pages(_pages[ext.index].offset_by(offset), count);
+	}
+	else {
+	    visitor.whole_pages(&_pages[ext.index + offset], count);
+	}
+	pgnum += count;
+    }
+    if (pgnum < end_pgnum) {
+	visitor.unmapped_pages(end_pgnum - pgnum);
     }
 
+    if (tail != 0) {
+	visitor.partial_page(pgnum_to_page(end_pgnum), tail);
+    }
     return true;
 }
-	
 
-string Vma::to_string() const
-{
-    stringstream sstr;
-    sstr << hex;
-    sstr << _range << ": " << _offset << " " << _fname;
-    return sstr.str();
+void Vma::calc_totals(const PagePoolPtr &pp)
+{
+    PageTotals running = { 0, 0, 0, 0, 0, 0 };
+    _totals.clear();
+    _totals.reserve(num_pages() + 1);
+    _totals.push_back(running);
+    _extent_ordinals.clear();
+    _extent_ordinals.reserve(_extents.size());
+
+    vector<PageExtent>::const_iterator it;
+    for (it = _extents.begin(); it != _extents.end(); ++it) {
+	_extent_ordinals.push_back(_totals.size() - 1);
+	for (unsigned long i = 0; i < it->count; ++i) {
+	    Page page = it->contiguous
+		? _pages[it->index].offset_by(i)
+		: _pages[it->index + i];
+	    int count = pp->count(page);
+	    // Matches add_page_sizes, which skips bad counts
+	    if (count > 0) {
+		running.mapped++;
+		running.effective_mapped += 1.0 / count;
+		if (count == 1) {
+		    running.sole_mapped++;
+		}
+		if (page.is_resident()) {
+		    running.resident++;
+		    running.effective_resident += 1.0 / count;
+		    if (page.is_writable()) {
+			running.writable++;
+		    }
+		}
+	    }
+	    _totals.push_back(running);
+	}
+    }
 }
 
-
-
-// ------------------------------------------------------------
-
-    Page::Page(PageCookie cookie, bool resident, bool writable)
-: _cookie(cookie), _resident(resident), _writable(writable)
-{ }
-
-PageCookie Page::cookie() const
+unsigned long Vma::mapped_pages_before(unsigned long pgnum)
 {
-    return _cookie;
+    // Find the last extent starting before pgnum
+    size_t lo = 0, hi = _extents.size();
+    while (lo < hi) {
+	size_t mid = (lo + hi) / 2;
+	if (_extents[mid].pgnum < pgnum) {
+	    lo = mid + 1;
+	}
+	else {
+	    hi = mid;
+	}
+    }
+    if (lo == 0) {
+	return 0;
+    }
+    const PageExtent &ext = _extents[lo - 1];
+    unsigned long in_ext = pgnum - ext.pgnum;
+    if (in_ext > ext.count) {
+	in_ext = ext.count;
+    }
+    return _extent_ordinals[lo - 1] + in_ext;
 }
 
-bool Page::is_mapped() const
+/// Add amount to the WHICH measure if it is one of MEASURES. Both
+/// are constants, so the measures nobody asked for cost nothing.
+template <unsigned MEASURES, Sizes::Measure WHICH>
+static inline void add_measure(Sizes &sizes, double amount)
 {
-    return _cookie != 0;
+    if (MEASURES & (1 << WHICH)) {
+	sizes.increase(WHICH, amount);
+    }
 }
 
-bool Page::is_resident() const
+/// Add bytes worth of one page to sizes
+template <unsigned MEASURES>
+static void add_page_sizes(const PagePoolPtr &pp,
+			   const Page &page,
+			   Address bytes,
+			   Sizes &sizes)
 {
-    return _resident;
-}
+    // Unmapped pages aren't counted in the page pool
+    if (!page.is_mapped()) {
+	return;
+    }
+    // Without any counted measures, a mapped page is taken as counted
+    int count = 1;
+    if (MEASURES & Sizes::COUNTED_MEASURES) {
+	count = pp->count(page);
+	if (count <= 0) {
+	    warn << "Invalid count for page\n";
+	    return;
+	}
+    }
 
-bool Page::is_writable() const
-{
-    return _writable;
+    add_measure<MEASURES, Sizes::MAPPED>(sizes, bytes);
+    add_measure<MEASURES, Sizes::EFFECTIVE_MAPPED>(sizes,
+						   (double) bytes / count);
+    if (count == 1) {
+	add_measure<MEASURES, Sizes::SOLE_MAPPED>(sizes, bytes);
+    }
+    if (page.is_resident()) {
+	add_measure<MEASURES, Sizes::RESIDENT>(sizes, bytes);
+	add_measure<MEASURES, Sizes::EFFECTIVE_RESIDENT>(sizes,
+							 (double) bytes
+							 / count);
+	if (page.is_writable()) {
+	    add_measure<MEASURES, Sizes::WRITABLE>(sizes, bytes);
+	}
+    }
 }
 
-void Page::print(ostream &os) const
+/// Adds up the MEASURES of the pages it visits. Whole pages go
+/// through the SizesKernel a chunk at a time, the partial ones one by
+/// one. The whole page sizes reach the Sizes on flush().
+template <unsigned MEASURES>
+class SizesVisitor : public PageVisitor
 {
-    os << "(" << _cookie << ":" << _resident << ":" << _writable << ")";
-}
+public:
+    SizesVisitor(const PagePoolPtr &pp, Sizes &sizes)
+	: _pp(pp), _sizes(sizes), _num_invalid(0) { }
+    void partial_page(const Page &page, Address bytes)
+    {
+	add_page_sizes<MEASURES>(_pp, page, bytes, _sizes);
+    }
+    void whole_pages(const Page *pages, size_t count)
+    {
+	if (!(MEASURES & Sizes::COUNTED_MEASURES)) {
+	    add_flags(pages, count);
+	    return;
+	}
+	while (count > 0) {
+	    size_t n = std::min(count, CHUNK);
+	    _num_invalid += _pp->counts(pages, n, _counts);
+	    SizesKernel::add(pages, _counts, n, _span);
+	    pages += n;
+	    count -= n;
+	}
+    }
+    void contiguous_pages(const Page &first, size_t count)
+    {
+	for (size_t done = 0; done < count; done += CHUNK) {
+	    size_t n = std::min(count - done, CHUNK);
+	    for (size_t i = 0; i < n; ++i) {
+		_pages[i] = first.offset_by(done + i);
+	    }
+	    whole_pages(_pages, n);
+	}
+    }
+    void flush()
+    {
+	if (_num_invalid > 0) {
+	    warn << "Invalid count for " << _num_invalid << " pages\n";
+	}
+	_span.add_to(_sizes, Elf::page_size(), MEASURES);
+	_span = SpanSizes();
+	_num_invalid = 0;
+    }
+private:
+    /// Only the flag measures are wanted, so skip the count lookups
+    void add_flags(const Page *pages, size_t count)
+    {
+	for (size_t i = 0; i < count; ++i) {
+	    if (pages[i].is_mapped() && pages[i].is_resident()) {
+		_span.resident++;
+		if (pages[i].is_writable()) {
+		    _span.writable++;
+		}
+	    }
+	}
+    }
+    static const size_t CHUNK = 256;
+    const PagePoolPtr &_pp;
+    Sizes &_sizes;
+    SpanSizes _span;
+    size_t _num_invalid;
+    int32_t _counts[CHUNK];
+    Page _pages[CHUNK];
+};
 
-// ------------------------------------------------------------
+template <unsigned MEASURES>
+const size_t SizesVisitor<MEASURES>::CHUNK;
 
-Sizes::Sizes()
+template <unsigned MEASURES>
+bool Vma::add_range_sizes(const PagePoolPtr &pp,
+			  const Range &mrange,
+			  Sizes &sizes)
 {
-    for (int i = 0; i < NUM_SIZES; ++i) {
-	_values[i] = 0.0;
+    if (mrange.size() == 0) {
+	return true;
+    }
+    if (!_range->contains(mrange)) {
+	warn << "Vma::add_range_sizes - range "
+	    << mrange.to_string() << " outside vma " << to_string() << "\n";
+	return false;
+    }
+    unsigned long start_pgnum, end_pgnum;
+    if (!addr_to_pgnum(mrange.start(), start_pgnum)
+	|| !addr_to_pgnum(mrange.end() - 1, end_pgnum)) {
+	warn << "Vma::add_range_sizes - can't get pgnums\n";
+	return false;
+    }
+    add_measure<MEASURES, Sizes::VM>(sizes, mrange.size());
+    if (!(MEASURES & Sizes::PAGE_MEASURES)) {
+	return true;
     }
-}
 
-double Sizes::val(int which)
-{
-    return _values[which];
+    // Sizing a whole vma visits each page once anyway, so there is
+    // no point building the totals for it
+    if (_totals.empty() && mrange == *_range) {
+	SizesVisitor<MEASURES> visitor(pp, sizes);
+	bool worked = visit_pages(mrange, visitor);
+	visitor.flush();
+	return worked;
+    }
+    if (_totals.empty()) {
+	calc_totals(pp);
+    }
+
+    if (start_pgnum == end_pgnum) {
+	add_page_sizes<MEASURES>(pp, pgnum_to_page(start_pgnum),
+				 mrange.size(), sizes);
+	return true;
+    }
+
+    // The partial pages at each end...
+    Address page_size = Elf::page_size();
+    Address bytes = page_size
+	- (mrange.start() - Elf::page_align_down(mrange.start()));
+    add_page_sizes<MEASURES>(pp, pgnum_to_page(start_pgnum), bytes, sizes);
+    bytes = mrange.end() - Elf::page_align_down(mrange.end() - 1);
+    add_page_sizes<MEASURES>(pp, pgnum_to_page(end_pgnum), bytes, sizes);
+
+    // ...and the whole pages between them
+    const PageTotals &lo = _totals[mapped_pages_before(start_pgnum + 1)];
+    const PageTotals &hi = _totals[mapped_pages_before(end_pgnum)];
+    add_measure<MEASURES, Sizes::MAPPED>(
+	sizes, (double) (hi.mapped - lo.mapped) * page_size);
+    add_measure<MEASURES, Sizes::EFFECTIVE_MAPPED>(
+	sizes, (hi.effective_mapped - lo.effective_mapped) * page_size);
+    add_measure<MEASURES, Sizes::SOLE_MAPPED>(
+	sizes, (double) (hi.sole_mapped - lo.sole_mapped) * page_size);
+    add_measure<MEASURES, Sizes::RESIDENT>(
+	sizes, (double) (hi.resident - lo.resident) * page_size);
+    add_measure<MEASURES, Sizes::EFFECTIVE_RESIDENT>(
+	sizes, (hi.effective_resident - lo.effective_resident) * page_size);
+    add_measure<MEASURES, Sizes::WRITABLE>(
+	sizes, (double) (hi.writable - lo.writable) * page_size);
+    return true;
 }
 
-double Sizes::sval(int which)
+string Vma::to_string() const
 {
-    return _values[which] / (double)_scale_factor;
+    stringstream sstr;
+    sstr << hex;
+    sstr << _range << ": " << _offset << " " << *_fname;
+    return sstr.str();
 }
 
-void Sizes::increase(enum Measure which, double amount)
+
+
+// ------------------------------------------------------------
+
+const int Page::COOKIE_BITS;
+const uint64_t Page::COOKIE_MASK;
+const uint64_t Page::RESIDENT_FLAG;
+const uint64_t Page::WRITABLE_FLAG;
+
+void Page::print(ostream &os) const
 {
-    _values[which] += amount;
+    os << "(" << cookie() << ":" << is_resident()
+       << ":" << is_writable() << ")";
 }
 
-void Sizes::add(const SizesPtr &other)
+// ------------------------------------------------------------
+
+Sizes::Sizes()
 {
     for (int i = 0; i < NUM_SIZES; ++i) {
-	_values[i] += other->_values[i];
+	_values[i] = 0.0;
     }
 }
 
-string Sizes::size_name(int which)
+void Sizes::add(const Sizes &other)
 {
-    string name = names[which];
-    if (!_scale_name.empty()) {
-	name += " (" + _scale_name + ")";
+    for (int i = 0; i < NUM_SIZES; ++i) {
+	_values[i] += other._values[i];
     }
-    return name;
 }
 
-void Sizes::scale_units()
-{
-    _scale_factor = 1;
-    _scale_name = "";
-}
-
-void Sizes::scale_kbytes()
+void Sizes::add(const SizesPtr &other)
 {
-    _scale_factor = 1024;
-    _scale_name = "K";
+    add(*other);
 }
 
-void Sizes::scale_mbytes()
+string Sizes::size_name(int which)
 {
-    _scale_factor = 1024 * 1024;
-    _scale_name = "M";
+    return names[which];
 }
 
 const string Sizes::names[] = {
@@ -666,30 +1745,84 @@ const string Sizes::names[] = {
     "Num Sizes"
 };
 
-int Sizes::_scale_factor = 1;
-string Sizes::_scale_name;
+// ------------------------------------------------------------
+
+SizeUnits::SizeUnits()
+    : _factor(1)
+{ }
+
+SizeUnits::SizeUnits(double factor, const string &name)
+    : _factor(factor), _name(name)
+{ }
+
+SizeUnits SizeUnits::bytes()
+{
+    return SizeUnits();
+}
+
+SizeUnits SizeUnits::kbytes()
+{
+    return SizeUnits(1024, "K");
+}
+
+SizeUnits SizeUnits::mbytes()
+{
+    return SizeUnits(1024 * 1024, "M");
+}
+
+string SizeUnits::size_name(int which) const
+{
+    string name = Sizes::size_name(which);
+    if (!_name.empty()) {
+	name += " (" + _name + ")";
+    }
+    return name;
+}
 
 // ------------------------------------------------------------
 
 File::File(const string &fname)
+    : _fname(new string(fname))
+{
+    load_elf();
+}
+
+File::File(const NamePtr &fname)
     : _fname(fname)
 {
-    if (file_exists(fname)) {
+    load_elf();
+}
+
+void File::load_elf()
+{
+    if (file_exists(*_fname)) {
 	_elf.reset(new Elf::File);
-	if (!_elf->load(_fname, false)) {
+	if (!_elf->load(*_fname, false)) {
 	    _elf.reset((Elf::File *) 0);
 	}
     }
 }
 
 string File::name()
+{
+    return *_fname;
+}
+
+const NamePtr &File::shared_name()
 {
     return _fname;
 }
 
 list<ProcessPtr> File::procs()
 {
-    list<ProcessPtr> result(_procs.begin(), _procs.end());
+    list<ProcessPtr> result;
+    map<pid_t, boost::weak_ptr<Process> >::iterator it;
+    for (it = _procs.begin(); it != _procs.end(); ++it) {
+	ProcessPtr proc = it->second.lock();
+	if (proc) {
+	    result.push_back(proc);
+	}
+    }
     return result;
 }
 
@@ -703,23 +1836,38 @@ bool File::is_elf()
     return _elf != 0;
 }
 
-list<MapPtr> File::maps()
+const list<MapPtr> &File::maps()
 {
     return _maps;
 }
 
+const list<MapPtr> &File::maps(pid_t pid)
+{
+    static const list<MapPtr> no_maps;
+    map<pid_t, list<MapPtr> >::const_iterator it = _proc_maps.find(pid);
+    return it == _proc_maps.end() ? no_maps : it->second;
+}
+
 SizesPtr File::sizes()
 {
-    if (_procs.empty()) {
-	warn << "File::sizes - no processes for file " << name() << "\n";
+    SizesPtr sizes(new Sizes);
+    if (!add_sizes<Sizes::ALL_MEASURES>(*sizes)) {
 	SizesPtr null_sizes;
 	return null_sizes;
     }
-    // std::set doesn't have .front
-    ProcessPtr proc = *(_procs.begin());
-    // This goes over all procs (because of the _maps), the proc is
-    // we're only using the proc to get to the pagepool.
-    return Map::sum_sizes(proc->page_pool(), _maps);
+    return sizes;
+}
+
+template <unsigned MEASURES>
+bool File::add_sizes(Sizes &sizes)
+{
+    if (!_page_pool) {
+	warn << "File::sizes - no processes for file " << name() << "\n";
+	return false;
+    }
+    // This goes over all procs (because of the _maps)
+    Map::add_sum_sizes<MEASURES>(_page_pool, _maps, sizes);
+    return true;
 }
 
 SizesPtr File::sizes(const RangePtr &elf_range)
@@ -728,7 +1876,7 @@ SizesPtr File::sizes(const RangePtr &elf_range)
     stringstream pref;
     pref << "File::sizes " << name() << ": ";
 
-    if (_procs.empty()) {
+    if (!_page_pool) {
 	warn << pref.str() << "no processes for file\n";
 	return null_sizes;
     }
@@ -736,33 +1884,25 @@ SizesPtr File::sizes(const RangePtr &elf_range)
     SizesPtr totals(new Sizes);
     SizesPtr sizes;
 
-    set<ProcessPtr>::iterator proc_it;
-    list<MapPtr>::iterator map_it;
-    list<MapPtr> maps_for_proc;
-    RangePtr subrange, map_elf_range;
-    ProcessPtr firstproc = *(_procs.begin()); // set has no ->front()
-    PagePoolPtr page_pool = firstproc->page_pool();
+    map<pid_t, list<MapPtr> >::const_iterator proc_it;
+    list<MapPtr>::const_iterator map_it;
+    RangePtr map_elf_range;
+    Range subrange, mem_range;
 
     // We need to loop through the procs, because the mapping from
     // ELF virtual address to actual address can be different in each
-    for (proc_it = _procs.begin(); proc_it != _procs.end(); ++proc_it) {
-	maps_for_proc = Map::intersect_lists((*proc_it)->maps(),
-					     _maps);
-	if (maps_for_proc.empty()) {
-	    warn << pref.str() << "no maps for process "
-		<< (*proc_it)->pid() << "\n";
-	    return null_sizes;
-	}
-
+    for (proc_it = _proc_maps.begin();
+	 proc_it != _proc_maps.end();
+	 ++proc_it) {
+	const list<MapPtr> &maps_for_proc = proc_it->second;
 	for (map_it = maps_for_proc.begin();
 	     map_it != maps_for_proc.end();
 	     ++map_it) {
 	    map_elf_range = (*map_it)->elf_range();
 	    if (!map_elf_range) continue;
-	    subrange = map_elf_range->intersect(elf_range);
-	    if (!subrange) continue;
-	    RangePtr mem_range = (*map_it)->elf_to_mem_range(subrange);
-	    sizes = (*map_it)->sizes_for_mem_range(page_pool,
+	    if (!map_elf_range->intersect(*elf_range, subrange)) continue;
+	    if (!(*map_it)->elf_to_mem_range(subrange, mem_range)) continue;
+	    sizes = (*map_it)->sizes_for_mem_range(_page_pool,
 						   mem_range);
 	    if (sizes) {
 		totals->add(sizes);
@@ -773,19 +1913,44 @@ SizesPtr File::sizes(const RangePtr &elf_range)
     return totals;
 }
 
-void File::add_maps(const list<MapPtr> &maps)
+bool File::sizes(const vector<Range> &elf_ranges, vector<Sizes> &results)
+{
+    results.assign(elf_ranges.size(), Sizes());
+
+    if (!_page_pool) {
+	warn << "File::sizes " << name() << ": no processes for file\n";
+	return false;
+    }
+
+    // As for a single range, each process may map the file at a
+    // different address
+    ElfRangeSweep sweep(elf_ranges);
+    map<pid_t, list<MapPtr> >::const_iterator proc_it;
+    for (proc_it = _proc_maps.begin();
+	 proc_it != _proc_maps.end();
+	 ++proc_it) {
+	sweep.add_sizes(_page_pool, proc_it->second, results);
+    }
+    return true;
+}
+
+void File::add_maps(pid_t pid, const list<MapPtr> &maps)
 {
     _maps.insert(_maps.end(), maps.begin(), maps.end());
+    list<MapPtr> &proc_maps = _proc_maps[pid];
+    proc_maps.insert(proc_maps.end(), maps.begin(), maps.end());
 }
 
-void File::add_map(const MapPtr &map)
+void File::add_map(pid_t pid, const MapPtr &map)
 {
     _maps.push_back(map);
+    _proc_maps[pid].push_back(map);
 }
 
 void File::add_proc(const ProcessPtr &proc)
 {
-    _procs.insert(proc);
+    _procs[proc->pid()] = proc;
+    _page_pool = proc->page_pool();
 }
 
 // ------------------------------------------------------------
@@ -820,14 +1985,24 @@ Address Map::elf_to_mem_offset()
 
 
 RangePtr Map::elf_to_mem_range(const RangePtr &elf_range)
+{
+    Range mem_range;
+    if (!elf_range || !elf_to_mem_range(*elf_range, mem_range)) {
+	return RangePtr((Range *) 0);
+    }
+    return RangePtr(new Range(mem_range));
+}
+
+bool Map::elf_to_mem_range(const Range &elf_range, Range &mem_range)
 {
     if (!_elf_range->contains(elf_range)) {
-	warn << "Range " << elf_range->to_string()
+	warn << "Range " << elf_range.to_string()
 	     << " not contained within " << _elf_range->to_string() << "\n";
-	return RangePtr((Range *) 0);
+	return false;
     }
 
-    return elf_range->add(elf_to_mem_offset());
+    mem_range = elf_range.shifted(elf_to_mem_offset());
+    return true;
 }
 
 string Map::to_string() const
@@ -842,140 +2017,438 @@ string Map::to_string() const
 
 SizesPtr Map::sizes_for_mem_range(const PagePoolPtr &pp)
 {
-    return sizes_for_mem_range(pp, _mem_range);
+    return sizes_for_mem_range(pp, *_mem_range);
 }
 
 SizesPtr Map::sizes_for_mem_range(const PagePoolPtr &pp,
 				  const RangePtr &mrange)
 {
-    SizesPtr null_sizes;
+    return sizes_for_mem_range(pp, *mrange);
+}
+
+SizesPtr Map::sizes_for_mem_range(const PagePoolPtr &pp,
+				  const Range &mrange)
+{
     SizesPtr sizes(new Sizes);
+    if (!add_sizes_for_mem_range(pp, mrange, *sizes)) {
+	SizesPtr null_sizes;
+	return null_sizes;
+    }
+    return sizes;
+}
 
-    if (!_mem_range->contains(mrange)) {
-	warn << "Non-overlapping range: " << *mrange
+template <unsigned MEASURES>
+bool Map::add_sizes_for_mem_range(const PagePoolPtr &pp,
+				  const Range &mrange,
+				  Sizes &sizes)
+{
+    Range subrange;
+    if (!_mem_range->contains(mrange)
+	|| !_mem_range->intersect(mrange, subrange)) {
+	warn << "Non-overlapping range: " << mrange
 	     << " not within " << _mem_range << "\n";
-	return null_sizes;
+	return false;
+    }
+
+    if (subrange.size() == 0) { return true; }
+
+    SizesPtr vma_sizes = _vma->summary_sizes();
+    if (vma_sizes) {
+	// Summary snapshots only know the totals for the vma, so we
+	// share them out by size. Summary maps cover whole vmas, so
+	// this is only approximate for ranges within a vma.
+	double frac = (double) subrange.size() / _vma->vm_size();
+	for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
+	    if (MEASURES & (1 << i)) {
+		sizes.increase((Sizes::Measure) i, vma_sizes->val(i) * frac);
+	    }
+	}
+	return true;
     }
     
-    RangePtr subrange = _mem_range->intersect(*mrange);
+    if (!_vma->add_range_sizes<MEASURES>(pp, subrange, sizes)) {
+	warn << "sizes_for_mem_range: Can't get sizes for range "
+	    << subrange.to_string() << "\n";
+	return false;
+    }
+
+    return true;
+}
+
+void Map::print(std::ostream &os) const
+{
+    os << to_string();
+}
+
+SizesPtr Map::sum_sizes(const PagePoolPtr &pp,
+			const list<MapPtr> &maps)
+{
+    SizesPtr sizes(new Sizes);
+    add_sum_sizes<Sizes::ALL_MEASURES>(pp, maps, *sizes);
+    return sizes;
+}
 
-    if (subrange->size() == 0) { return sizes; }
+template <unsigned MEASURES>
+void Map::add_sum_sizes(const PagePoolPtr &pp,
+			const list<MapPtr> &maps,
+			Sizes &sizes)
+{
+    // A map which fails adds nothing, rather than what it had got to
+    Sizes subsizes;
+    list<MapPtr>::const_iterator map_it;
+    for (map_it = maps.begin(); map_it != maps.end(); ++map_it) {
+	subsizes = Sizes();
+	if ((*map_it)->add_sizes_for_mem_range<MEASURES>(pp,
+							 *(*map_it)->_mem_range,
+							 subsizes)) {
+	    sizes.add(subsizes);
+	}
+    }
+}
+
+// The measure sets the sizing templates are built for
+#define INSTANTIATE_SIZES(MEASURES)					\
+    template bool Vma::add_range_sizes<MEASURES>(const PagePoolPtr &,	\
+						 const Range &,		\
+						 Sizes &);		\
+    template bool Map::add_sizes_for_mem_range<MEASURES>(		\
+	const PagePoolPtr &, const Range &, Sizes &);			\
+    template void Map::add_sum_sizes<MEASURES>(const PagePoolPtr &,	\
+					       const list<MapPtr> &,	\
+					       Sizes &);		\
+    template void Process::add_sizes<MEASURES>(Sizes &);		\
+    template void Process::add_sizes<MEASURES>(const FilePtr &,	\
+					       Sizes &);		\
+    template bool File::add_sizes<MEASURES>(Sizes &);
+
+INSTANTIATE_SIZES(Sizes::ALL_MEASURES)
+INSTANTIATE_SIZES(Sizes::EFFECTIVE_RESIDENT_BIT)
+
+list<MapPtr> Map::intersect_lists(const list<MapPtr> &a_arg,
+				  const list<MapPtr> &b_arg)
+{
+    list<MapPtr> a(a_arg), b(b_arg), result;
+
+    a.sort();
+    b.sort();
     
-    std::list<Vma::PartialPageInfo> ppi_info;
-    if (!_vma->get_pages_for_range(subrange, ppi_info)) {
-	warn << "sizes_for_mem_range: Can't get pages for range "
-	    << subrange->to_string() << "\n";
-	return null_sizes;
+    while (!a.empty() && !b.empty()) {
+	if (a.front() == b.front()) {
+	    result.push_back(b.front());
+	    b.pop_front();
+	    a.pop_front();
+	}
+	else if (a.front() < b.front()) {
+	    a.pop_front();
+	}
+	else {
+	    b.pop_front();
+	}
     }
 
-    std::list<Vma::PartialPageInfo>::iterator it;
+    return result;
+}
 
-    for (it = ppi_info.begin(); it != ppi_info.end(); ++it) {
-	Page &page = (*it).page;
-	int count = pp->count((*it).page);
-	int bytes = (*it).bytes;
+static bool mapptr_is_less_than(const MapPtr &lhs, const MapPtr &rhs)
+{
+    return lhs->mem_range()->start() < rhs->mem_range()->start();
+}
 
-//	dbg << "page: " << hex << page.cookie() << dec
-//	    << " count " << count << " bytes " << bytes << "\n";
-	if (count <= 0) {
-	    warn << "Invalid count for page\n";
+list<MapPtr> Map::sort(const list<MapPtr> &maplist)
+{
+    list<MapPtr> result(maplist);
+    result.sort(mapptr_is_less_than);
+    return result;
+}
+
+// ------------------------------------------------------------
+
+// Initial size of the MapsScanner buffer, grown as needed
+static const size_t MAPS_BUFSIZE = 64 * 1024;
+
+MapsScanner::MapsScanner()
+    : _len(0), _pos(0)
+{ }
+
+bool MapsScanner::load(const string &fname)
+{
+    _len = 0;
+    _pos = 0;
+
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+	return false;
+    }
+
+    if (_buf.empty()) {
+	_buf.resize(MAPS_BUFSIZE);
+    }
+    // /proc files have no size, so read until EOF. With a big enough
+    // buffer this is a single read.
+    while (true) {
+	if (_len == _buf.size()) {
+	    _buf.resize(_buf.size() * 2);
+	}
+	ssize_t got = read(fd, &_buf[_len], _buf.size() - _len);
+	if (got < 0 && errno == EINTR) {
 	    continue;
 	}
+	if (got < 0) {
+	    close(fd);
+	    return false;
+	}
+	if (got == 0) {
+	    break;
+	}
+	_len += got;
+    }
+
+    close(fd);
+    return true;
+}
+
+void MapsScanner::set_text(const char *text, size_t len)
+{
+    _buf.assign(text, text + len);
+    _len = len;
+    _pos = 0;
+}
+
+static inline bool scan_hex(const char *&p, const char *end,
+			    unsigned long &val)
+{
+    const char *start = p;
+    val = 0;
+    for (; p < end; ++p) {
+	unsigned int digit;
+	if (*p >= '0' && *p <= '9') {
+	    digit = *p - '0';
+	}
+	else if (*p >= 'a' && *p <= 'f') {
+	    digit = *p - 'a' + 10;
+	}
+	else if (*p >= 'A' && *p <= 'F') {
+	    digit = *p - 'A' + 10;
+	}
+	else {
+	    break;
+	}
+	val = (val << 4) | digit;
+    }
+    return p != start;
+}
+
+static inline bool scan_dec(const char *&p, const char *end,
+			    unsigned long &val)
+{
+    const char *start = p;
+    val = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+	val = val * 10 + (*p - '0');
+    }
+    return p != start;
+}
+
+static inline bool scan_char(const char *&p, const char *end, char c)
+{
+    if (p < end && *p == c) {
+	++p;
+	return true;
+    }
+    return false;
+}
 
-	sizes->increase(Sizes::VM, bytes);
+// Lines look like:
+// 08047000-08070000 r-xp 00000000 16:0a 29616899   /bin/ls
+// The name may contain spaces (e.g. " (deleted)"), or be missing.
+static bool parse_maps_line(const char *p, const char *end, MapsLine &line)
+{
+    unsigned long offset, major, minor, inode;
 
-	if (page.is_mapped()) {
-	    sizes->increase(Sizes::MAPPED, bytes);
-	    sizes->increase(Sizes::EFFECTIVE_MAPPED, (double) bytes / count);
-	    if (count == 1) {
-		sizes->increase(Sizes::SOLE_MAPPED, bytes);
-	    }
+    if (!scan_hex(p, end, line.start)
+	|| !scan_char(p, end, '-')
+	|| !scan_hex(p, end, line.end)
+	|| !scan_char(p, end, ' ')
+	|| end - p < 4) {
+	return false;
+    }
 
-	    if (page.is_resident()) {
-		sizes->increase(Sizes::RESIDENT, bytes);
-		sizes->increase(Sizes::EFFECTIVE_RESIDENT, (double) bytes / count);
+    line.perms = 0;
+    if (p[0] == 'r') { line.perms |= Vma::PERM_READ; }
+    if (p[1] == 'w') { line.perms |= Vma::PERM_WRITE; }
+    if (p[2] == 'x') { line.perms |= Vma::PERM_EXEC; }
+    if (p[3] == 's') { line.perms |= Vma::PERM_SHARED; }
+    p += 4;
+
+    if (!scan_char(p, end, ' ')
+	|| !scan_hex(p, end, offset)
+	|| !scan_char(p, end, ' ')
+	|| !scan_hex(p, end, major)
+	|| !scan_char(p, end, ':')
+	|| !scan_hex(p, end, minor)
+	|| !scan_char(p, end, ' ')
+	|| !scan_dec(p, end, inode)) {
+	return false;
+    }
+    line.offset = offset;
+    line.dev = makedev(major, minor);
+    line.inode = inode;
 
-		if (page.is_writable()) {
-		    sizes->increase(Sizes::WRITABLE, bytes);
-		}
-	    }
-	}
+    while (p < end && isspace(*p)) {
+	++p;
     }
-    
-    if (sizes->val(Sizes::VM) != subrange->size()) {
-	warn << "Size mismatch: vm size " << sizes->val(Sizes::VM)
-	     << " range " << subrange->to_string() << "\n";
-	return null_sizes;
+    while (end > p && isspace(end[-1])) {
+	--end;
     }
-
-    return sizes;
+    line.name = p;
+    line.name_len = end - p;
+    return true;
 }
 
-void Map::print(std::ostream &os) const
+bool MapsScanner::next_line(const char *&line, const char *&eol)
 {
-    os << to_string();
+    if (_pos >= _len) {
+	return false;
+    }
+    const char *bufend = &_buf[0] + _len;
+    line = &_buf[_pos];
+    eol = (const char *) memchr(line, '\n', bufend - line);
+    if (eol == NULL) {
+	eol = bufend;
+    }
+    _pos = (eol - &_buf[0]) + 1;
+    return true;
 }
 
-SizesPtr Map::sum_sizes(const PagePoolPtr &pp,
-			const list<MapPtr> &maps)
+bool MapsScanner::next(MapsLine &line)
 {
-    SizesPtr sizes(new Sizes);
-    list<MapPtr>::const_iterator map_it;
-    for (map_it = maps.begin(); map_it != maps.end(); ++map_it) {
-        SizesPtr subsizes = (*map_it)->sizes_for_mem_range(pp);
-        if (subsizes)
-        {
-            sizes->add(subsizes);
-        }
+    const char *p, *eol;
+    while (next_line(p, eol)) {
+	if (parse_maps_line(p, eol, line)) {
+	    return true;
+	}
+	if (eol != p) {
+	    warn << "MapsScanner - can't parse line: " << string(p, eol) << "\n";
+	}
     }
-    return sizes;
+    return false;
 }
 
-list<MapPtr> Map::intersect_lists(const list<MapPtr> &a_arg,
-				  const list<MapPtr> &b_arg)
-{
-    list<MapPtr> a(a_arg), b(b_arg), result;
+// The smaps fields we use, in the order the kernel writes them
+static const struct {
+    const char *name;
+    unsigned long SmapsEntry::*field;
+} smaps_fields[] = {
+    { "Rss", &SmapsEntry::rss },
+    { "Pss", &SmapsEntry::pss },
+    { "Private_Clean", &SmapsEntry::private_clean },
+    { "Private_Dirty", &SmapsEntry::private_dirty },
+    { "Anonymous", &SmapsEntry::anonymous },
+    { "Swap", &SmapsEntry::swap },
+    { "SwapPss", &SmapsEntry::swap_pss },
+    { NULL, NULL },
+};
 
-    a.sort();
-    b.sort();
-    
-    while (!a.empty() && !b.empty()) {
-	if (a.front() == b.front()) {
-	    result.push_back(b.front());
-	    b.pop_front();
-	    a.pop_front();
-	}
-	else if (a.front() < b.front()) {
-	    a.pop_front();
-	}
-	else {
-	    b.pop_front();
+// Field lines look like:
+// Private_Dirty:        12 kB
+static void parse_smaps_field(const char *p, const char *end,
+			      SmapsEntry &entry)
+{
+    const char *colon = (const char *) memchr(p, ':', end - p);
+    if (colon == NULL) {
+	return;
+    }
+    size_t name_len = colon - p;
+    for (int i = 0; smaps_fields[i].name != NULL; ++i) {
+	if (strlen(smaps_fields[i].name) == name_len
+	    && memcmp(smaps_fields[i].name, p, name_len) == 0) {
+	    const char *vp = colon + 1;
+	    while (vp < end && *vp == ' ') {
+		++vp;
+	    }
+	    unsigned long val;
+	    if (scan_dec(vp, end, val)) {
+		entry.*(smaps_fields[i].field) = val;
+	    }
+	    return;
 	}
     }
-
-    return result;
 }
 
-static bool mapptr_is_less_than(const MapPtr &lhs, const MapPtr &rhs)
+bool MapsScanner::next(SmapsEntry &entry)
 {
-    return lhs->mem_range()->start() < rhs->mem_range()->start();
+    if (!next(entry.line)) {
+	return false;
+    }
+    entry.rss = entry.pss = 0;
+    entry.private_clean = entry.private_dirty = 0;
+    entry.anonymous = entry.swap = entry.swap_pss = 0;
+
+    // Read fields up to the next vma's maps line
+    const char *p, *eol;
+    size_t line_pos = _pos;
+    while (next_line(p, eol)) {
+	MapsLine next_vma;
+	if (parse_maps_line(p, eol, next_vma)) {
+	    _pos = line_pos;
+	    break;
+	}
+	parse_smaps_field(p, eol, entry);
+	line_pos = _pos;
+    }
+    return true;
 }
 
-list<MapPtr> Map::sort(const list<MapPtr> &maplist)
+// ------------------------------------------------------------
+
+PageSink::~PageSink()
+{ }
+
+PageVisitor::~PageVisitor()
+{ }
+
+void PageVisitor::contiguous_pages(const Page &first, size_t count)
 {
-    list<MapPtr> result(maplist);
-    result.sort(mapptr_is_less_than);
-    return result;
+    for (size_t i = 0; i < count; ++i) {
+	Page page = first.offset_by(i);
+	whole_pages(&page, 1);
+    }
 }
 
-// ------------------------------------------------------------
+void PageVisitor::unmapped_pages(size_t count)
+{ }
 
 SysInfo::~SysInfo()
 { }
 
+void SysInfo::prune_names()
+{ }
+
+PageCookie SysInfo::max_pfn()
+{
+    return 0;
+}
+
+PageCookie SysInfo::mapped_pages()
+{
+    return 0;
+}
+
+bool SysInfo::is_thread_safe()
+{
+    // Play safe. In particular the kernel module remembers the pid we
+    // last wrote to it, so LinuxSysInfo must do one pid at a time.
+    return false;
+}
+
 LinuxSysInfo::~LinuxSysInfo()
 { }
 
+void LinuxSysInfo::prune_names()
+{
+    _names.prune();
+}
+
 const std::string LinuxSysInfo::EXMAP_FILE("/proc/exmap");
 
 list<pid_t> LinuxSysInfo::accessible_pids()
@@ -1014,11 +2487,9 @@ bool LinuxSysInfo::sanity_check()
     return true;
 }
 
-bool LinuxSysInfo::read_page_info(pid_t pid,
-				  map<Address, list<Page> > &page_info)
+bool LinuxSysInfo::read_page_info(pid_t pid, PageSink &sink)
 {
     list<string> lines;
-    page_info.clear();
 
     stringstream sstr;
     sstr << pid << "\n";
@@ -1033,8 +2504,10 @@ bool LinuxSysInfo::read_page_info(pid_t pid,
 	return false;
     }
 
-    list<Page> empty_pagelist;
-    list<Page> *current_pagelist = NULL;
+    // Pages for the current vma, passed on when the next one starts
+    vector<Page> pages;
+    Address vma_start = 0;
+    bool have_vma = false;
     
     list<string>::const_iterator it;
     for (it = lines.begin(); it != lines.end(); ++it) {
@@ -1050,16 +2523,16 @@ bool LinuxSysInfo::read_page_info(pid_t pid,
 	}
 
 	if (it->substr(0, 3) == "VMA") {
-	    Address start_addr;
-	    string token;
-	    sstr.str(it->substr(4)); // "VMA deadbeef"
-	    sstr >> hex >> start_addr;
-
-	    // Put a (copy of) the empty pagelist in for this address
-	    page_info[start_addr] = empty_pagelist;
-
-	    // And remember where to put the pages
-	    current_pagelist = &(page_info[start_addr]);
+	    if (have_vma && !pages.empty()) {
+		sink.add_pages(vma_start, &pages[0], pages.size());
+	    }
+	    unsigned long npages = 0;
+	    sstr.clear();
+	    sstr.str(it->substr(4)); // "VMA deadbeef 12"
+	    sstr >> hex >> vma_start >> dec >> npages;
+	    have_vma = true;
+	    pages.clear();
+	    pages.reserve(npages);
 	}
 	else {
 	    bool writable, resident;
@@ -1068,14 +2541,16 @@ bool LinuxSysInfo::read_page_info(pid_t pid,
 		warn << "read_page_info - bad page line:" << pid << "\n";
 		continue;
 	    }
-	    if (current_pagelist == NULL) {
+	    if (!have_vma) {
 		warn << "read_page_info: page info line before VMA\n";
 		continue;
 	    }
-	    Page p(cookie, resident, writable);
-	    current_pagelist->push_back(p);
+	    pages.push_back(Page(cookie, resident, writable));
 	}
     }
+    if (have_vma && !pages.empty()) {
+	sink.add_pages(vma_start, &pages[0], pages.size());
+    }
 
     return true;
 }
@@ -1095,7 +2570,7 @@ bool LinuxSysInfo::parse_page_line(const string &line,
     writable = i;
 
     sstr >> hex >> cookie;
-    cookie |= (i_resident << 31);
+    cookie |= ((PageCookie) i_resident << 31);
 
     return true;
 }
@@ -1118,87 +2593,457 @@ std::string LinuxSysInfo::read_cmdline(pid_t pid)
 
 bool LinuxSysInfo::read_vmas(const PagePoolPtr &pp,
 			     pid_t pid,
-			     list<VmaPtr> &vmas)
+			     vector<VmaPtr> &vmas)
 {
     vmas.clear();
-    string mapfile = proc_map_file(pid);
-
-    list<string> lines;
 
-    if (!read_textfile(mapfile, lines)) {
+    MapsScanner scanner;
+    if (!scanner.load(proc_map_file(pid))) {
 	warn << "read_vmas - can't load maps for: " << pid << "\n";
 	return false;
     }
 
+    MapsLine line;
+    while (scanner.next(line)) {
+	vmas.push_back(make_vma(line));
+    }
+    return true;
+}
+
+VmaPtr LinuxSysInfo::parse_vma_line(const string &line)
+{
+    MapsScanner scanner;
+    MapsLine mline;
+
+    scanner.set_text(line.data(), line.length());
+    if (!scanner.next(mline)) {
+	VmaPtr null_vma;
+	return null_vma;
+    }
+    return make_vma(mline);
+}
+
+VmaPtr LinuxSysInfo::make_vma(const MapsLine &line)
+{
+    static const string ANON_NAME("[anon]");
+    NamePtr fname = line.name_len == 0
+	? _names.intern(ANON_NAME)
+	: _names.intern(line.name, line.name_len);
+
+    VmaPtr vma = boost::make_shared<Vma>(line.start, line.end, line.offset,
+					 fname, line.perms, line.dev,
+					 line.inode);
+
+    dbg << "Parsed vma: " << hex << line.start << ", " << line.end
+	<< ", " << line.offset << ": " << *fname << "\n";
+
+    return vma;
+}
+
+string LinuxSysInfo::proc_map_file(pid_t pid)
+{
+    stringstream sstr;
+    sstr << "/proc/" << pid << "/maps";
+    return sstr.str();
+}
+
+bool LinuxSysInfo::read_vma_sizes(pid_t pid,
+				  map<Address, SizesPtr> &vma_sizes)
+{
+    stringstream fname;
+    fname << "/proc/" << pid << "/smaps";
+
+    MapsScanner scanner;
+    if (!scanner.load(fname.str())) {
+	warn << "read_vma_sizes - can't read smaps: " << pid << "\n";
+	return false;
+    }
+    return scan_vma_sizes(scanner, vma_sizes);
+}
+
+bool LinuxSysInfo::scan_vma_sizes(MapsScanner &scanner,
+				  map<Address, SizesPtr> &vma_sizes)
+{
+    vma_sizes.clear();
+
+    SmapsEntry entry;
+    while (scanner.next(entry)) {
+	vma_sizes[entry.line.start] = smaps_to_sizes(entry);
+    }
+    return true;
+}
+
+SizesPtr LinuxSysInfo::smaps_to_sizes(const SmapsEntry &entry)
+{
+    SizesPtr sizes(new Sizes);
+    const double kb = 1024;
+
+    sizes->increase(Sizes::VM, entry.line.end - entry.line.start);
+    sizes->increase(Sizes::RESIDENT, entry.rss * kb);
+    sizes->increase(Sizes::MAPPED, (entry.rss + entry.swap) * kb);
+    sizes->increase(Sizes::EFFECTIVE_RESIDENT, entry.pss * kb);
+    sizes->increase(Sizes::EFFECTIVE_MAPPED,
+		    (entry.pss + entry.swap_pss) * kb);
+    sizes->increase(Sizes::SOLE_MAPPED,
+		    (entry.private_clean + entry.private_dirty) * kb);
+
+    // As for pagemap, guess writable pages from the vma perms: all of
+    // a shared writable mapping, and the private (anonymous) copies
+    // in a private one.
+    if (entry.line.perms & Vma::PERM_WRITE) {
+	if (entry.line.perms & Vma::PERM_SHARED) {
+	    sizes->increase(Sizes::WRITABLE, entry.rss * kb);
+	}
+	else {
+	    sizes->increase(Sizes::WRITABLE, entry.anonymous * kb);
+	}
+    }
+
+    return sizes;
+}
+
+// ------------------------------------------------------------
+
+// The layout of a /proc/xxx/pagemap entry. See
+// Documentation/admin-guide/mm/pagemap.rst in the kernel source.
+static const uint64_t PM_PFN_MASK = (1ULL << 55) - 1;
+static const uint64_t PM_MMAP_EXCLUSIVE = 1ULL << 56;
+static const uint64_t PM_FILE = 1ULL << 61;
+static const uint64_t PM_SWAP = 1ULL << 62;
+static const uint64_t PM_PRESENT = 1ULL << 63;
+
+// Tag for swap entry cookies, so they can't clash with pfns. It must
+// fit below Page::COOKIE_BITS.
+static const uint64_t SWAP_COOKIE = 1ULL << 55;
+
+// Number of pagemap entries we read at a time
+static const size_t PAGEMAP_CHUNK = 4096;
+
+// PAGEMAP_SCAN (linux 6.7) returns just the populated ranges of an
+// address range, so we don't have to read an entry for every page of
+// large sparse vmas. Older headers don't define it.
+#ifndef PAGEMAP_SCAN
+struct page_region {
+    uint64_t start;
+    uint64_t end;
+    uint64_t categories;
+};
+
+struct pm_scan_arg {
+    uint64_t size;
+    uint64_t flags;
+    uint64_t start;
+    uint64_t end;
+    uint64_t walk_end;
+    uint64_t vec;
+    uint64_t vec_len;
+    uint64_t max_pages;
+    uint64_t category_inverted;
+    uint64_t category_mask;
+    uint64_t category_anyof_mask;
+    uint64_t return_mask;
+};
+
+#define PAGE_IS_PRESENT (1 << 3)
+#define PAGE_IS_SWAPPED (1 << 4)
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#endif
+
+// Number of populated regions we ask PAGEMAP_SCAN for at a time
+static const size_t PAGEMAP_SCAN_REGIONS = 512;
+
+PagemapSysInfo::PagemapSysInfo()
+    : _have_pagemap_scan(probe_pagemap_scan())
+{ }
+
+PagemapSysInfo::~PagemapSysInfo()
+{ }
+
+bool PagemapSysInfo::is_thread_safe()
+{
+    return true;
+}
+
+const std::string PagemapSysInfo::KPAGECOUNT_FILE("/proc/kpagecount");
+
+// Each zone in /proc/zoneinfo has lines like:
+//         spanned  1044480
+//   start_pfn:           4096
+PageCookie PagemapSysInfo::max_pfn()
+{
+    list<string> lines;
+    if (!read_textfile("/proc/zoneinfo", lines)) {
+	return 0;
+    }
+
+    PageCookie max = 0, spanned = 0;
     list<string>::iterator it;
-    for(it = lines.begin(); it != lines.end(); ++it) {
-	VmaPtr vma = parse_vma_line(*it);
-	if (!vma) {
-	    warn << "read_vmas - can't parse line\n";
+    for (it = lines.begin(); it != lines.end(); ++it) {
+	stringstream sstr(*it);
+	string field;
+	PageCookie val;
+	if (!(sstr >> field >> val)) {
 	    continue;
 	}
-	vma->selfptr(vma);
-	vmas.push_back(vma);
+	if (field == "spanned") {
+	    spanned = val;
+	}
+	else if (field == "start_pfn:") {
+	    max = std::max(max, val + spanned);
+	}
     }
-    return true;
+    return max;
+}
+
+// /proc/meminfo has lines like:
+// AnonPages:       1702436 kB
+PageCookie PagemapSysInfo::mapped_pages()
+{
+    list<string> lines;
+    if (!read_textfile("/proc/meminfo", lines)) {
+	return 0;
+    }
+
+    PageCookie kbytes = 0;
+    list<string>::iterator it;
+    for (it = lines.begin(); it != lines.end(); ++it) {
+	stringstream sstr(*it);
+	string field;
+	PageCookie val;
+	if (!(sstr >> field >> val)) {
+	    continue;
+	}
+	if (field == "AnonPages:" || field == "Mapped:") {
+	    kbytes += val;
+	}
+    }
+    return kbytes * 1024 / Elf::page_size();
 }
 
+bool PagemapSysInfo::sanity_check()
+{
+    if (!file_exists("/proc/self/pagemap")) {
+	warn << "Can't find /proc/self/pagemap: kernel too old?\n";
+	return false;
+    }
+
+    // The kernel zeroes the PFNs in pagemap unless we have
+    // CAP_SYS_ADMIN, which is also what it takes to read kpagecount.
+    // Without real PFNs we can't see any sharing.
+    if (!file_readable(KPAGECOUNT_FILE)) {
+	warn << "Can't read " << KPAGECOUNT_FILE
+	     << ": page frame numbers are only visible to root\n";
+	return false;
+    }
 
+    return true;
+}
 
-VmaPtr LinuxSysInfo::parse_vma_line(const string &line_arg)
+bool PagemapSysInfo::read_page_info(pid_t pid, PageSink &sink)
 {
-    const string ANON_NAME("[anon]");
-    string line(line_arg);
+    MapsScanner scanner;
 
-    string perms;
-    Elf::Address start, end;
-    off_t offset;
-    string fname;
-    string::size_type dashpos;
-    VmaPtr vma;
-    string token;
-    
+    if (!scanner.load(proc_map_file(pid))) {
+	warn << "read_page_info - can't read maps: " << pid << "\n";
+	return false;
+    }
 
-    // Break the range into two hex numbers
-    dashpos = line.find('-');
-    if (dashpos == string::npos) {
-	warn << "Can't find dash in VMA line: " << line << "\n";
-	return vma;
+    stringstream fname;
+    fname << "/proc/" << pid << "/pagemap";
+    int fd = open(fname.str().c_str(), O_RDONLY);
+    if (fd < 0) {
+	warn << "read_page_info - can't open pagemap: " << pid << "\n";
+	return false;
     }
-    line[dashpos] = ' ';
-    
-    stringstream sstr(line);
-    sstr >> hex >> start;
-    sstr >> end;
-    sstr >> perms;
-    sstr >> offset;
-    sstr >> token;
-    sstr >> token;
 
-    sstr >> fname;
-    if (fname.empty()) {
-	fname = ANON_NAME;
+    MapsLine line;
+    while (scanner.next(line)) {
+	if (_have_pagemap_scan) {
+	    scan_vma(fd, line, sink);
+	}
+	else {
+	    read_range(fd, line, line.start, line.end, sink);
+	}
     }
 
-    vma.reset(new Vma(start, end, offset, fname));
+    close(fd);
+    return true;
+}
 
-    dbg << "Parsed vma: " << hex << start << ", " << end
-	<< ", " << offset << ": " << fname << "\n";
+// Scan the page holding one of our own variables. An older kernel
+// fails with ENOTTY (or EINVAL, from a kernel which knows the ioctl
+// number but not our arguments).
+bool PagemapSysInfo::probe_pagemap_scan()
+{
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+    if (fd < 0) {
+	return false;
+    }
 
-    return vma;
+    page_region region;
+    int probe = 0;
+    pm_scan_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.size = sizeof(arg);
+    arg.start = Elf::page_align_down((Address) (unsigned long) &probe);
+    arg.end = arg.start + Elf::page_size();
+    arg.vec = (uint64_t) (unsigned long) &region;
+    arg.vec_len = 1;
+    arg.category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+    arg.return_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+
+    bool supported = ioctl(fd, PAGEMAP_SCAN, &arg) >= 0;
+    close(fd);
+    return supported;
+}
+
+bool PagemapSysInfo::scan_vma(int fd,
+			      const MapsLine &line,
+			      PageSink &sink)
+{
+    vector<page_region> regions(PAGEMAP_SCAN_REGIONS);
+    Address start = line.start;
+
+    while (start < line.end) {
+	pm_scan_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.size = sizeof(arg);
+	arg.start = start;
+	arg.end = line.end;
+	arg.vec = (uint64_t) (unsigned long) &regions[0];
+	arg.vec_len = regions.size();
+	arg.category_anyof_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+	arg.return_mask = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+
+	int num_regions = ioctl(fd, PAGEMAP_SCAN, &arg);
+	if (num_regions < 0) {
+	    if (errno == ENOTTY || errno == EINVAL) {
+		// Read the rest of this vma entry by entry instead
+		return read_range(fd, line, start, line.end, sink);
+	    }
+	    // [vsyscall] and friends are outside the process mm
+	    return true;
+	}
+
+	for (int i = 0; i < num_regions; ++i) {
+	    read_range(fd, line, regions[i].start, regions[i].end, sink);
+	}
+
+	if (arg.walk_end <= start) {
+	    break;
+	}
+	start = arg.walk_end;
+    }
+
+    return true;
 }
 
-string LinuxSysInfo::proc_map_file(pid_t pid)
+bool PagemapSysInfo::read_range(int fd,
+				const MapsLine &line,
+				Address start,
+				Address end,
+				PageSink &sink)
+{
+    bool writable = line.perms & Vma::PERM_WRITE;
+    bool shared = line.perms & Vma::PERM_SHARED;
+
+    const Address page_size = Elf::page_size();
+    Address pgnum = start / page_size;
+    Address npages = (end - start) / page_size;
+    size_t chunk = npages < PAGEMAP_CHUNK ? npages : PAGEMAP_CHUNK;
+    vector<uint64_t> entries(chunk);
+    vector<Page> pages;
+    pages.reserve(chunk);
+
+    while (npages > 0) {
+	size_t want = npages < entries.size() ? npages : entries.size();
+	ssize_t got = pread(fd,
+			    &entries[0],
+			    want * sizeof(uint64_t),
+			    (off_t) (pgnum * sizeof(uint64_t)));
+	// Short reads happen for areas like [vsyscall] which are
+	// outside the process mm.
+	if (got <= 0) {
+	    break;
+	}
+	size_t num_entries = got / sizeof(uint64_t);
+
+	// Pass on each run of populated pages
+	Address run_start = pgnum;
+	pages.clear();
+	for (size_t i = 0; i < num_entries; ++i) {
+	    Page page = entry_to_page(entries[i], writable, shared);
+	    if (!page.is_mapped()) {
+		if (!pages.empty()) {
+		    sink.add_pages(run_start * page_size, &pages[0], pages.size());
+		    pages.clear();
+		}
+		run_start = pgnum + i + 1;
+		continue;
+	    }
+	    pages.push_back(page);
+	}
+	if (!pages.empty()) {
+	    sink.add_pages(run_start * page_size, &pages[0], pages.size());
+	}
+	pgnum += num_entries;
+	npages -= num_entries;
+    }
+
+    return true;
+}
+
+Page PagemapSysInfo::entry_to_page(uint64_t entry,
+				   bool vma_writable,
+				   bool vma_shared)
 {
-    stringstream sstr;
-    sstr << "/proc/" << pid << "/maps";
-    return sstr.str();
+    if (entry & PM_PRESENT) {
+	// A written page in a private mapping is an anonymous copy
+	// which only we map. Read-only pages in the same vma are still
+	// page cache (PM_FILE) or the shared zero page (not exclusive).
+	bool writable = vma_writable
+	    && (vma_shared
+		|| ((entry & PM_MMAP_EXCLUSIVE) && !(entry & PM_FILE)));
+	return Page(entry & PM_PFN_MASK, true, writable);
+    }
+    if (entry & PM_SWAP) {
+	return Page((entry & PM_PFN_MASK) | SWAP_COOKIE, false, false);
+    }
+    return Page(0, false, false);
+}
+
+// ------------------------------------------------------------
+
+SysInfoPtr Exmap::make_sysinfo()
+{
+    SysInfoPtr sysinfo;
+    const char *cp = getenv("EXMAP_SYSINFO");
+    string which = cp ? cp : "";
+
+    if (which == "module") {
+	sysinfo.reset(new LinuxSysInfo);
+    }
+    else if (which == "pagemap") {
+	sysinfo.reset(new PagemapSysInfo);
+    }
+    else {
+	if (!which.empty()) {
+	    warn << "Unknown EXMAP_SYSINFO " << which << ", guessing\n";
+	}
+	if (file_exists(LinuxSysInfo::EXMAP_FILE)) {
+	    sysinfo.reset(new LinuxSysInfo);
+	}
+	else {
+	    sysinfo.reset(new PagemapSysInfo);
+	}
+    }
+    return sysinfo;
 }
 
 
 
     
-MapCalculator::MapCalculator(const list<VmaPtr> &vmas,
+MapCalculator::MapCalculator(const vector<VmaPtr> &vmas,
 			     FilePoolPtr &file_pool,
 			     const ProcessPtr &proc)
 : _vmas(vmas), _file_pool(file_pool), _proc(proc)
@@ -1210,11 +3055,11 @@ bool MapCalculator::calc_maps(list<MapPtr> &maps)
 {
     walk_vma_files();
 
-    list<string> fnames = map_keys(_fname_to_vmas);
-    list<string>::iterator it;
-    for (it = fnames.begin(); it != fnames.end(); ++it) {
-	if (!calc_maps_for_file(*it)) {
-	    warn << "calc_maps: failed to calc for " << *it << "\n";
+    map<FilePtr, list<VmaPtr> >::const_iterator it;
+    for (it = _file_to_vmas.begin(); it != _file_to_vmas.end(); ++it) {
+	if (!calc_maps_for_file(it->first, it->second)) {
+	    warn << "calc_maps: failed to calc for " << it->first->name()
+		 << "\n";
 	    return false;
 	}
     }
@@ -1240,29 +3085,32 @@ bool MapCalculator::add_holes()
     stringstream pref;
     pref << _proc->pid() << " add_holes: ";
     list<MapPtr>::iterator map_it;
-    list<RangePtr> map_ranges;
+    vector<Range> map_ranges;
 
-    // this wouldn't require a loop or a (named) helper function in a
-    // decent language
+    // Merge the map ranges once, then each vma only looks at the
+    // ranges which overlap it
     for (map_it = _maps.begin(); map_it != _maps.end(); ++map_it) {
-	map_ranges.push_back((*map_it)->mem_range());
+	map_ranges.push_back(*(*map_it)->mem_range());
     }
+    Range::merge_in_place(map_ranges);
 
-    list<VmaPtr>::iterator vma_it;
-    list<RangePtr>::iterator hole_it;
+    vector<VmaPtr>::const_iterator vma_it;
+    vector<Range> vma_holes;
+    vector<Range>::iterator hole_it;
     RangePtr null_range;
     for (vma_it = _vmas.begin(); vma_it != _vmas.end(); ++vma_it) {
-	VmaPtr &vma = *vma_it;
+	const VmaPtr &vma = *vma_it;
 	dbg << pref.str() << "adding holes for vma range"
 	    << vma->range() << "\n";
-	list<RangePtr> vma_holes = vma->range()->invert_list(map_ranges);
-	FilePtr file = _file_pool->get_or_make_file(vma->fname());
+	vma->range()->invert_sorted(map_ranges, vma_holes);
+	FilePtr file = _file_pool->get_or_make_file(vma);
 	for (hole_it = vma_holes.begin();
 		hole_it != vma_holes.end();
 		++hole_it) {
-	    MapPtr map(new Map(vma, *hole_it, null_range));
+	    RangePtr hole = boost::make_shared<Range>(*hole_it);
+	    MapPtr map = boost::make_shared<Map>(vma, hole, null_range);
 	    _maps.push_back(map);
-	    file->add_map(map);
+	    file->add_map(_proc->pid(), map);
 	    dbg << pref.str() << "adding hole " << map->to_string() << "\n";
 	}
     }
@@ -1275,11 +3123,11 @@ bool MapCalculator::sanity_check(const list<MapPtr> &maps)
     stringstream pref;
     pref << _proc->pid() << " sanity_check: ";
     list<MapPtr>::const_iterator map_it = maps.begin();
-    list<VmaPtr>::iterator vma_it = _vmas.begin();
+    vector<VmaPtr>::const_iterator vma_it = _vmas.begin();
 
 
     while (vma_it != _vmas.end()) {
-	VmaPtr &vma = *vma_it;
+	const VmaPtr &vma = *vma_it;
 	dbg << pref.str() << "VMA: " << vma->to_string() << "\n";
 
 	if ((*map_it)->mem_range()->start() != vma->start()) {
@@ -1360,23 +3208,23 @@ string MapCalculator::dump_maps_to_string(const std::list<MapPtr> &maps)
     return sstr.str();
 }
 
-bool MapCalculator::calc_maps_for_file(const string &fname)
+bool MapCalculator::calc_maps_for_file(const FilePtr &file,
+	const list<VmaPtr> &filevmas)
 {
     stringstream pref;
-    pref << _proc->pid() << " " << fname << " calc_maps_for_file: ";
-    FilePtr file = _file_pool->get_or_make_file(fname);
+    pref << _proc->pid() << " " << file->name() << " calc_maps_for_file: ";
 
     size_t num_maps_before = _maps.size();
     if (file->is_elf()) {
 	dbg << pref.str() << "elf file\n";
-	if(!calc_maps_for_elf_file(fname, file)) {
+	if(!calc_maps_for_elf_file(file, filevmas)) {
 	    warn << pref.str() << "failed to calc elf file maps\n";
 	    return false;
 	}
     }
     else {
 	dbg << pref.str() << "non elf file\n";
-	if(!calc_maps_for_nonelf_file(fname, file)) {
+	if(!calc_maps_for_nonelf_file(file, filevmas)) {
 	    warn << pref.str() << "failed to calc nonelf file maps\n";
 	    return false;
 	}
@@ -1390,12 +3238,12 @@ bool MapCalculator::calc_maps_for_file(const string &fname)
     return true;
 }
 
-bool MapCalculator::calc_maps_for_nonelf_file(const string &fname,
-	const FilePtr &file)
+bool MapCalculator::calc_maps_for_nonelf_file(const FilePtr &file,
+	const list<VmaPtr> &filevmas)
 {
     stringstream pref;
-    pref << _proc->pid() << " " << fname << " calc_maps_for_nonelf_file: ";
-    list<VmaPtr> filevmas = _fname_to_vmas[fname];
+    pref << _proc->pid() << " " << file->name()
+	 << " calc_maps_for_nonelf_file: ";
 
     if (filevmas.empty()) {
 	warn << pref.str() << "no vmas for nonelf file\n";
@@ -1408,35 +3256,29 @@ bool MapCalculator::calc_maps_for_nonelf_file(const string &fname,
 	const VmaPtr &vma = *it;
 	// filevmas includes any trailing non file backed vmas. we don't
 	// want them here
-	if (vma->fname() != fname) {
+	if (!vma->is_file_backed()) {
 	    continue;
-	    // not a warning
-	    dbg << pref.str() << "vma name mismatch "
-		<< vma->to_string() << "\n";
-//	    warn << pref.str() << "vma name mismatch "
-//		<< vma->to_string() << "\n";
 	}
-	MapPtr map(new Map(vma, vma->range(), null_range));
+	MapPtr map = boost::make_shared<Map>(vma, vma->range(), null_range);
 	_maps.push_back(map);
-	file->add_map(map);
+	file->add_map(_proc->pid(), map);
 	dbg << pref.str() << "adding nonelf map " << map->to_string() << "\n";
     }
 
     return true;
 }
 
-bool MapCalculator::calc_maps_for_elf_file(const string &fname,
-	const FilePtr &file)
+bool MapCalculator::calc_maps_for_elf_file(const FilePtr &file,
+	list<VmaPtr> filevmas)
 {
     stringstream pref;
-    pref << _proc->pid() << " " << fname << " calc_maps_for_elf_file: ";
+    pref << _proc->pid() << " " << file->name() << " calc_maps_for_elf_file: ";
     list<Elf::SegmentPtr> segs = file->elf()->loadable_segments();
     if (segs.empty()) {
 	warn << pref.str() << "no loadable segments\n";
 	return false;
     }
 
-    list<VmaPtr> filevmas = _fname_to_vmas[fname];
     if (filevmas.empty()) {
 	warn << pref.str() << "no vmas for segment\n";
 	return false;
@@ -1487,15 +3329,18 @@ bool MapCalculator::calc_map_for_seg(const FilePtr &file,
 	    seg_to_mem = vmamem_base - segmem_base;
 	}
 
-	RangePtr seg_mem_range = seg->mem_range()->add(seg_to_mem);
-	RangePtr working_mrange = seg_mem_range->intersect(*(vma->range()));
-	if (!working_mrange || working_mrange->size() <= 0) {
+	Range seg_mem_range = seg->mem_range()->shifted(seg_to_mem);
+	Range working_mrange;
+	if (!seg_mem_range.intersect(*(vma->range()), working_mrange)
+	    || working_mrange.size() <= 0) {
 	    continue;
 	}
-	RangePtr elf_mem_range = working_mrange->subtract(seg_to_mem);
-	MapPtr map(new Map(vma, working_mrange, elf_mem_range));
+	RangePtr mem_range = boost::make_shared<Range>(working_mrange);
+	RangePtr elf_mem_range
+	    = boost::make_shared<Range>(working_mrange.shifted(-seg_to_mem));
+	MapPtr map = boost::make_shared<Map>(vma, mem_range, elf_mem_range);
 	_maps.push_back(map);
-	file->add_map(map);
+	file->add_map(_proc->pid(), map);
 	dbg << pref.str() << "adding elf map " << map->to_string() << "\n";
 
 	if (!vma->is_file_backed()) {
@@ -1521,28 +3366,28 @@ bool MapCalculator::calc_map_for_seg(const FilePtr &file,
 
 void MapCalculator::walk_vma_files()
 {
-    list<VmaPtr>::iterator it;
+    vector<VmaPtr>::const_iterator it;
 
-    string last_file_backed;
+    FilePtr last_file_backed;
     for(it = _vmas.begin(); it != _vmas.end(); ++it) {
-	VmaPtr &vma = *it;
+	const VmaPtr &vma = *it;
 
-	FilePtr file = _file_pool->get_or_make_file(vma->fname());
+	FilePtr file = _file_pool->get_or_make_file(vma);
 	file->add_proc(_proc);
 	_proc->add_file(file);
 
 	// associate non-file-backed vmas with the last file backed
 	// one
 	if (vma->is_file_backed()) {
-	    last_file_backed = vma->fname();
+	    last_file_backed = file;
 	}
-	if (!last_file_backed.empty()) {
-	    _fname_to_vmas[last_file_backed].push_back(vma);
+	if (last_file_backed) {
+	    _file_to_vmas[last_file_backed].push_back(vma);
 	}
     }
-    std::map<std::string, std::list<Exmap::VmaPtr> >::iterator map_it;
-    for(map_it = _fname_to_vmas.begin(); map_it != _fname_to_vmas.end(); ++map_it) {
-        string fname = map_it->first;
+    std::map<FilePtr, std::list<Exmap::VmaPtr> >::iterator map_it;
+    for(map_it = _file_to_vmas.begin(); map_it != _file_to_vmas.end(); ++map_it) {
+        string fname = map_it->first->name();
         size_t num = map_it->second.size();
         dbg << "File " << fname << " has " << num << " vmas" << "\n";
     }
@@ -11,8 +11,10 @@
 #include <set>
 
 #include <boost/smart_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
 
 #include <sys/types.h>
+#include <stdint.h>
 #include "jutil.hpp"
 #include "Elf.hpp"
 
@@ -40,6 +42,72 @@ namespace Exmap
     typedef boost::shared_ptr<Page> PagePtr;
     class SysInfo;
     typedef boost::shared_ptr<SysInfo> SysInfoPtr;
+    /// A file name, shared by every vma with that name
+    typedef boost::shared_ptr<const std::string> NamePtr;
+
+    /// Receives page info from a SysInfo as it is read, so the
+    /// pages can be stored without building an intermediate copy.
+    class PageSink
+    {
+    public:
+	virtual ~PageSink();
+
+	/// Take a run of count consecutive pages, the first at the
+	/// start address. Runs arrive in address order. The pages are
+	/// only valid for the duration of the call.
+	virtual void add_pages(Elf::Address start,
+			       const Page *pages,
+			       size_t count) = 0;
+    };
+
+    /// Receives the pages covering a range from Vma::visit_pages,
+    /// in address order: a partial page at each end if the range
+    /// isn't page aligned, and whole pages in between in as few
+    /// calls as the vma's page storage allows.
+    class PageVisitor
+    {
+    public:
+	virtual ~PageVisitor();
+
+	/// bytes of one page (less than a whole page)
+	virtual void partial_page(const Page &page, Elf::Address bytes) = 0;
+
+	/// count whole pages
+	virtual void whole_pages(const Page *pages, size_t count) = 0;
+
+	/// count whole pages, each the one before offset by one. By
+	/// default passed on to whole_pages a page at a time.
+	virtual void contiguous_pages(const Page &first, size_t count);
+
+	/// count whole unmapped pages. Ignored by default.
+	virtual void unmapped_pages(size_t count);
+    };
+
+    /// Interns names, so that each distinct name is held once however
+    /// many vmas have it, and names from the same pool can be compared
+    /// by pointer. Safe to use from several loading threads.
+    class NamePool
+    {
+    public:
+	NamePool();
+	/// The pooled copy of the len chars at name
+	NamePtr intern(const char *name, size_t len);
+	/// Same, but takes a string
+	NamePtr intern(const std::string &name) {
+	    return intern(name.data(), name.length());
+	}
+	/// Drop the names nothing but the pool holds on to
+	void prune();
+	/// Number of names in the pool
+	size_t size();
+    private:
+	static size_t hash(const char *name, size_t len);
+	void insert(const NamePtr &name);
+	/// Open addressing table of names, null for an empty slot
+	std::vector<NamePtr> _slots;
+	size_t _size;
+	jutil::Mutex _lock;
+    };
 
     /// This is the interface to the system to query information
     /// about processes (pids, vmas, page info). It's abstract to
@@ -57,20 +125,95 @@ namespace Exmap
 	/// kernel modules available, versions, etc).
 	virtual bool sanity_check() = 0;
 
-	/// Read the page info for a pid
-	virtual bool read_page_info(pid_t pid,
-				    std::map<Elf::Address,
-				    std::list<Page> > &pi) = 0;
+	/// Read the page info for a pid, passing each run of
+	/// consecutive pages to the sink. Backends may leave out
+	/// unpopulated pages, so a vma may have several runs or none.
+	virtual bool read_page_info(pid_t pid, PageSink &sink) = 0;
 
 	/// Read cmdline for pid
 	virtual std::string read_cmdline(pid_t pid) = 0;
 
-	/// Read vma list for pid
+	/// Read vma list for pid, in address order
 	virtual bool read_vmas(const PagePoolPtr &pp,
 			       pid_t pid,
-			       std::list<VmaPtr> &vmas) = 0;
+			       std::vector<VmaPtr> &vmas) = 0;
+
+	/// Read the kernel's own usage totals for each vma of a pid,
+	/// keyed on vma start address. Used for summary snapshots,
+	/// which don't read any page info.
+	virtual bool read_vma_sizes(pid_t pid,
+				    std::map<Elf::Address, SizesPtr> &vs) = 0;
+
+	/// True if the read_ methods may be called for different pids
+	/// from several threads at once.
+	virtual bool is_thread_safe();
+
+	/// If page cookies are pfns, one more than the highest pfn of
+	/// the system's memory. 0 if unknown.
+	virtual PageCookie max_pfn();
+
+	/// Roughly how many distinct pages user processes have mapped,
+	/// to decide how to count them. 0 if unknown.
+	virtual PageCookie mapped_pages();
+
+	/// A snapshot is about to load. Sysinfos which intern names can
+	/// let go of those no earlier snapshot still uses.
+	virtual void prune_names();
+
+    private:
+    };
+
+    /// The fields of one line of /proc/xxx/maps. The name points into
+    /// the MapsScanner buffer and is not null terminated.
+    struct MapsLine
+    {
+	Elf::Address start;
+	Elf::Address end;
+	/// Vma::PERM_xxx flags
+	unsigned int perms;
+	off_t offset;
+	dev_t dev;
+	ino_t inode;
+	const char *name;
+	size_t name_len;
+    };
 
+    /// One vma of /proc/xxx/smaps: the maps line followed by the
+    /// usage fields we use. Fields are in kbytes, as in the file.
+    struct SmapsEntry
+    {
+	MapsLine line;
+	unsigned long rss;
+	unsigned long pss;
+	unsigned long private_clean;
+	unsigned long private_dirty;
+	unsigned long anonymous;
+	unsigned long swap;
+	unsigned long swap_pss;
+    };
+
+    /// Parses /proc/xxx/maps in place. The whole file is read into a
+    /// single buffer and each line is scanned without copying it.
+    class MapsScanner
+    {
+    public:
+	MapsScanner();
+	/// Read the whole of the file into our buffer
+	bool load(const std::string &fname);
+	/// Scan text we already have, rather than a file
+	void set_text(const char *text, size_t len);
+	/// Parse the next line. Returns false at the end of the text.
+	/// Lines which can't be parsed are warned about and skipped.
+	bool next(MapsLine &line);
+	/// Parse the next /proc/xxx/smaps entry. Returns false at the
+	/// end of the text. Fields we don't use are skipped.
+	bool next(SmapsEntry &entry);
     private:
+	/// Find the next line, advancing past it
+	bool next_line(const char *&line, const char *&eol);
+	std::vector<char> _buf;
+	size_t _len;
+	size_t _pos;
     };
 
     /// Concrete implementation of Sysinfo for a Linux system.
@@ -80,32 +223,103 @@ namespace Exmap
 	virtual ~LinuxSysInfo();
 	virtual std::list<pid_t> accessible_pids();
 	virtual bool sanity_check();
-	virtual bool read_page_info(pid_t pid,
-			    std::map<Elf::Address, std::list<Page> > &pi);
+	virtual bool read_page_info(pid_t pid, PageSink &sink);
 	virtual std::string read_cmdline(pid_t pid);
 	virtual bool read_vmas(const PagePoolPtr &pp,
 			       pid_t pid,
-			       std::list<VmaPtr> &vmas);
+			       std::vector<VmaPtr> &vmas);
+	/// Read from /proc/xxx/smaps, so works with any backend
+	virtual bool read_vma_sizes(pid_t pid,
+				    std::map<Elf::Address, SizesPtr> &vs);
+	/// The file the kernel module provides
+	static const std::string EXMAP_FILE;
+	virtual void prune_names();
     protected:
 	/// Parse a single /proc/xxx/maps line and instantiate a vma
 	/// protected to allow use by mock testing objects.
 	VmaPtr parse_vma_line(const std::string &line);
+	/// Instantiate a vma from a scanned maps line
+	VmaPtr make_vma(const MapsLine &line);
 	/// Parse a single /proc/exmap page line
 	bool parse_page_line(const std::string &line,
 		bool &resident,
 		bool &writable,
 		PageCookie &cookie);
-    private:
-
+	/// The /proc/xxx/maps file for a pid
         std::string proc_map_file(pid_t pid);
-	static const std::string EXMAP_FILE;
+	/// Convert the smaps entries into per-vma sizes
+	bool scan_vma_sizes(MapsScanner &scanner,
+			    std::map<Elf::Address, SizesPtr> &vma_sizes);
+	/// The sizes for a single smaps entry. The kernel counts sharing
+	/// over the whole system, where page-level snapshots count it
+	/// over the processes in the snapshot.
+	static SizesPtr smaps_to_sizes(const SmapsEntry &entry);
+	/// The names of the vmas we have made
+	NamePool _names;
+    };
+
+    /// Implementation of SysInfo which doesn't need the exmap kernel
+    /// module. Page info is read from the binary /proc/xxx/pagemap
+    /// file (one 64-bit entry per virtual page) rather than the text
+    /// lines of /proc/exmap.
+    ///
+    /// Only populated pages are returned. Where the kernel supports
+    /// the PAGEMAP_SCAN ioctl (Linux 6.7+) we use it to find the
+    /// populated ranges and only read the entries for those, otherwise
+    /// we read the whole of each vma a chunk at a time.
+    class PagemapSysInfo : public LinuxSysInfo
+    {
+    public:
+	PagemapSysInfo();
+	virtual ~PagemapSysInfo();
+	virtual bool sanity_check();
+	virtual bool read_page_info(pid_t pid, PageSink &sink);
+	/// Each pid has its own pagemap file, so we can read in parallel
+	virtual bool is_thread_safe();
+	/// Read from the zone ranges in /proc/zoneinfo
+	virtual PageCookie max_pfn();
+	/// AnonPages plus Mapped from /proc/meminfo
+	virtual PageCookie mapped_pages();
+    protected:
+	/// Convert a single pagemap entry into a Page. pagemap doesn't
+	/// export the pte writable bit, so we approximate it from the
+	/// vma permissions and whether the page is a private copy.
+	static Page entry_to_page(uint64_t entry,
+				  bool vma_writable,
+				  bool vma_shared);
+    private:
+	/// Add the populated pages in [start, end) to page_info, reading
+	/// the pagemap entries a chunk at a time.
+	bool read_range(int fd,
+			const MapsLine &line,
+			Elf::Address start,
+			Elf::Address end,
+			PageSink &sink);
+	/// Use PAGEMAP_SCAN to find the populated ranges within the vma
+	/// and read those. If the ioctl refuses the vma, the rest of it
+	/// is read with read_range.
+	bool scan_vma(int fd,
+		      const MapsLine &line,
+		      PageSink &sink);
+	/// Whether the kernel supports PAGEMAP_SCAN
+	static bool probe_pagemap_scan();
+	/// Set once when constructed, so the loader threads only read it
+	const bool _have_pagemap_scan;
+	static const std::string KPAGECOUNT_FILE;
     };
 
+    /// Return the SysInfo to use on this system. The EXMAP_SYSINFO
+    /// environment variable may be set to 'module' or 'pagemap' to
+    /// choose, otherwise we use the kernel module if it is loaded and
+    /// pagemap if not.
+    SysInfoPtr make_sysinfo();
+
 
     /// Holds the various measures we can make of a File, Process or
     /// ELF memory range. Sizes are measured as doubles, to avoid too much
     /// rounding down when calculating the effective values.
-    /// A static unit/scale may also be set.
+    /// A Sizes is a small value, fine to keep on the stack or in a
+    /// vector. Values are in bytes; see SizeUnits for scaling them.
     class Sizes
     {
     public:
@@ -123,59 +337,112 @@ namespace Exmap
 	    RESIDENT,
 	    NUM_SIZES,
 	};
-	
-	/// Get the value, scaled into the current units
-	double sval(int which);
+
+	/// Masks of measures, to choose which ones the sizing
+	/// templates (e.g. Process::add_sizes) compute. Measures left
+	/// out stay at zero.
+	enum MeasureMask {
+	    EFFECTIVE_RESIDENT_BIT = 1 << EFFECTIVE_RESIDENT,
+	    EFFECTIVE_MAPPED_BIT = 1 << EFFECTIVE_MAPPED,
+	    WRITABLE_BIT = 1 << WRITABLE,
+	    VM_BIT = 1 << VM,
+	    SOLE_MAPPED_BIT = 1 << SOLE_MAPPED,
+	    MAPPED_BIT = 1 << MAPPED,
+	    RESIDENT_BIT = 1 << RESIDENT,
+	    ALL_MEASURES = (1 << NUM_SIZES) - 1,
+	    /// The measures which need page pool counts
+	    COUNTED_MEASURES = EFFECTIVE_RESIDENT_BIT | EFFECTIVE_MAPPED_BIT
+			       | SOLE_MAPPED_BIT | MAPPED_BIT,
+	    /// The measures which need the pages at all
+	    PAGE_MEASURES = ALL_MEASURES & ~VM_BIT,
+	};
 
 	/// Get the value
-	double val(int which);
+	double val(int which) const { return _values[which]; }
 
 	/// Add to a value
-	void increase(enum Measure which, double amount);
+	void increase(enum Measure which, double amount) {
+	    _values[which] += amount;
+	}
 
 	/// Human readable name for the size
 	static std::string size_name(int which);
 
 	/// Add the values from another set of sizes.
+	void add(const Sizes &other);
+	/// Same, but takes a SizesPtr
 	void add(const SizesPtr &other);
 
-	/// Set scale factor to 1
-	static void scale_units();
-	
-	/// Set scale factor to kbytes
-	static void scale_kbytes();
-	
-	/// Set scale factor to mbytes
-	static void scale_mbytes();
-	
     private:
 	/// These are the size names
 	const static std::string names[];
 
 	/// The measure values
 	double _values[NUM_SIZES];
+    };
+
+    /// The units a view shows sizes in. Each view keeps its own, so
+    /// nothing global changes when one of them switches units.
+    class SizeUnits
+    {
+    public:
+	/// Bytes
+	SizeUnits();
+	static SizeUnits bytes();
+	static SizeUnits kbytes();
+	static SizeUnits mbytes();
 
-	/// Scale starts off as 1
-	static int _scale_factor;
+	/// A value of sizes, scaled into these units
+	double sval(const Sizes &sizes, int which) const {
+	    return sizes.val(which) / _factor;
+	}
 
-	/// Scale name starts off as empty
-	static std::string _scale_name;
+	/// Human readable name for the size, with the units
+	std::string size_name(int which) const;
+
+    private:
+	SizeUnits(double factor, const std::string &name);
+	double _factor;
+	std::string _name;
     };
 
     /// Thin class to hold information about a single page
+    /// Packed into a single 64-bit word: the cookie (pfn or swap
+    /// entry) in the low COOKIE_BITS, flags in the bits above.
     class Page
     {
     public:
-	Page(PageCookie cookie, bool resident, bool writable);
-	bool is_mapped() const;
-	bool is_resident() const;
-	bool is_writable() const;
-	PageCookie cookie() const;
+	/// An unmapped page, so Pages can live in an array
+	Page() : _word(0) { }
+	/// Cookie bits above COOKIE_BITS are dropped
+	Page(PageCookie cookie, bool resident, bool writable)
+	    : _word((cookie & COOKIE_MASK)
+		    | (resident ? RESIDENT_FLAG : 0)
+		    | (writable ? WRITABLE_FLAG : 0)) { }
+	bool is_mapped() const { return (_word & COOKIE_MASK) != 0; }
+	bool is_resident() const { return _word & RESIDENT_FLAG; }
+	bool is_writable() const { return _word & WRITABLE_FLAG; }
+	PageCookie cookie() const { return _word & COOKIE_MASK; }
+	/// The page n on in a run of consecutive cookies with the same
+	/// flags as this one.
+	Page offset_by(unsigned long n) const {
+	    Page p(*this);
+	    p._word += n;
+	    return p;
+	}
+	/// True if this page is the next in such a run after prev
+	bool follows(const Page &prev) const {
+	    return _word == prev._word + 1;
+	}
 	void print(std::ostream &os) const;
+
+	/// Number of bits available for the cookie
+	static const int COOKIE_BITS = 56;
     private:
-	PageCookie _cookie;
-	int _resident : 1;
-	int _writable : 1;
+	static const uint64_t COOKIE_MASK = (1ULL << COOKIE_BITS) - 1;
+	static const uint64_t RESIDENT_FLAG = 1ULL << 63;
+	static const uint64_t WRITABLE_FLAG = 1ULL << 62;
+	uint64_t _word;
     };
     
 
@@ -187,12 +454,37 @@ namespace Exmap
 	Vma(Elf::Address start,
 		Elf::Address end,
 		off_t offset,
-		const std::string &fname);
+		const std::string &fname,
+		unsigned int perms = 0,
+		dev_t dev = 0,
+		ino_t inode = 0);
+	/// Same, but shares an interned name
+	Vma(Elf::Address start,
+		Elf::Address end,
+		off_t offset,
+		const NamePtr &fname,
+		unsigned int perms = 0,
+		dev_t dev = 0,
+		ino_t inode = 0);
+
+	/// Bits of the perms field
+	enum Perms {
+	    PERM_READ = 1,
+	    PERM_WRITE = 2,
+	    PERM_EXEC = 4,
+	    PERM_SHARED = 8,
+	};
 
 	PagePoolPtr &page_pool();
 	
-	/// Record that we own these pages
-	void add_pages(const std::list<Page> &pages);
+	/// Record that we own these pages, the first being at the given
+	/// address. Runs must be added in address order. Only mapped
+	/// pages are stored, the rest of the vma reads as unmapped, and
+	/// runs of pages with consecutive cookies are stored as their
+	/// first page. Returns how many pages from the front of the run
+	/// were taken: none if the run is out of order or starts outside
+	/// the vma, and only those within the vma if it runs past the end.
+	size_t add_pages(Elf::Address start, const Page *pages, size_t count);
 
 	/// The vma start address
 	Elf::Address start();
@@ -205,7 +497,10 @@ namespace Exmap
 	
 	/// The name of the underlying file (possibly [anon] or other
 	/// if there is no real file)
-	std::string fname();
+	const std::string &fname() { return *_fname; }
+
+	/// The same name, as shared with other vmas
+	const NamePtr &shared_name() { return _fname; }
 
 	/// The offset of the vma start within the file
 	/// (not a useful value unless the Vma is file backed)
@@ -214,6 +509,20 @@ namespace Exmap
 	/// The length of the VM area
 	Elf::Address vm_size();
 
+	/// The PERM_xxx flags from the maps file
+	unsigned int perms();
+	bool is_readable();
+	bool is_writable();
+	bool is_executable();
+	/// True for MAP_SHARED, false for private (copy on write) maps
+	bool is_shared();
+
+	/// The device of the backing file (0 if none)
+	dev_t dev();
+
+	/// The inode of the backing file (0 if none)
+	ino_t inode();
+
 	std::string to_string() const;
 
 	/// True if the vma is a special page - we generally wish to
@@ -229,37 +538,117 @@ namespace Exmap
 				    const FilePtr &previous_file,
 				    pid_t pid);
 
-	boost::shared_ptr<Vma> selfptr();
-	void selfptr(boost::shared_ptr<Vma> &p);
-
+	/// The number of (mapped) pages we store
 	int num_pages();
 
-	/// Struct to hold page + overlap info
-	struct PartialPageInfo
-	{
-	    PartialPageInfo(const Page &p,
-		    Elf::Address b) : page(p), bytes(b) { }
-	    Page page;
-	    Elf::Address bytes;
-	};
-	
-	/// Get a list of pages which cover the range, together
-	/// with the per-page size of the overlap with the range
-	/// (i.e. always page-size except at the start and end)
-	/// Does a lot of error checking, too.
-	bool get_pages_for_range(const RangePtr &mrange,
-				 std::list<PartialPageInfo> &info);
+	/// Release any spare page storage, once all pages are added
+	void shrink_pages();
+
+	/// The memory used to store our pages, in bytes
+	size_t page_storage_bytes();
+
+	/// The page at the given address (unmapped if we have none)
+	Page page_at(Elf::Address addr);
+
+	/// Set the totals for the whole vma, for summary snapshots
+	/// which have no pages.
+	void set_summary_sizes(const SizesPtr &sizes);
+
+	/// The totals for the whole vma, null unless this is from a
+	/// summary snapshot.
+	SizesPtr summary_sizes();
+
+	/// Pass the pages covering mrange to visitor. Doesn't check
+	/// mrange is within the vma unless set_check_ranges is on.
+	bool visit_pages(const Range &mrange, PageVisitor &visitor);
+
+	/// Check the ranges given to visit_pages and warn about bad
+	/// ones. Off unless EXMAP_CHECK_RANGES is set.
+	static void set_check_ranges(bool check);
+
+	/// Add the sizes of the pages within mrange to sizes, using
+	/// the counts in pp. The first call builds running totals
+	/// over the pages, so later calls only look at the two edge
+	/// pages, however large the range. The pool counts must be
+	/// final, and no pages may be added afterwards.
+	bool add_range_sizes(const PagePoolPtr &pp,
+			     const Range &mrange,
+			     Sizes &sizes) {
+	    return add_range_sizes<Sizes::ALL_MEASURES>(pp, mrange, sizes);
+	}
+	/// Same, but only the MEASURES (a Sizes::MeasureMask). See
+	/// Process::add_sizes for the masks which are instantiated.
+	template <unsigned MEASURES>
+	bool add_range_sizes(const PagePoolPtr &pp,
+			     const Range &mrange,
+			     Sizes &sizes);
 	
     private:
-	/// Get the pgnum (index into the page vector) of the given
+	/// Get the pgnum (page number within the vma) of the given
 	/// address.
-	bool addr_to_pgnum(Elf::Address addr, unsigned int &pgnum);
+	bool addr_to_pgnum(Elf::Address addr, unsigned long &pgnum);
+
+	/// The page for the pgnum (unmapped if we have none)
+	Page pgnum_to_page(unsigned long pgnum);
+
+	/// A run of consecutive mapped pages. The pages are either held
+	/// one per pgnum in _pages, or, if their cookies are
+	/// consecutive, just the first page is.
+	struct PageExtent
+	{
+	    /// pgnum of the first page
+	    unsigned long pgnum;
+	    /// number of pages in the run
+	    unsigned long count : 63;
+	    /// true if only the first page is held
+	    unsigned long contiguous : 1;
+	    /// index of the first page in _pages
+	    unsigned long index;
+	};
+
+	/// Store one mapped page after the existing ones
+	void append_page(unsigned long pgnum, const Page &page);
+
+	/// Totals over the mapped pages before some point in the
+	/// vma, one for each measure which depends on the page
+	struct PageTotals
+	{
+	    double effective_mapped;
+	    double effective_resident;
+	    unsigned int mapped;
+	    unsigned int sole_mapped;
+	    unsigned int resident;
+	    unsigned int writable;
+	};
+
+	/// Fill in _totals and _extent_ordinals from the page counts
+	void calc_totals(const PagePoolPtr &pp);
+
+	/// The number of mapped pages before pgnum
+	unsigned long mapped_pages_before(unsigned long pgnum);
+
+	/// True if visit_pages can use mrange
+	bool valid_range(const Range &mrange);
+
+	static bool _check_ranges;
+
 	
 	RangePtr _range;
 	off_t _offset;
-	std::string _fname;
+	NamePtr _fname;
+	unsigned int _perms;
+	dev_t _dev;
+	ino_t _inode;
+	/// Sorted, non-overlapping runs of mapped pages
+	std::vector<PageExtent> _extents;
+	/// The pages held by the extents, in address order
 	std::vector<Page> _pages;
-	boost::weak_ptr<Vma> _selfptr;
+	/// _totals[i] is the total over the first i mapped pages.
+	/// Empty until the first add_range_sizes.
+	std::vector<PageTotals> _totals;
+	/// The number of mapped pages before each extent
+	std::vector<unsigned long> _extent_ordinals;
+	SizesPtr _summary_sizes;
     };
 
     /// A map represents a range of memory (mem_range) within a
@@ -285,11 +674,30 @@ namespace Exmap
 	RangePtr elf_range() const;
 	/// Convert an elf-mem-range to a VMA memory range
 	RangePtr elf_to_mem_range(const RangePtr &elf_range);
+	/// Same, without allocating. False if elf_range isn't
+	/// within the map.
+	bool elf_to_mem_range(const Range &elf_range, Range &mem_range);
 	/// Return the sizes for the whole Map VMA mem range
 	SizesPtr sizes_for_mem_range(const PagePoolPtr &pp);
 	/// Return the sizes for a subrange of the vma mem range
 	SizesPtr sizes_for_mem_range(const PagePoolPtr &pp,
 				     const RangePtr &mrange);
+	/// Same, but takes a Range
+	SizesPtr sizes_for_mem_range(const PagePoolPtr &pp,
+				     const Range &mrange);
+	/// Add the sizes for a subrange of the vma mem range to sizes
+	bool add_sizes_for_mem_range(const PagePoolPtr &pp,
+				     const Range &mrange,
+				     Sizes &sizes) {
+	    return add_sizes_for_mem_range<Sizes::ALL_MEASURES>(pp,
+								mrange,
+								sizes);
+	}
+	/// Same, but only the MEASURES
+	template <unsigned MEASURES>
+	bool add_sizes_for_mem_range(const PagePoolPtr &pp,
+				     const Range &mrange,
+				     Sizes &sizes);
 	/// Represent the map in string form
 	std::string to_string() const;
 	/// Write the map to a ostream in string form
@@ -298,6 +706,11 @@ namespace Exmap
 	/// Add up all the sizes for a list of maps
 	static SizesPtr sum_sizes(const PagePoolPtr &pp,
 				  const std::list<MapPtr> &maps);
+	/// Add up the MEASURES of the whole of each map into sizes
+	template <unsigned MEASURES>
+	static void add_sum_sizes(const PagePoolPtr &pp,
+				  const std::list<MapPtr> &maps,
+				  Sizes &sizes);
 
 	/// Sort a list of MapPtr
 	static std::list<MapPtr> sort(const std::list<MapPtr> &maplist);
@@ -318,81 +731,250 @@ namespace Exmap
     {
     public:
 	File(const std::string &fname);
+	/// Same, but shares an interned name
+	File(const NamePtr &fname);
 	std::string name();
-	/// List of processes which map this file.
+	/// The same name, as shared with the vmas
+	const NamePtr &shared_name();
+	/// List of processes which map this file. Built on each call,
+	/// so the sizing code goes by the maps of each pid instead.
 	std::list<ProcessPtr> procs();
 	/// List of all maps which refer to this file (over many procs)
-	std::list<MapPtr> maps();
+	const std::list<MapPtr> &maps();
+	/// The maps of this file in one process (empty if none)
+	const std::list<MapPtr> &maps(pid_t pid);
 	/// Return the file ELF object if it is an ELF file, null o/w
 	Elf::FilePtr elf();
 	/// True if the file is an ELF file.
 	bool is_elf();
 	/// Return the sizes for all maps over this file.
 	SizesPtr sizes();
+	/// Add the MEASURES over all maps of this file to sizes,
+	/// without allocating. False if no process maps the file.
+	template <unsigned MEASURES>
+	bool add_sizes(Sizes &sizes);
 	/// Return the sizes for all maps in all processes over this elf range
 	SizesPtr sizes(const RangePtr &elf_range);
-
-	/// Register a map with this file
-	void add_map(const MapPtr &map);
-	/// Register a list of maps with this file
-	void add_maps(const std::list<MapPtr> &maps);
+	/// The sizes over each of a list of elf ranges (e.g. all the
+	/// symbols in a section), in all processes. results[i] is for
+	/// elf_ranges[i]. Much quicker than asking for each range in
+	/// turn. Ranges may overlap, and are quickest sorted by start.
+	bool sizes(const std::vector<Range> &elf_ranges,
+		   std::vector<Sizes> &results);
+
+	/// Register a map of this file in process pid
+	void add_map(pid_t pid, const MapPtr &map);
+	/// Register a list of maps of this file in process pid
+	void add_maps(pid_t pid, const std::list<MapPtr> &maps);
 	/// Register a proc with this file
 	void add_proc(const ProcessPtr &proc);
     private:
-	std::string _fname;
+	void load_elf();
+	NamePtr _fname;
 	std::list<MapPtr> _maps;
-	std::set<ProcessPtr> _procs;
+	/// The same maps grouped by process, so a (file, process)
+	/// query doesn't have to search the maps of every process
+	std::map<pid_t, std::list<MapPtr> > _proc_maps;
+	/// Weak, as the processes hold on to their files. Keyed on pid.
+	std::map<pid_t, boost::weak_ptr<Process> > _procs;
+	/// The page pool the processes share, null until one is added
+	PagePoolPtr _page_pool;
 	Elf::FilePtr _elf;
     };
 
-    /// Holds all the file objects, indexed by name
+    /// Holds all the file objects. A vma of a real file finds its
+    /// File by (dev, inode), so a file mapped under several paths
+    /// (e.g. the same library in many container mounts) is one File,
+    /// read once. Other vmas ([heap], [anon] etc) go by name.
     class FilePool
     {
     public:
 	void clear();
+	/// The file seen under this name, null if none. If distinct
+	/// files share the name, the first one seen.
 	FilePtr name_to_file(const std::string &name);
+	/// The file of this name, made if need be
 	FilePtr get_or_make_file(const std::string &name);
+	/// The file a vma maps, made if need be
+	FilePtr get_or_make_file(const VmaPtr &vma);
+	/// All the files, in name order
 	std::list<FilePtr> files();
     private:
-	std::map<std::string, FilePtr> _files;
+	/// Identity of a real file
+	struct FileId
+	{
+	    dev_t dev;
+	    ino_t inode;
+	    bool operator<(const FileId &other) const {
+		return dev < other.dev
+		    || (dev == other.dev && inode < other.inode);
+	    }
+	};
+	FilePtr make_file(const NamePtr &name);
+	std::map<FileId, FilePtr> _by_id;
+	/// Files without an id, by their interned name. Names are
+	/// compared by pointer, so this only finds names from the same
+	/// NamePool; _by_name catches the rest.
+	std::map<NamePtr, FilePtr> _by_shared_name;
+	/// Every name each file has been seen under
+	std::map<std::string, FilePtr> _by_name;
+	std::list<FilePtr> _files;
     };
     typedef boost::shared_ptr<FilePool> FilePoolPtr;
 
+    /// Open addressing (linear probing) hash table of counts, keyed
+    /// on page cookie. Cookie 0 marks an empty slot, so can't be
+    /// counted, but that's an unmapped page anyway.
+    class PageCountTable
+    {
+	friend class PagePool;
+    public:
+	PageCountTable();
+	/// Remove all counts
+	void clear();
+	/// The count for the cookie, 0 if never incremented
+	inline int count(PageCookie cookie) const {
+	    size_t i = slot(cookie);
+	    while (_slots[i].cookie != 0) {
+		if (_slots[i].cookie == cookie) {
+		    return _slots[i].count;
+		}
+		i = (i + 1) & _mask;
+	    }
+	    return 0;
+	};
+	/// Add one to the count for the cookie. Cookie 0 is ignored.
+	inline void increment(PageCookie cookie) {
+	    add(cookie, 1);
+	};
+	/// Add n to the count for the cookie. Cookie 0 is ignored.
+	inline void add(PageCookie cookie, int n) {
+	    if (cookie == 0) {
+		return;
+	    }
+	    if ((_size + 1) * 2 > _slots.size()) {
+		grow();
+	    }
+	    size_t i = slot(cookie);
+	    while (_slots[i].cookie != cookie) {
+		if (_slots[i].cookie == 0) {
+		    _slots[i].cookie = cookie;
+		    ++_size;
+		    break;
+		}
+		i = (i + 1) & _mask;
+	    }
+	    _slots[i].count += n;
+	};
+	/// Count the mapped pages of an array
+	inline void add_pages(const Page *pages, size_t count) {
+	    for (size_t i = 0; i < count; ++i) {
+		increment(pages[i].cookie());
+	    }
+	};
+	/// Number of distinct cookies counted
+	size_t size() const { return _size; }
+    private:
+	struct Slot
+	{
+	    PageCookie cookie;
+	    int count;
+	};
+	/// Fibonacci hashing: the top bits of cookie * 2^64/phi
+	inline size_t slot(PageCookie cookie) const {
+	    return (size_t) ((cookie * 0x9E3779B97F4A7C15ULL) >> _shift);
+	};
+	/// Double the number of slots
+	void grow();
+	std::vector<Slot> _slots;
+	size_t _size;
+	size_t _mask;
+	int _shift;
+    };
+
     /// Hold information regarding each page in use
     class PagePool
     {
     public:
-	/// Empty the pagepool
+	/// Empty the pagepool, and go back to counting every page in
+	/// the hash table
 	void clear();
+	/// Count pages with cookies below limit (i.e. pfns, if the
+	/// limit is max_pfn) in an array indexed by cookie rather
+	/// than the hash table. Must be set before any counting.
+	void set_dense_limit(PageCookie limit);
+	/// The dense limit, 0 if every page is hashed
+	PageCookie dense_limit() const { return _dense.size(); }
+	/// True if counting num_cookies distinct cookies below limit
+	/// takes less memory in the dense array than in the hash table.
+	/// The array has an entry for every cookie up to the limit,
+	/// counted or not.
+	static bool dense_is_smaller(PageCookie limit, PageCookie num_cookies);
 	/// Fetch the usage count of a page
-	inline int count(const Page &page) {
-	    return _counts[page.cookie()];
+	inline int count(const Page &page) const {
+	    PageCookie cookie = page.cookie();
+	    if (cookie < _dense.size()) {
+		return _dense[cookie];
+	    }
+	    return _table.count(cookie);
 	};
+	/// Fetch the usage counts of an array of pages into counts,
+	/// 0 for unmapped pages. Returns the number of mapped pages
+	/// which have no count.
+	size_t counts(const Page *pages, size_t n, int32_t *counts) const;
 	/// Increase the count of a page (to 1 if the page is previously
-	/// unseen).
+	/// unseen). Not locked.
 	inline void inc_page_count(const Page &page) {
-	    _counts[page.cookie()] = _counts[page.cookie()]++;
-	};
-	/// Increase the count of a list of pages.
-	inline void inc_pages_count(const std::list<Page> &pages) {
-	    std::list<Page>::const_iterator it;
-	    for (it = pages.begin(); it != pages.end(); ++it) {
-		inc_page_count(*it);
+	    PageCookie cookie = page.cookie();
+	    if (cookie < _dense.size()) {
+		++_dense[cookie];
+	    }
+	    else {
+		_table.increment(cookie);
 	    }
 	};
+	/// Increase the count of an array of pages. Unmapped pages
+	/// aren't counted. Safe to call from several threads at once:
+	/// pages below the dense limit are counted with atomic
+	/// increments, only the rest take a lock.
+	void inc_pages_count(const Page *pages, size_t count);
+	/// Same, but the pages beyond the dense limit are counted in
+	/// overflow, to be merged later, so no lock is taken. Each
+	/// thread needs its own overflow table.
+	void inc_pages_count(const Page *pages,
+			     size_t count,
+			     PageCountTable &overflow);
+	/// Add in the counts from a table, e.g. one which a thread has
+	/// been counting its pages in. Not locked.
+	void merge(const PageCountTable &shard);
 
     private:
-	std::map<PageCookie, int> _counts;
+	/// Counts indexed by cookie, for cookies below the dense limit
+	std::vector<int> _dense;
+	/// Counts for all other cookies
+	PageCountTable _table;
+	jutil::Mutex _lock;
     };
 
     
-    /// Hold the information about one process.
-    class Process
+    /// Hold the information about one process. While loading, the
+    /// process is the sink for its page info, which goes straight
+    /// into the owning vmas.
+    class Process : public PageSink,
+		    public boost::enable_shared_from_this<Process>
     {
     public:
 	Process(const PagePoolPtr &pp, pid_t pid);
 	/// Load the pid-specific information from the sysinfo
-	bool load(SysInfoPtr &sys_info);
+	/// If shard is given, page counts go there rather than the
+	/// page pool, to be merged into the pool later. If overflow is
+	/// given, only pages below the pool's dense limit are counted
+	/// in the pool, and the rest go there.
+	bool load(SysInfoPtr &sys_info,
+		  PageCountTable *shard = NULL,
+		  PageCountTable *overflow = NULL);
+	/// Load the vmas and their usage totals but no page info.
+	bool load_summary(SysInfoPtr &sys_info);
 	/// True if the process has its own memory region (some kernel threads
 	/// have pids but no mem).
 	bool has_mm();
@@ -403,38 +985,69 @@ namespace Exmap
 	/// The list of files the process maps
 	std::list<FilePtr> files();
 	/// List of all maps which refer to this process (over all files)
-	std::list<MapPtr> maps();
+	const std::list<MapPtr> &maps();
+	/// The vmas of the process, in address order
+	const std::vector<VmaPtr> &vmas();
+	/// The vma containing addr, or null if addr isn't mapped
+	VmaPtr vma_at(Elf::Address addr);
 	/// The sizes over all the process maps
 	SizesPtr sizes();
 	/// The sizes over all the maps associated with a given file
 	SizesPtr sizes(const FilePtr &file);
+	/// Add the MEASURES (a Sizes::MeasureMask) over all the process
+	/// maps to sizes, skipping the work for the other measures.
+	/// The sizing templates are instantiated in Exmap.cpp for
+	/// Sizes::ALL_MEASURES and Sizes::EFFECTIVE_RESIDENT_BIT.
+	template <unsigned MEASURES>
+	void add_sizes(Sizes &sizes);
+	/// Same, over all the maps associated with a given file
+	template <unsigned MEASURES>
+	void add_sizes(const FilePtr &file, Sizes &sizes);
 	/// The sizes over a given elf range associated with a given file
 	SizesPtr sizes(const FilePtr &file,
 		       const RangePtr &elf_range);
+	/// The sizes over each of a list of elf ranges associated with a
+	/// given file, as for File::sizes
+	bool sizes(const FilePtr &file,
+		   const std::vector<Range> &elf_ranges,
+		   std::vector<Sizes> &results);
 	/// Process the vma info into a collection of maps. Also associates
 	/// the maps with the files and processes.
 	bool calculate_maps(FilePoolPtr &file_pool);
-	/// Todo - private ctors and write a factory method which removes the
-	/// need for selfptr()
-	boost::shared_ptr<Process> selfptr();
-	/// Todo - private ctors and write a factory method which removes the
-	/// need for selfptr()
-	void selfptr(boost::shared_ptr<Process> &p);
+	/// Make one map for each vma of a summary load. Maps have no
+	/// ELF ranges, so section and symbol sizes aren't available.
+	bool calculate_summary_maps(FilePoolPtr &file_pool);
 	/// Associate a file with this process
 	void add_file(const FilePtr &file);
 	/// Retrieve the page_pool
 	const PagePoolPtr &page_pool();
 	/// Write some process info to the ostream
 	void print(std::ostream &os) const;
+	/// PageSink: store the pages in the vma containing them
+	virtual void add_pages(Elf::Address start,
+			       const Page *pages,
+			       size_t count);
     private:
+	void load_cmdline(SysInfoPtr &sys_info);
 	void remove_ignorable_if_nopages();
-	boost::weak_ptr<Process> _selfptr;
 	bool load_page_info(SysInfoPtr &sys_info);
 	bool find_vma_by_addr(Elf::Address start,
 			       VmaPtr &current_vma);
-	std::list<MapPtr> restrict_maps_to_file(const FilePtr &file);
-	/// The ordered list of vmas read from /proc/xxx/maps.
-	std::list<VmaPtr> _vmas;
+	std::vector<VmaPtr>::iterator find_vma_containing(Elf::Address addr);
+	const std::list<MapPtr> &restrict_maps_to_file(const FilePtr &file);
+	/// The ordered vmas read from /proc/xxx/maps. Sorted by start
+	/// and non-overlapping, so lookups are binary searches.
+	std::vector<VmaPtr> _vmas;
+
+	/// The vma the last pages were added to
+	std::vector<VmaPtr>::iterator _sink_vma;
+
+	/// Where page counts go while loading, if not the page pool
+	PageCountTable *_shard;
+
+	/// Where counts for pages beyond the dense limit go while
+	/// loading, if not the page pool
+	PageCountTable *_overflow;
 
 	/// The pid of this process.
 	pid_t _pid;
@@ -446,7 +1059,7 @@ namespace Exmap
 
 	std::set<FilePtr> _files;
 
-	const PagePoolPtr &_page_pool;
+	PagePoolPtr _page_pool;
     };
 
     /// Hold info about one complete snapshot of process info
@@ -476,6 +1089,41 @@ namespace Exmap
 	
 	/// Load the snapshot
 	bool load();
+
+	/// Set the number of threads used to load the processes. 1
+	/// (the default) loads them one after another. Only used if the
+	/// sysinfo is thread safe.
+	void set_num_threads(int num_threads);
+
+	/// The number of threads which will be used to load processes
+	int num_threads();
+
+	/// Thread count from the EXMAP_THREADS environment variable (0
+	/// meaning one per cpu), or 1 if it isn't set.
+	static int default_num_threads();
+
+	/// How page counts are gathered when loading with threads
+	enum CountMode {
+	    /// Atomic increments into the page pool's dense counts.
+	    /// Pages beyond the dense limit (or every page, if the pool
+	    /// has none) are counted as for COUNT_SHARDED.
+	    COUNT_ATOMIC,
+	    /// Each thread counts into its own table, and the tables
+	    /// are merged into the page pool afterwards
+	    COUNT_SHARDED,
+	};
+
+	/// Set how pages are counted when loading with threads
+	void set_count_mode(CountMode mode);
+
+	/// Only load the per-vma usage totals the kernel keeps in
+	/// /proc/xxx/smaps rather than every page. This is much faster
+	/// and needs neither the module nor root, but only gives
+	/// process and file sizes. Must be set before load().
+	void set_summary_only(bool summary_only);
+
+	/// True if this is a summary snapshot
+	bool summary_only();
     private:
 
 	// ----------------------------------------
@@ -485,6 +1133,24 @@ namespace Exmap
 	/// Load the pid list as procs.
 	bool load_procs(const std::list<pid_t> &pids);
 
+	/// Load the pid list as procs, using a pool of _num_threads threads
+	void load_procs_threaded(const std::list<pid_t> &pids);
+
+	/// Shared state for the load_procs_threaded workers
+	struct LoadWork;
+
+	/// Per-thread state for the load_procs_threaded workers
+	struct LoadThread;
+
+	/// Thread body for load_procs_threaded
+	static void *load_worker(void *arg);
+
+	/// Load a single proc. Null if it fails or has no mm. Page
+	/// counts go into the thread's table if given, all of them
+	/// for COUNT_SHARDED and those the pool doesn't count densely
+	/// for COUNT_ATOMIC.
+	ProcessPtr load_proc(pid_t pid, PageCountTable *counts = NULL);
+
 	/// Calculate the ELF file->VMA mappings
 	bool calculate_file_mappings();
 
@@ -503,6 +1169,15 @@ namespace Exmap
 
 	/// Source of our information about processes
 	SysInfoPtr &_sys_info;
+
+	/// Number of threads to load procs with
+	int _num_threads;
+
+	/// Load from smaps rather than page info
+	bool _summary_only;
+
+	/// How threads count pages
+	CountMode _count_mode;
     };
     typedef boost::shared_ptr<Snapshot> SnapshotPtr;
 
@@ -511,7 +1186,7 @@ namespace Exmap
     {
 	public:
 	    /// Init the calculator. The calculator is per-proc, per vma-list
-	    MapCalculator(const std::list<VmaPtr> &vmas,
+	    MapCalculator(const std::vector<VmaPtr> &vmas,
 		    FilePoolPtr &file_pool,
 		    const ProcessPtr &proc);
 
@@ -519,11 +1194,12 @@ namespace Exmap
 	    bool calc_maps(std::list<MapPtr> &maps);
 	private:
 
-	    bool calc_maps_for_file(const std::string &fname);
-	    bool calc_maps_for_elf_file(const std::string &fname,
-		    const FilePtr &file);
-	    bool calc_maps_for_nonelf_file(const std::string &fname,
-		    const FilePtr &file);
+	    bool calc_maps_for_file(const FilePtr &file,
+		    const std::list<VmaPtr> &filevmas);
+	    bool calc_maps_for_elf_file(const FilePtr &file,
+		    std::list<VmaPtr> filevmas);
+	    bool calc_maps_for_nonelf_file(const FilePtr &file,
+		    const std::list<VmaPtr> &filevmas);
 	    bool calc_map_for_seg(const FilePtr &file,
 		    const Elf::SegmentPtr &seg,
 		    std::list<VmaPtr> &vmas);
@@ -531,9 +1207,11 @@ namespace Exmap
 	    bool sanity_check(const std::list<MapPtr> &maps);
 	    void walk_vma_files();
 	    std::string dump_maps_to_string(const std::list<MapPtr> &maps);
-	    std::map<std::string, std::list<Exmap::VmaPtr> > _fname_to_vmas;
+	    /// The vmas of each file, and the non file backed vmas
+	    /// which follow them
+	    std::map<FilePtr, std::list<Exmap::VmaPtr> > _file_to_vmas;
 
-	    std::list<VmaPtr> _vmas;
+	    const std::vector<VmaPtr> &_vmas;
 	    FilePoolPtr _file_pool;
 	    const ProcessPtr _proc;
 	    std::list<MapPtr> _maps;
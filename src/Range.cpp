@@ -2,30 +2,18 @@
  * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
  */
 #include <sstream>
+#include <algorithm>
 #include "Range.hpp"
 
 using namespace std;
 
-Range::Range(unsigned long start, unsigned long end)
-    : _start(start),
-      _end(end)
-{ }
-
-unsigned long Range::start() const { return _start; }
-unsigned long Range::end() const { return _end; }
-unsigned long Range::size() const
-{
-    return _end - _start;
-}
-    
 RangePtr Range::intersect(const Range &r) const
 {
-    if (!overlaps(r)) {
+    Range result;
+    if (!intersect(r, result)) {
 	return RangePtr((Range *) 0);
     }
-    unsigned long start = (_start > r._start) ? _start : r._start;
-    unsigned long end = (_end > r._end) ? r._end : _end;
-    return RangePtr(new Range(start, end));
+    return RangePtr(new Range(result));
 }
 
 RangePtr Range::intersect(const RangePtr &r) const
@@ -53,7 +41,7 @@ void Range::print(std::ostream &os) const
 
 RangePtr Range::add(unsigned long v) const
 {
-    return RangePtr(new Range(_start + v, _end + v));
+    return RangePtr(new Range(shifted(v)));
 }
 
 RangePtr Range::subtract(unsigned long v) const
@@ -61,11 +49,6 @@ RangePtr Range::subtract(unsigned long v) const
     return add(-v);
 }
 
-bool Range::contains(unsigned long v) const
-{
-    return _start <= v && v < _end;
-}
-
 bool Range::contains(const RangePtr &r) const
 {
     if (!r) { return false; }
@@ -74,15 +57,8 @@ bool Range::contains(const RangePtr &r) const
 
 bool Range::contains(const Range &r) const
 {
-    RangePtr is = intersect(r);
-    return is && *is == r;
-}
-
-bool Range::overlaps(const Range &r) const
-{
-    return contains(r._start)
-	|| r.contains(_start)
-	|| (r._start <= _start && _end < r._end);
+    Range is;
+    return intersect(r, is) && is == r;
 }
 
 RangePtr Range::truncate_below(unsigned long v) const
@@ -101,20 +77,11 @@ RangePtr Range::truncate_above(unsigned long v) const
 
 RangePtr Range::merge(const Range &r) const
 {
-    if (_end == r._start) {
-	return RangePtr(new Range(_start, r._end));
-    }
-    if (_start == r._end) {
-	return RangePtr(new Range(r._start, _end));
-    }
-    if (overlaps(r)) {
-	unsigned long start = _start < r._start ? _start : r._start;
-	unsigned long end = _end > r._end ? _end : r._end;
-	return RangePtr(new Range(start, end));
-    }
-    else {
+    Range result;
+    if (!merge(r, result)) {
 	return RangePtr((Range *) 0);
     }
+    return RangePtr(new Range(result));
 }
 
 string Range::to_string() const
@@ -221,6 +188,68 @@ bool Range::any_overlap(const list<RangePtr> &arg)
     return false;
 }
 
+void Range::merge_in_place(vector<Range> &v)
+{
+    if (v.empty()) { return; }
+    sort(v.begin(), v.end());
+
+    // Sorted by start, so each range either extends the last output
+    // range or starts a new one
+    vector<Range>::iterator out = v.begin();
+    vector<Range>::iterator it;
+    for (it = v.begin() + 1; it != v.end(); ++it) {
+	if (it->_start <= out->_end) {
+	    if (it->_end > out->_end) {
+		out->_end = it->_end;
+	    }
+	}
+	else {
+	    *(++out) = *it;
+	}
+    }
+    v.erase(out + 1, v.end());
+}
+
+/// Orders merged ranges by end, to find the first one reaching past v
+static bool ends_at_or_before(const Range &r, unsigned long v)
+{
+    return r.end() <= v;
+}
+
+void Range::restrict_sorted(const vector<Range> &merged,
+			    vector<Range> &result) const
+{
+    result.clear();
+    // The merged ranges are disjoint, so their ends are sorted too
+    vector<Range>::const_iterator it;
+    it = lower_bound(merged.begin(), merged.end(), _start, ends_at_or_before);
+    for (; it != merged.end() && it->_start < _end; ++it) {
+	Range subr = it->clamp(_start, _end);
+	if (subr.size() > 0) {
+	    result.push_back(subr);
+	}
+    }
+}
+
+void Range::invert_sorted(const vector<Range> &merged,
+			  vector<Range> &result) const
+{
+    result.clear();
+    unsigned long val = _start;
+    vector<Range>::const_iterator it;
+    it = lower_bound(merged.begin(), merged.end(), _start, ends_at_or_before);
+    for (; it != merged.end() && it->_start < _end; ++it) {
+	if (it->size() == 0) { continue; }
+	if (val < it->_start) {
+	    result.push_back(Range(val, it->_start));
+	}
+	val = it->_end;
+    }
+    if (val < _end) {
+	result.push_back(Range(val, _end));
+    }
+}
+
 ostream &operator<<(ostream &os, const Range &r)
 {
     r.print(os);
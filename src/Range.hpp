@@ -6,22 +6,66 @@
 
 #include <string>
 #include <list>
+#include <vector>
 
 #include <boost/shared_ptr.hpp>
 
 class Range;
 typedef boost::shared_ptr<Range> RangePtr;
-/// Handle manipulation of half-open (start <= x < end) ranges
+/// Handle manipulation of half-open (start <= x < end) ranges.
+///
+/// A Range is two words and cheap to copy. The methods that return a
+/// RangePtr allocate, so code on a hot path should use the value
+/// forms (intersect(r, result), shifted(), clamp(), merge(r, result))
+/// and the std::vector<Range> list operations below.
 class Range
 {
 public:
-    Range(unsigned long start, unsigned long end);
+    /// The empty range (0, 0), so Ranges can live in a vector
+    Range() : _start(0), _end(0) { }
+    Range(unsigned long start, unsigned long end)
+	: _start(start), _end(end) { }
     /// The range start
-    unsigned long start() const;
+    unsigned long start() const { return _start; }
     /// The range end
-    unsigned long end() const;
+    unsigned long end() const { return _end; }
     /// The range length (note that (x, x) has a size of zero)
-    unsigned long size() const;
+    unsigned long size() const { return _end - _start; }
+
+    /// Set result to the intersection and return true, or return
+    /// false if the intersection is empty
+    bool intersect(const Range &r, Range &result) const
+    {
+	if (!overlaps(r)) { return false; }
+	result = Range(_start > r._start ? _start : r._start,
+		       _end > r._end ? r._end : _end);
+	return true;
+    }
+    /// The range moved up by v. Arithmetic wraps, so shifted(-v)
+    /// moves it down.
+    Range shifted(unsigned long v) const
+    {
+	return Range(_start + v, _end + v);
+    }
+    /// The range clipped to [lo, hi]. Clipping a range that lies
+    /// wholly outside gives an empty range at lo or hi.
+    Range clamp(unsigned long lo, unsigned long hi) const
+    {
+	unsigned long start = _start < lo ? lo : (_start > hi ? hi : _start);
+	unsigned long end = _end < lo ? lo : (_end > hi ? hi : _end);
+	return Range(start, end);
+    }
+    /// Set result to the union of two overlapping or adjacent ranges
+    /// and return true, or return false if there is a gap between them
+    bool merge(const Range &r, Range &result) const
+    {
+	if (_end != r._start && _start != r._end && !overlaps(r)) {
+	    return false;
+	}
+	result = Range(_start < r._start ? _start : r._start,
+		       _end > r._end ? _end : r._end);
+	return true;
+    }
     
     /// Return a newly allocated Range which is the intersection
     /// (null if intersection is empty)
@@ -39,16 +83,24 @@ public:
     /// Return new range shifted down by v
     RangePtr subtract(unsigned long v) const;
     /// True if the range contains v (remember ranges don't contain the end)
-    bool contains(unsigned long v) const;
+    bool contains(unsigned long v) const
+    {
+	return _start <= v && v < _end;
+    }
     /// True if the range contains both start and end of r
     bool contains(const Range &r) const;
     /// Same, but takes a RangePtr
     bool contains(const RangePtr &r) const;
     /// True if the intersection with r is non-empty
-    bool overlaps(const Range &r) const;
+    bool overlaps(const Range &r) const
+    {
+	return contains(r._start)
+	    || r.contains(_start)
+	    || (r._start <= _start && _end < r._end);
+    }
     /// Same, but takes a RangePtr
     bool overlaps(const RangePtr &r) const;
-    /// Returns a 
+    /// Returns a new range with any part below v moved up to v
     RangePtr truncate_below(unsigned long v) const;
     RangePtr truncate_above(unsigned long v) const;
     RangePtr merge(const Range &r) const;
@@ -63,6 +115,24 @@ public:
 
     /// True if any of the ranges overlap
     static bool any_overlap(const std::list<RangePtr> &l);
+
+    // The vector forms of merge_list, restrict and invert_list. They
+    // don't allocate once the vectors have grown, so a caller which
+    // restricts or inverts against the same list many times merges it
+    // once and reuses the result vector.
+
+    /// Sort v by start and merge overlapping and adjacent ranges, in place
+    static void merge_in_place(std::vector<Range> &v);
+
+    /// Set result to the parts of merged which lie within this range.
+    /// merged must be the output of merge_in_place.
+    void restrict_sorted(const std::vector<Range> &merged,
+			 std::vector<Range> &result) const;
+
+    /// Set result to the parts of this range not covered by merged.
+    /// merged must be the output of merge_in_place.
+    void invert_sorted(const std::vector<Range> &merged,
+		       std::vector<Range> &result) const;
     
 private:
     unsigned long _start;
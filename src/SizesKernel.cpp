@@ -0,0 +1,332 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#include "SizesKernel.hpp"
+
+#include <string>
+#include <stdlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EXMAP_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace Exmap;
+using namespace jutil;
+
+void SpanSizes::add_to(Sizes &sizes,
+		       Elf::Address page_size,
+		       unsigned measures) const
+{
+    double values[Sizes::NUM_SIZES] = { 0 };
+    values[Sizes::MAPPED] = (double) mapped * page_size;
+    values[Sizes::EFFECTIVE_MAPPED] = effective_mapped * page_size;
+    values[Sizes::SOLE_MAPPED] = (double) sole_mapped * page_size;
+    values[Sizes::RESIDENT] = (double) resident * page_size;
+    values[Sizes::EFFECTIVE_RESIDENT] = effective_resident * page_size;
+    values[Sizes::WRITABLE] = (double) writable * page_size;
+    for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
+	if (i != Sizes::VM && (measures & (1 << i))) {
+	    sizes.increase((Sizes::Measure) i, values[i]);
+	}
+    }
+}
+
+// ------------------------------------------------------------
+
+// Picked on first use rather than at static init time, since it may
+// need to warn and the warn stream may not be constructed yet
+SizesKernel::Kind SizesKernel::_chosen_kind = SizesKernel::NUM_KINDS;
+SizesKernel::Function SizesKernel::_chosen = SizesKernel::add_first;
+
+void SizesKernel::add_first(const Page *pages,
+			    const int32_t *counts,
+			    size_t n,
+			    SpanSizes &sizes)
+{
+    chosen();
+    _chosen(pages, counts, n, sizes);
+}
+
+SizesKernel::Kind SizesKernel::best()
+{
+    const char *cp = getenv("EXMAP_SIZES_KERNEL");
+    if (cp != NULL) {
+	for (int i = 0; i < NUM_KINDS; ++i) {
+	    Kind kind = (Kind) i;
+	    if (name(kind) == string(cp) && supported(kind)) {
+		return kind;
+	    }
+	}
+	warn << "Unusable EXMAP_SIZES_KERNEL " << cp << ", guessing\n";
+    }
+    if (supported(AVX2)) {
+	return AVX2;
+    }
+    if (supported(SSE2)) {
+	return SSE2;
+    }
+    return SCALAR;
+}
+
+SizesKernel::Kind SizesKernel::chosen()
+{
+    if (_chosen_kind == NUM_KINDS) {
+	choose(best());
+    }
+    return _chosen_kind;
+}
+
+bool SizesKernel::choose(Kind kind)
+{
+    if (!supported(kind)) {
+	return false;
+    }
+    _chosen_kind = kind;
+    _chosen = function(kind);
+    return true;
+}
+
+bool SizesKernel::supported(Kind kind)
+{
+    switch (kind) {
+    case SCALAR:
+	return true;
+#ifdef EXMAP_X86_KERNELS
+    case SSE2:
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+    case AVX2:
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+    default:
+	return false;
+    }
+}
+
+SizesKernel::Function SizesKernel::function(Kind kind)
+{
+    if (!supported(kind)) {
+	return NULL;
+    }
+    switch (kind) {
+    case SSE2:
+	return add_sse2;
+    case AVX2:
+	return add_avx2;
+    default:
+	return add_scalar;
+    }
+}
+
+const char *SizesKernel::name(Kind kind)
+{
+    switch (kind) {
+    case SCALAR:
+	return "scalar";
+    case SSE2:
+	return "sse2";
+    case AVX2:
+	return "avx2";
+    default:
+	return "unknown";
+    }
+}
+
+void SizesKernel::add_scalar(const Page *pages,
+			     const int32_t *counts,
+			     size_t n,
+			     SpanSizes &sizes)
+{
+    for (size_t i = 0; i < n; ++i) {
+	int count = counts[i];
+	if (count <= 0) {
+	    continue;
+	}
+	double share = 1.0 / count;
+	sizes.mapped++;
+	sizes.effective_mapped += share;
+	if (count == 1) {
+	    sizes.sole_mapped++;
+	}
+	if (pages[i].is_resident()) {
+	    sizes.resident++;
+	    sizes.effective_resident += share;
+	    if (pages[i].is_writable()) {
+		sizes.writable++;
+	    }
+	}
+    }
+}
+
+#ifdef EXMAP_X86_KERNELS
+
+// The vector kernels turn the page flags into lane masks with
+// arithmetic shifts, so they rely on where Page keeps them: resident
+// in the top bit of the word and writable in the one below it.
+// They read the words straight out of the Page array.
+typedef char page_is_one_word[sizeof(Page) == sizeof(uint64_t) ? 1 : -1];
+
+/// All ones in each 64 bit lane whose top bit is set
+__attribute__((target("sse2")))
+static inline __m128i top_bit_mask(__m128i words)
+{
+    return _mm_shuffle_epi32(_mm_srai_epi32(words, 31),
+			     _MM_SHUFFLE(3, 3, 1, 1));
+}
+
+__attribute__((target("sse2")))
+static inline uint64_t lane_sum(__m128i v)
+{
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, v);
+    return lanes[0] + lanes[1];
+}
+
+__attribute__((target("sse2")))
+void SizesKernel::add_sse2(const Page *pages,
+			   const int32_t *counts,
+			   size_t n,
+			   SpanSizes &sizes)
+{
+    const uint64_t *words = reinterpret_cast<const uint64_t *>(pages);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128d done = _mm_set1_pd(1.0);
+    __m128d effective_mapped = _mm_setzero_pd();
+    __m128d effective_resident = _mm_setzero_pd();
+    __m128i mapped = zero, sole_mapped = zero;
+    __m128i resident = zero, writable = zero;
+
+    size_t i;
+    for (i = 0; i + 2 <= n; i += 2) {
+	__m128i count = _mm_loadl_epi64((const __m128i *) (counts + i));
+	__m128i valid = _mm_cmpgt_epi32(count, zero);
+	__m128i sole = _mm_cmpeq_epi32(count, one);
+	valid = _mm_unpacklo_epi32(valid, valid);
+	sole = _mm_unpacklo_epi32(sole, sole);
+
+	__m128i word = _mm_loadu_si128((const __m128i *) (words + i));
+	__m128i res = _mm_and_si128(valid, top_bit_mask(word));
+	__m128i wr = _mm_and_si128(res,
+				   top_bit_mask(_mm_slli_epi64(word, 1)));
+
+	// Lanes with a zero count divide to inf, masked off here
+	__m128d share = _mm_div_pd(done, _mm_cvtepi32_pd(count));
+	share = _mm_and_pd(share, _mm_castsi128_pd(valid));
+	effective_mapped = _mm_add_pd(effective_mapped, share);
+	effective_resident
+	    = _mm_add_pd(effective_resident,
+			 _mm_and_pd(share, _mm_castsi128_pd(res)));
+
+	// Masks are -1, so subtracting them counts
+	mapped = _mm_sub_epi64(mapped, valid);
+	sole_mapped = _mm_sub_epi64(sole_mapped, sole);
+	resident = _mm_sub_epi64(resident, res);
+	writable = _mm_sub_epi64(writable, wr);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, effective_mapped);
+    sizes.effective_mapped += lanes[0] + lanes[1];
+    _mm_storeu_pd(lanes, effective_resident);
+    sizes.effective_resident += lanes[0] + lanes[1];
+    sizes.mapped += lane_sum(mapped);
+    sizes.sole_mapped += lane_sum(sole_mapped);
+    sizes.resident += lane_sum(resident);
+    sizes.writable += lane_sum(writable);
+
+    add_scalar(pages + i, counts + i, n - i, sizes);
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t lane_sum(__m256i v)
+{
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, v);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+static inline double lane_sum(__m256d v)
+{
+    double lanes[4];
+    _mm256_storeu_pd(lanes, v);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+void SizesKernel::add_avx2(const Page *pages,
+			   const int32_t *counts,
+			   size_t n,
+			   SpanSizes &sizes)
+{
+    const uint64_t *words = reinterpret_cast<const uint64_t *>(pages);
+    const __m128i zero4 = _mm_setzero_si128();
+    const __m128i one4 = _mm_set1_epi32(1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256d done = _mm256_set1_pd(1.0);
+    __m256d effective_mapped = _mm256_setzero_pd();
+    __m256d effective_resident = _mm256_setzero_pd();
+    __m256i mapped = zero, sole_mapped = zero;
+    __m256i resident = zero, writable = zero;
+
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m128i count = _mm_loadu_si128((const __m128i *) (counts + i));
+	__m256i valid = _mm256_cvtepi32_epi64(_mm_cmpgt_epi32(count, zero4));
+	__m256i sole = _mm256_cvtepi32_epi64(_mm_cmpeq_epi32(count, one4));
+
+	__m256i word = _mm256_loadu_si256((const __m256i *) (words + i));
+	__m256i res = _mm256_and_si256(valid,
+				       _mm256_cmpgt_epi64(zero, word));
+	__m256i wr = _mm256_and_si256(
+	    res, _mm256_cmpgt_epi64(zero, _mm256_slli_epi64(word, 1)));
+
+	// Lanes with a zero count divide to inf, masked off here
+	__m256d share = _mm256_div_pd(done, _mm256_cvtepi32_pd(count));
+	share = _mm256_and_pd(share, _mm256_castsi256_pd(valid));
+	effective_mapped = _mm256_add_pd(effective_mapped, share);
+	effective_resident
+	    = _mm256_add_pd(effective_resident,
+			    _mm256_and_pd(share, _mm256_castsi256_pd(res)));
+
+	// Masks are -1, so subtracting them counts
+	mapped = _mm256_sub_epi64(mapped, valid);
+	sole_mapped = _mm256_sub_epi64(sole_mapped, sole);
+	resident = _mm256_sub_epi64(resident, res);
+	writable = _mm256_sub_epi64(writable, wr);
+    }
+
+    sizes.effective_mapped += lane_sum(effective_mapped);
+    sizes.effective_resident += lane_sum(effective_resident);
+    sizes.mapped += lane_sum(mapped);
+    sizes.sole_mapped += lane_sum(sole_mapped);
+    sizes.resident += lane_sum(resident);
+    sizes.writable += lane_sum(writable);
+
+    add_scalar(pages + i, counts + i, n - i, sizes);
+}
+
+#else
+
+// No vector kernels off x86; supported() never offers them
+void SizesKernel::add_sse2(const Page *pages,
+			   const int32_t *counts,
+			   size_t n,
+			   SpanSizes &sizes)
+{
+    add_scalar(pages, counts, n, sizes);
+}
+
+void SizesKernel::add_avx2(const Page *pages,
+			   const int32_t *counts,
+			   size_t n,
+			   SpanSizes &sizes)
+{
+    add_scalar(pages, counts, n, sizes);
+}
+
+#endif
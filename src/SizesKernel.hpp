@@ -0,0 +1,104 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#ifndef _SIZESKERNEL_H
+#define _SIZESKERNEL_H
+
+#include "Exmap.hpp"
+
+#include <stdint.h>
+
+namespace Exmap
+{
+    /// Page measures of a run of whole pages, counted in pages. The
+    /// effective sizes are sums of 1/count.
+    struct SpanSizes
+    {
+	SpanSizes()
+	    : effective_mapped(0), effective_resident(0),
+	      mapped(0), sole_mapped(0), resident(0), writable(0) { }
+	double effective_mapped;
+	double effective_resident;
+	uint64_t mapped;
+	uint64_t sole_mapped;
+	uint64_t resident;
+	uint64_t writable;
+	/// Add these pages to those of the measures (a
+	/// Sizes::MeasureMask) which a span has, in bytes
+	void add_to(Sizes &sizes,
+		    Elf::Address page_size,
+		    unsigned measures = Sizes::ALL_MEASURES) const;
+    };
+
+    /// Adds up the sizes of an array of whole pages, given the
+    /// PagePool count for each page (0 for unmapped pages, which
+    /// aren't counted). Pages with a count of 0 or less add nothing.
+    ///
+    /// There is a plain C++ kernel and SSE2 and AVX2 ones for x86,
+    /// which take the page flags as lane masks rather than branching
+    /// on them. The best one the cpu supports is picked the first
+    /// time it is needed, or EXMAP_SIZES_KERNEL can name one. They
+    /// differ only in the rounding of the effective sizes.
+    class SizesKernel
+    {
+    public:
+	enum Kind {
+	    SCALAR = 0,
+	    SSE2,
+	    AVX2,
+	    NUM_KINDS,
+	};
+
+	typedef void (*Function)(const Page *pages,
+				 const int32_t *counts,
+				 size_t n,
+				 SpanSizes &sizes);
+
+	/// Add the pages using the chosen kernel
+	static void add(const Page *pages,
+			const int32_t *counts,
+			size_t n,
+			SpanSizes &sizes) {
+	    _chosen(pages, counts, n, sizes);
+	};
+
+	/// The kernel add() uses
+	static Kind chosen();
+
+	/// Use a particular kernel, if the cpu supports it
+	static bool choose(Kind kind);
+
+	/// Is this kernel built in and supported by the cpu?
+	static bool supported(Kind kind);
+
+	/// The kernel function, NULL if unsupported
+	static Function function(Kind kind);
+
+	/// Human readable kernel name
+	static const char *name(Kind kind);
+
+    private:
+	static Kind best();
+	static Kind _chosen_kind;
+	static Function _chosen;
+
+	static void add_first(const Page *pages,
+			      const int32_t *counts,
+			      size_t n,
+			      SpanSizes &sizes);
+	static void add_scalar(const Page *pages,
+			       const int32_t *counts,
+			       size_t n,
+			       SpanSizes &sizes);
+	static void add_sse2(const Page *pages,
+			     const int32_t *counts,
+			     size_t n,
+			     SpanSizes &sizes);
+	static void add_avx2(const Page *pages,
+			     const int32_t *counts,
+			     size_t n,
+			     SpanSizes &sizes);
+    };
+}
+
+#endif
@@ -0,0 +1,943 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#include "Exmap.hpp"
+#include "SizesKernel.hpp"
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+using namespace std;
+using namespace Exmap;
+using namespace jutil;
+
+static int usage();
+static int do_load(char *args[]);
+static int do_summary(char *args[]);
+static int do_pagestore(char *args[]);
+static int do_pagepool(char *args[]);
+static int do_range(char *args[]);
+static int do_filerows(char *args[]);
+static int do_symbols(char *args[]);
+static int do_kernel(char *args[]);
+static int do_measures(char *args[]);
+static int do_elf(char *args[]);
+typedef int (*Handler)(char *args[]);
+
+struct command
+{
+    const char *command;
+    Handler handler;
+    const char *usage;
+} cmd_handles[] = {
+    { "load",
+      do_load,
+    "[nthreads [atomic|sharded]] time a serial and a threaded snapshot load"},
+    { "summary",
+      do_summary,
+    "time a full snapshot load against a summary load"},
+    { "pagestore",
+      do_pagestore,
+    "[mapsfile] compare vma page storage with a dense page array"},
+    { "pagepool",
+      do_pagepool,
+    "[npages [npfns]] time page counting with a map, hash table and array"},
+    { "range",
+      do_range,
+    "[nvmas] time finding map holes with RangePtr lists and Range vectors"},
+    { "filerows",
+      do_filerows,
+    "[nrepeats] time the per-process rows of each file, as gexmap does"},
+    { "symbols",
+      do_symbols,
+    "[filename] time sizing every symbol of a file, one by one and batched"},
+    { "kernel",
+      do_kernel,
+    "[npages [nrepeats]] time sizing whole pages a page at a time and with each SizesKernel"},
+    { "measures",
+      do_measures,
+    "[nrepeats] time sizing every process for all measures and for effective resident only"},
+    { "elf",
+      do_elf,
+    "[nrepeats [file...]] time loading the headers (uncached and cached) and the symbols of elf files"},
+    { NULL, NULL, NULL },
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+	return usage();
+    }
+
+    struct command *chandler = cmd_handles;
+    while (chandler->command != NULL) {
+	if (strcmp(chandler->command, argv[1]) == 0) {
+	    return chandler->handler(argv + 2);
+	}
+	++chandler;
+    }
+
+    cerr << "Unrecognised command: " << argv[1] << "\n";
+    return usage();
+}
+
+static int usage()
+{
+    struct command *chandler = cmd_handles;
+    ostream &os = cerr;
+    os << "\n";
+    while (chandler->command != NULL) {
+	os << chandler->command << ": " << chandler->usage << "\n";
+	++chandler;
+    }
+    return -1;
+}
+
+/// Wall clock seconds
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/// Load a snapshot with the given number of threads, returning the
+/// time taken (negative on failure).
+static double time_load(SnapshotPtr &snap, int nthreads)
+{
+    snap->set_num_threads(nthreads);
+    double start = now();
+    if (!snap->load()) {
+	return -1.0;
+    }
+    return now() - start;
+}
+
+/// True if the two snapshots have the same procs with the same sizes
+static bool same_procs(SnapshotPtr &a, SnapshotPtr &b)
+{
+    list<ProcessPtr> aprocs = a->procs();
+    list<ProcessPtr>::iterator it;
+    bool same = true;
+
+    for (it = aprocs.begin(); it != aprocs.end(); ++it) {
+	ProcessPtr bproc = b->proc((*it)->pid());
+	if (!bproc) {
+	    // A process may have exited between the two loads
+	    continue;
+	}
+	SizesPtr asizes = (*it)->sizes();
+	SizesPtr bsizes = bproc->sizes();
+	if (asizes->val(Sizes::VM) != bsizes->val(Sizes::VM)) {
+	    cerr << "pid " << (*it)->pid() << " differs\n";
+	    same = false;
+	}
+    }
+    return same;
+}
+
+static int do_load(char *args[])
+{
+    int nthreads = num_cpus();
+    if (args[0] != NULL) {
+	nthreads = atoi(args[0]);
+    }
+    if (nthreads < 1) {
+	cerr << "invalid thread count: " << args[0] << "\n";
+	return usage();
+    }
+    Snapshot::CountMode mode = Snapshot::COUNT_ATOMIC;
+    if (args[0] != NULL && args[1] != NULL) {
+	if (strcmp(args[1], "sharded") == 0) {
+	    mode = Snapshot::COUNT_SHARDED;
+	}
+	else if (strcmp(args[1], "atomic") != 0) {
+	    cerr << "invalid count mode: " << args[1] << "\n";
+	    return usage();
+	}
+    }
+
+    SysInfoPtr sysinfo = make_sysinfo();
+    if (nthreads > 1 && !sysinfo->is_thread_safe()) {
+	cerr << "sysinfo can't be read from several threads, "
+	     << "try EXMAP_SYSINFO=pagemap\n";
+	return -1;
+    }
+
+    SnapshotPtr serial(new Snapshot(sysinfo));
+    double serial_time = time_load(serial, 1);
+    SnapshotPtr threaded(new Snapshot(sysinfo));
+    threaded->set_count_mode(mode);
+    double threaded_time = time_load(threaded, nthreads);
+    if (serial_time < 0 || threaded_time < 0) {
+	cerr << "Failed to load snapshot - aborting" << endl;
+	return -1;
+    }
+
+    cout << "procs:\t" << serial->num_procs() << "\n"
+	 << "1 thread:\t" << serial_time << "s\n"
+	 << nthreads << " threads:\t" << threaded_time << "s\n"
+	 << "speedup:\t" << serial_time / threaded_time << "\n";
+
+    if (!same_procs(serial, threaded)) {
+	cerr << "threaded load gave different results\n";
+	return -1;
+    }
+    return 0;
+}
+
+/// Total of one measure over all procs in the snapshot
+static double total_size(SnapshotPtr &snap, int which)
+{
+    list<ProcessPtr> procs = snap->procs();
+    list<ProcessPtr>::iterator it;
+    double total = 0;
+    for (it = procs.begin(); it != procs.end(); ++it) {
+	total += (*it)->sizes()->val(which);
+    }
+    return total;
+}
+
+static int do_summary(char *args[])
+{
+    SysInfoPtr sysinfo = make_sysinfo();
+
+    SnapshotPtr full(new Snapshot(sysinfo));
+    double full_time = time_load(full, full->num_threads());
+    SnapshotPtr summary(new Snapshot(sysinfo));
+    summary->set_summary_only(true);
+    double summary_time = time_load(summary, summary->num_threads());
+    if (full_time < 0 || summary_time < 0) {
+	cerr << "Failed to load snapshot - aborting" << endl;
+	return -1;
+    }
+
+    SizeUnits units = SizeUnits::kbytes();
+    cout << "procs:\t" << full->num_procs()
+	 << "\t" << summary->num_procs() << "\n"
+	 << "load:\t" << full_time << "s\t" << summary_time << "s\n"
+	 << "speedup:\t" << full_time / summary_time << "\n";
+    for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
+	cout << units.size_name(i) << ":\t"
+	     << total_size(full, i) / 1024
+	     << "\t" << total_size(summary, i) / 1024 << "\n";
+    }
+    return 0;
+}
+
+/// Totals of page storage over a number of vmas
+struct StoreTotals
+{
+    StoreTotals() : vmas(0), pages(0), mapped(0), dense(0), store(0) { }
+    void add(VmaPtr &vma)
+    {
+	unsigned long npages = vma->vm_size() / Elf::page_size();
+	++vmas;
+	pages += npages;
+	mapped += vma->num_pages();
+	dense += npages * sizeof(Page);
+	store += vma->page_storage_bytes();
+    }
+    void print()
+    {
+	cout << "vmas:\t" << vmas << "\n"
+	     << "pages:\t" << pages << "\n"
+	     << "mapped:\t" << mapped << "\n"
+	     << "dense (K):\t" << dense / 1024 << "\n"
+	     << "store (K):\t" << store / 1024 << "\n"
+	     << "ratio:\t" << (double) dense / store << "\n";
+    }
+    unsigned long vmas, pages, mapped, dense, store;
+};
+
+/// Fill a vma with made up pages: runs of random length, some of
+/// them holes and the rest consecutive pfns from a random start.
+static void synthetic_pages(VmaPtr &vma)
+{
+    unsigned long npages = vma->vm_size() / Elf::page_size();
+    vector<Page> pages;
+    pages.reserve(npages);
+    while (pages.size() < npages) {
+	unsigned long run = 1 + rand() % 64;
+	bool hole = rand() % 10 < 3;
+	PageCookie pfn = 1 + rand() % 0x100000;
+	for (unsigned long i = 0; i < run && pages.size() < npages; ++i) {
+	    pages.push_back(hole ? Page(0, false, false)
+			    : Page(pfn + i, true, false));
+	}
+    }
+    vma->add_pages(vma->start(), &pages[0], pages.size());
+    vma->shrink_pages();
+}
+
+static int do_pagestore(char *args[])
+{
+    StoreTotals totals;
+
+    if (args[0] == NULL) {
+	SysInfoPtr sysinfo = make_sysinfo();
+	SnapshotPtr snap(new Snapshot(sysinfo));
+	if (!snap->load()) {
+	    cerr << "Failed to load snapshot - aborting" << endl;
+	    return -1;
+	}
+	list<ProcessPtr> procs = snap->procs();
+	list<ProcessPtr>::iterator proc_it;
+	for (proc_it = procs.begin(); proc_it != procs.end(); ++proc_it) {
+	    vector<VmaPtr> vmas = (*proc_it)->vmas();
+	    vector<VmaPtr>::iterator vma_it;
+	    for (vma_it = vmas.begin(); vma_it != vmas.end(); ++vma_it) {
+		totals.add(*vma_it);
+	    }
+	}
+    }
+    else {
+	// A captured maps file has the layout but no pages, so fill
+	// them in the same way each run.
+	MapsScanner scanner;
+	if (!scanner.load(args[0])) {
+	    cerr << "Can't read maps file " << args[0] << "\n";
+	    return -1;
+	}
+	srand(1);
+	MapsLine line;
+	while (scanner.next(line)) {
+	    VmaPtr vma(new Vma(line.start, line.end, line.offset,
+			       string(line.name, line.name_len)));
+	    synthetic_pages(vma);
+	    totals.add(vma);
+	}
+    }
+
+    totals.print();
+    return 0;
+}
+
+/// Reproducible stream of pfns in [1, npfns], cheaper than rand()
+class PfnStream
+{
+public:
+    PfnStream(unsigned long npfns) : _npfns(npfns), _state(88172645463325252ULL) { }
+    PageCookie next()
+    {
+	// xorshift64
+	_state ^= _state << 13;
+	_state ^= _state >> 7;
+	_state ^= _state << 17;
+	return 1 + _state % _npfns;
+    }
+private:
+    unsigned long _npfns;
+    uint64_t _state;
+};
+
+/// Count npages pages into the pool, then look them all up again,
+/// printing the rate of each.
+static void time_pool(const string &name,
+		      PagePool &pool,
+		      unsigned long npages,
+		      unsigned long npfns)
+{
+    PfnStream pfns(npfns);
+    double start = now();
+    for (unsigned long i = 0; i < npages; ++i) {
+	pool.inc_page_count(Page(pfns.next(), true, false));
+    }
+    double insert_time = now() - start;
+
+    pfns = PfnStream(npfns);
+    unsigned long total = 0;
+    start = now();
+    for (unsigned long i = 0; i < npages; ++i) {
+	total += pool.count(Page(pfns.next(), true, false));
+    }
+    double lookup_time = now() - start;
+
+    cout << name << ":\t" << npages / insert_time / 1e6 << "M inserts/s\t"
+	 << npages / lookup_time / 1e6 << "M lookups/s\t"
+	 << "(checksum " << total << ")\n";
+}
+
+/// The same for the std::map PagePool used to use
+static void time_map(unsigned long npages, unsigned long npfns)
+{
+    map<PageCookie, int> counts;
+    PfnStream pfns(npfns);
+    double start = now();
+    for (unsigned long i = 0; i < npages; ++i) {
+	++counts[pfns.next()];
+    }
+    double insert_time = now() - start;
+
+    pfns = PfnStream(npfns);
+    unsigned long total = 0;
+    start = now();
+    for (unsigned long i = 0; i < npages; ++i) {
+	map<PageCookie, int>::iterator it = counts.find(pfns.next());
+	total += it == counts.end() ? 0 : it->second;
+    }
+    double lookup_time = now() - start;
+
+    cout << "map:\t" << npages / insert_time / 1e6 << "M inserts/s\t"
+	 << npages / lookup_time / 1e6 << "M lookups/s\t"
+	 << "(checksum " << total << ")\n";
+}
+
+// Beyond this the std::map takes too long and too much memory
+static const unsigned long MAX_MAP_PAGES = 10000000;
+
+static int do_pagepool(char *args[])
+{
+    unsigned long npages = 100000000;
+    unsigned long npfns = 0;
+    if (args[0] != NULL) {
+	npages = strtoul(args[0], NULL, 0);
+	if (args[1] != NULL) {
+	    npfns = strtoul(args[1], NULL, 0);
+	}
+    }
+    if (npfns == 0) {
+	// Each pfn mapped 8 times on average
+	npfns = npages / 8 + 1;
+    }
+
+    cout << "pages:\t" << npages << "\n"
+	 << "pfns:\t" << npfns << "\n";
+
+    if (npages <= MAX_MAP_PAGES) {
+	time_map(npages, npfns);
+    }
+    else {
+	cout << "map:\tskipped, more than " << MAX_MAP_PAGES << " pages\n";
+    }
+
+    {
+	PagePool pool;
+	time_pool("hash", pool, npages, npfns);
+    }
+    {
+	PagePool pool;
+	pool.set_dense_limit(npfns + 1);
+	time_pool("dense", pool, npages, npfns);
+    }
+    return 0;
+}
+
+/// Each synthetic vma is 64 pages, with maps over some of them
+static const unsigned long RANGE_VMA_SIZE = 64 * 4096;
+
+static int do_range(char *args[])
+{
+    unsigned long nvmas = 2000;
+    if (args[0] != NULL) {
+	nvmas = strtoul(args[0], NULL, 0);
+    }
+
+    // Lay out the vmas the way MapCalculator sees them: each one
+    // covered by a few maps, leaving holes between them
+    vector<Range> vmas;
+    list<RangePtr> map_list;
+    vector<Range> map_vector;
+    srand(1);
+    for (unsigned long i = 0; i < nvmas; ++i) {
+	unsigned long start = (i + 1) * 2 * RANGE_VMA_SIZE;
+	vmas.push_back(Range(start, start + RANGE_VMA_SIZE));
+	unsigned long addr = start;
+	while (addr < start + RANGE_VMA_SIZE) {
+	    unsigned long len = (rand() % 16 + 1) * 4096;
+	    unsigned long end = addr + len;
+	    if (end > start + RANGE_VMA_SIZE) {
+		end = start + RANGE_VMA_SIZE;
+	    }
+	    if (rand() % 3 != 0) {
+		map_list.push_back(RangePtr(new Range(addr, end)));
+		map_vector.push_back(Range(addr, end));
+	    }
+	    addr = end;
+	}
+    }
+    cout << "vmas:\t" << nvmas << "\n"
+	 << "maps:\t" << map_vector.size() << "\n";
+
+    vector<Range>::iterator vma_it;
+    unsigned long nholes = 0;
+    double start = now();
+    for (vma_it = vmas.begin(); vma_it != vmas.end(); ++vma_it) {
+	nholes += vma_it->invert_list(map_list).size();
+    }
+    double list_time = now() - start;
+    cout << "list:\t" << list_time << "s\t(" << nholes << " holes)\n";
+
+    vector<Range> holes;
+    nholes = 0;
+    start = now();
+    Range::merge_in_place(map_vector);
+    for (vma_it = vmas.begin(); vma_it != vmas.end(); ++vma_it) {
+	vma_it->invert_sorted(map_vector, holes);
+	nholes += holes.size();
+    }
+    double vector_time = now() - start;
+    cout << "vector:\t" << vector_time << "s\t(" << nholes << " holes)\n";
+    return 0;
+}
+
+static int do_filerows(char *args[])
+{
+    int nrepeats = 10;
+    if (args[0] != NULL) {
+	nrepeats = atoi(args[0]);
+    }
+
+    SysInfoPtr sysinfo = make_sysinfo();
+    SnapshotPtr snap(new Snapshot(sysinfo));
+    if (time_load(snap, snap->num_threads()) < 0) {
+	cerr << "Failed to load snapshot - aborting" << endl;
+	return -1;
+    }
+
+    // One row for each process mapping each file, as in the file
+    // view's process list
+    list<FilePtr> files = snap->files();
+    list<FilePtr>::iterator file_it;
+    vector<pair<FilePtr, ProcessPtr> > rows;
+    for (file_it = files.begin(); file_it != files.end(); ++file_it) {
+	list<ProcessPtr> procs = (*file_it)->procs();
+	list<ProcessPtr>::iterator proc_it;
+	for (proc_it = procs.begin(); proc_it != procs.end(); ++proc_it) {
+	    rows.push_back(make_pair(*file_it, *proc_it));
+	}
+    }
+    cout << "files:\t" << files.size() << "\n"
+	 << "rows:\t" << rows.size() << "\n";
+
+    // Finding the maps is what the index changes; sizing them is
+    // the same work either way, so time it separately
+    vector<pair<FilePtr, ProcessPtr> >::iterator row_it;
+    unsigned long old_maps = 0;
+    double start = now();
+    for (int i = 0; i < nrepeats; ++i) {
+	for (row_it = rows.begin(); row_it != rows.end(); ++row_it) {
+	    old_maps += Map::intersect_lists(row_it->first->maps(),
+					     row_it->second->maps()).size();
+	}
+    }
+    double old_time = now() - start;
+
+    unsigned long new_maps = 0;
+    start = now();
+    for (int i = 0; i < nrepeats; ++i) {
+	for (row_it = rows.begin(); row_it != rows.end(); ++row_it) {
+	    new_maps += row_it->first->maps(row_it->second->pid()).size();
+	}
+    }
+    double new_time = now() - start;
+
+    double total = 0;
+    start = now();
+    for (int i = 0; i < nrepeats; ++i) {
+	for (row_it = rows.begin(); row_it != rows.end(); ++row_it) {
+	    total += row_it->second->sizes(row_it->first)->val(Sizes::VM);
+	}
+    }
+    double sizes_time = now() - start;
+
+    cout << "intersect_lists:\t" << old_time << "s\n"
+	 << "per-process index:\t" << new_time << "s\n"
+	 << "row sizes:\t" << sizes_time << "s\n";
+    if (old_maps != new_maps) {
+	cerr << "map counts differ: " << old_maps << " " << new_maps << "\n";
+	return -1;
+    }
+    return 0;
+}
+
+/// The symbol ranges of each mappable section of an elf file
+static void section_symbol_ranges(const Elf::FilePtr &elf,
+				  list<vector<Range> > &sections)
+{
+    list<Elf::SectionPtr> secs = elf->mappable_sections();
+    list<Elf::SectionPtr>::iterator sec_it;
+    for (sec_it = secs.begin(); sec_it != secs.end(); ++sec_it) {
+	list<Elf::SymbolPtr> syms = elf->symbols_in_section(*sec_it);
+	list<Elf::SymbolPtr>::iterator sym_it;
+	sections.push_back(vector<Range>());
+	for (sym_it = syms.begin(); sym_it != syms.end(); ++sym_it) {
+	    sections.back().push_back(*(*sym_it)->range());
+	}
+    }
+}
+
+static int do_symbols(char *args[])
+{
+    SysInfoPtr sysinfo = make_sysinfo();
+    SnapshotPtr snap(new Snapshot(sysinfo));
+    if (time_load(snap, snap->num_threads()) < 0) {
+	cerr << "Failed to load snapshot - aborting" << endl;
+	return -1;
+    }
+
+    // The named file, or else the elf file with the most symbols
+    FilePtr file;
+    list<vector<Range> > sections;
+    unsigned long nsyms = 0;
+    list<FilePtr> files = snap->files();
+    list<FilePtr>::iterator file_it;
+    for (file_it = files.begin(); file_it != files.end(); ++file_it) {
+	if (!(*file_it)->is_elf()) {
+	    continue;
+	}
+	if (args[0] != NULL && (*file_it)->name() != args[0]) {
+	    continue;
+	}
+	list<vector<Range> > secs;
+	section_symbol_ranges((*file_it)->elf(), secs);
+	unsigned long n = 0;
+	list<vector<Range> >::iterator sec_it;
+	for (sec_it = secs.begin(); sec_it != secs.end(); ++sec_it) {
+	    n += sec_it->size();
+	}
+	if (!file || n > nsyms) {
+	    file = *file_it;
+	    sections.swap(secs);
+	    nsyms = n;
+	}
+    }
+    if (!file) {
+	cerr << "No elf file found\n";
+	return -1;
+    }
+    cout << "file:\t" << file->name() << "\n"
+	 << "procs:\t" << file->procs().size() << "\n"
+	 << "symbols:\t" << nsyms << "\n";
+
+    // As the symbol list does for all processes, a row at a time...
+    list<vector<Range> >::iterator sec_it;
+    vector<Range>::iterator range_it;
+    double single_total = 0;
+    double start = now();
+    for (sec_it = sections.begin(); sec_it != sections.end(); ++sec_it) {
+	for (range_it = sec_it->begin(); range_it != sec_it->end(); ++range_it) {
+	    SizesPtr sizes = file->sizes(RangePtr(new Range(*range_it)));
+	    if (sizes) {
+		single_total += sizes->val(Sizes::EFFECTIVE_RESIDENT);
+	    }
+	}
+    }
+    double single_time = now() - start;
+
+    // ...and a section at a time
+    double batch_total = 0;
+    vector<Sizes> results;
+    vector<Sizes>::iterator res_it;
+    start = now();
+    for (sec_it = sections.begin(); sec_it != sections.end(); ++sec_it) {
+	file->sizes(*sec_it, results);
+	for (res_it = results.begin(); res_it != results.end(); ++res_it) {
+	    batch_total += res_it->val(Sizes::EFFECTIVE_RESIDENT);
+	}
+    }
+    double batch_time = now() - start;
+
+    cout << "one by one:\t" << single_time << "s\n"
+	 << "batched:\t" << batch_time << "s\n"
+	 << "speedup:\t" << single_time / batch_time << "\n";
+    if (fabs(single_total - batch_total) > 1e-3 * (single_total + 1)) {
+	cerr << "totals differ: " << single_total << " " << batch_total << "\n";
+	return -1;
+    }
+    return 0;
+}
+
+/// Size the pages a page at a time, the way a whole vma used to be
+static double time_page_sizes(const PagePoolPtr &pp,
+			      const vector<Page> &pages,
+			      int nrepeats)
+{
+    Sizes sizes;
+    const Elf::Address page_size = Elf::page_size();
+    double start = now();
+    for (int r = 0; r < nrepeats; ++r) {
+	vector<Page>::const_iterator it;
+	for (it = pages.begin(); it != pages.end(); ++it) {
+	    int count = it->is_mapped() ? pp->count(*it) : 0;
+	    if (count <= 0) {
+		continue;
+	    }
+	    sizes.increase(Sizes::MAPPED, page_size);
+	    sizes.increase(Sizes::EFFECTIVE_MAPPED, (double) page_size / count);
+	    if (count == 1) {
+		sizes.increase(Sizes::SOLE_MAPPED, page_size);
+	    }
+	    if (it->is_resident()) {
+		sizes.increase(Sizes::RESIDENT, page_size);
+		sizes.increase(Sizes::EFFECTIVE_RESIDENT,
+			       (double) page_size / count);
+		if (it->is_writable()) {
+		    sizes.increase(Sizes::WRITABLE, page_size);
+		}
+	    }
+	}
+    }
+    double elapsed = now() - start;
+    cout << "page:\t" << elapsed << "s\t"
+	 << pages.size() * nrepeats / elapsed / 1e6 << "M pages/s\t"
+	 << "(effective " << sizes.val(Sizes::EFFECTIVE_MAPPED)
+	 / page_size / nrepeats << ")\n";
+    return elapsed;
+}
+
+/// Size the pages with a kernel, gathering their counts a chunk at a
+/// time as SizesVisitor does
+static void time_kernel(SizesKernel::Kind kind,
+			const PagePoolPtr &pp,
+			const vector<Page> &pages,
+			int nrepeats,
+			double page_time)
+{
+    static const size_t CHUNK = 256;
+    int32_t counts[CHUNK];
+    SizesKernel::Function kernel = SizesKernel::function(kind);
+    SpanSizes sizes;
+    double start = now();
+    for (int r = 0; r < nrepeats; ++r) {
+	for (size_t i = 0; i < pages.size(); i += CHUNK) {
+	    size_t n = min(CHUNK, pages.size() - i);
+	    pp->counts(&pages[i], n, counts);
+	    kernel(&pages[i], counts, n, sizes);
+	}
+    }
+    double elapsed = now() - start;
+
+    // The count lookups dominate, so time the kernel alone too, on
+    // counts gathered up front
+    vector<int32_t> all_counts(pages.size());
+    pp->counts(&pages[0], pages.size(), &all_counts[0]);
+    SpanSizes alone;
+    start = now();
+    for (int r = 0; r < nrepeats; ++r) {
+	kernel(&pages[0], &all_counts[0], pages.size(), alone);
+    }
+    double kernel_time = now() - start;
+
+    cout << SizesKernel::name(kind) << ":\t" << elapsed << "s\t"
+	 << pages.size() * nrepeats / elapsed / 1e6 << "M pages/s\t"
+	 << "(x" << page_time / elapsed << ", kernel alone "
+	 << pages.size() * nrepeats / kernel_time / 1e6 << "M pages/s, "
+	 << "effective " << sizes.effective_mapped / nrepeats << ")\n";
+}
+
+static int do_kernel(char *args[])
+{
+    unsigned long npages = 1000000;
+    int nrepeats = 20;
+    if (args[0] != NULL) {
+	npages = strtoul(args[0], NULL, 0);
+	if (args[1] != NULL) {
+	    nrepeats = atoi(args[1]);
+	}
+    }
+    if (npages == 0 || nrepeats < 1) {
+	return usage();
+    }
+
+    // Each pfn mapped 4 times on average, some pages unmapped or not
+    // resident
+    unsigned long npfns = npages / 4 + 1;
+    PagePoolPtr pp(new PagePool);
+    pp->set_dense_limit(npfns + 1);
+    vector<Page> pages;
+    pages.reserve(npages);
+    srand(1);
+    for (unsigned long i = 0; i < npages; ++i) {
+	int r = rand();
+	PageCookie pfn = r % 8 == 0 ? 0 : rand() % npfns + 1;
+	pages.push_back(Page(pfn, r & 16, r & 32));
+	pp->inc_page_count(pages.back());
+    }
+
+    cout << "pages:\t" << npages << "\n"
+	 << "repeats:\t" << nrepeats << "\n"
+	 << "chosen:\t" << SizesKernel::name(SizesKernel::chosen()) << "\n";
+    double page_time = time_page_sizes(pp, pages, nrepeats);
+    for (int k = 0; k < SizesKernel::NUM_KINDS; ++k) {
+	SizesKernel::Kind kind = (SizesKernel::Kind) k;
+	if (!SizesKernel::supported(kind)) {
+	    cout << SizesKernel::name(kind) << ":\tunsupported\n";
+	    continue;
+	}
+	time_kernel(kind, pp, pages, nrepeats, page_time);
+    }
+    return 0;
+}
+
+/// Size every process nrepeats times for the MEASURES, returning the
+/// time taken and the total effective resident size
+template <unsigned MEASURES>
+static double time_measures(const list<ProcessPtr> &procs,
+			    int nrepeats,
+			    double &effective)
+{
+    list<ProcessPtr>::const_iterator it;
+    effective = 0;
+    double start = now();
+    for (int r = 0; r < nrepeats; ++r) {
+	for (it = procs.begin(); it != procs.end(); ++it) {
+	    Sizes sizes;
+	    (*it)->add_sizes<MEASURES>(sizes);
+	    effective += sizes.val(Sizes::EFFECTIVE_RESIDENT);
+	}
+    }
+    return now() - start;
+}
+
+static int do_measures(char *args[])
+{
+    int nrepeats = 10;
+    if (args[0] != NULL) {
+	nrepeats = atoi(args[0]);
+    }
+    if (nrepeats < 1) {
+	return usage();
+    }
+
+    SysInfoPtr sysinfo = make_sysinfo();
+    SnapshotPtr snap(new Snapshot(sysinfo));
+    if (!snap->load()) {
+	cerr << "Failed to load snapshot - aborting" << endl;
+	return -1;
+    }
+    list<ProcessPtr> procs = snap->procs();
+
+    // The first pass over a vma may build its running totals, so
+    // warm them up before timing either
+    double all_effective, effective;
+    time_measures<Sizes::ALL_MEASURES>(procs, 1, all_effective);
+    double all_time = time_measures<Sizes::ALL_MEASURES>(procs,
+							 nrepeats,
+							 all_effective);
+    double effective_time
+	= time_measures<Sizes::EFFECTIVE_RESIDENT_BIT>(procs,
+							nrepeats,
+							effective);
+
+    cout << "procs:\t" << procs.size() << "\n"
+	 << "all:\t" << all_time << "s\n"
+	 << "effective:\t" << effective_time << "s\t(x"
+	 << all_time / effective_time << ")\n"
+	 << "same:\t" << (fabs(all_effective - effective)
+			   <= 1e-6 * (1 + all_effective) ? "yes" : "NO") << "\n";
+    return 0;
+}
+
+/// Time loading an elf file's headers, as every mapped file has done,
+/// from the file and from a HeaderCache in cache_dir, and then its
+/// symbols too, as the symbol views do
+static bool time_elf(const string &fname,
+		     int nrepeats,
+		     const string &cache_dir)
+{
+    Elf::HeaderCache::use_dir("");
+    Elf::File elf;
+    if (!elf.load(fname, false)) {
+	cerr << "Can't load elf file " << fname << "\n";
+	return false;
+    }
+    unsigned long nsyms = elf.all_symbols().size();
+
+    double start = now();
+    for (int r = 0; r < nrepeats; ++r) {
+	elf.load(fname, false);
+    }
+    double headers_time = (now() - start) / nrepeats;
+
+    cout << fname << ": " << (elf.is_shared_object() ? "shared" : "exe")
+	 << ", " << nsyms << " symbols\n"
+	 << "headers:\t" << headers_time * 1e6 << "us\n";
+
+    // Fill the cache, then read it back as the next run would
+    Elf::HeaderCache::use_dir(cache_dir);
+    elf.load(fname, false);
+    Elf::HeaderCache::instance().save();
+    Elf::HeaderCache::use_dir(cache_dir);
+    start = now();
+    for (int r = 0; r < nrepeats; ++r) {
+	elf.load(fname, false);
+    }
+    double cached_time = (now() - start) / nrepeats;
+    unsigned long hits = Elf::HeaderCache::instance().hits();
+    Elf::HeaderCache::use_dir("");
+
+    cout << "cached headers:\t" << cached_time * 1e6 << "us\t("
+	 << hits << "/" << nrepeats << " hits)\n";
+    // e.g. the bundled libc, whose section headers are cut off
+    if (nsyms == 0) {
+	return true;
+    }
+
+    unsigned long ndefined = 0;
+    start = now();
+    for (int r = 0; r < nrepeats; ++r) {
+	elf.load(fname, false);
+	ndefined += elf.defined_symbols().size();
+    }
+    double symbols_time = (now() - start) / nrepeats;
+
+    cout << "symbols:\t" << symbols_time * 1e3 << "ms\t"
+	 << nsyms / symbols_time / 1e6 << "M symbols/s\n";
+    return ndefined <= nsyms * nrepeats;
+}
+
+static int do_elf(char *args[])
+{
+    int nrepeats = 100;
+    if (args[0] != NULL) {
+	nrepeats = atoi(args[0]);
+	++args;
+    }
+    if (nrepeats < 1) {
+	return usage();
+    }
+
+    list<string> fnames;
+    while (*args != NULL) {
+	fnames.push_back(*args++);
+    }
+    if (fnames.empty()) {
+	// The bundled 32 bit libc and a 64 bit one from the system
+	static const char *defaults[] = {
+	    "fc4-libc-2.3.5.so",
+	    "/lib64/libc.so.6",
+	    "/lib/x86_64-linux-gnu/libc.so.6",
+	    "/usr/lib/libc.so.6",
+	    NULL,
+	};
+	for (const char **cp = defaults; *cp != NULL; ++cp) {
+	    if (file_exists(*cp)) {
+		fnames.push_back(*cp);
+	    }
+	}
+    }
+
+    char dir_template[] = "/tmp/exmbench_cache.XXXXXX";
+    if (mkdtemp(dir_template) == NULL) {
+	cerr << "Can't make cache directory\n";
+	return -1;
+    }
+    const string cache_dir = dir_template;
+
+    int ret = 0;
+    list<string>::iterator it;
+    for (it = fnames.begin(); it != fnames.end() && ret == 0; ++it) {
+	if (!time_elf(*it, nrepeats, cache_dir)) {
+	    ret = -1;
+	}
+    }
+    unlink((cache_dir + "/elf-headers").c_str());
+    rmdir(cache_dir.c_str());
+    return ret;
+}
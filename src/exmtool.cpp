@@ -25,7 +25,7 @@ struct command
 } cmd_handles[] = {
     { "procs",
       do_procs,
-    "list the known processes"},
+    "[-e] list the known processes (-e: effective resident only)"},
     { "files",
       do_files,
     "list the known files"},
@@ -37,6 +37,14 @@ struct command
 
 int main(int argc, char *argv[])
 {
+    // -s: load a summary snapshot from smaps
+    bool summary_only = false;
+    if (argc >= 2 && strcmp(argv[1], "-s") == 0) {
+	summary_only = true;
+	--argc;
+	++argv;
+    }
+
     if (argc < 2) {
 	return usage();
     }
@@ -56,8 +64,9 @@ int main(int argc, char *argv[])
 	return usage();
     }
 
-    SysInfoPtr sysinfo(new LinuxSysInfo);
+    SysInfoPtr sysinfo = make_sysinfo();
     SnapshotPtr snapshot(new Snapshot(sysinfo));
+    snapshot->set_summary_only(summary_only);
     if (!snapshot->load()) {
 	cerr << "Failed to load snapshot - aborting" << endl;
 	return -1;
@@ -70,7 +79,8 @@ static int usage()
 {
     struct command *chandler = cmd_handles;
     ostream &os = cerr;
-    os << "\n";
+    os << "\nusage: exmtool [-s] command\n"
+       << "-s: only load process and file totals (from smaps)\n\n";
     while (chandler->command != NULL) {
 	os << chandler->command << ": " << chandler->usage << "\n";
 	++chandler;
@@ -78,26 +88,48 @@ static int usage()
     return -1;
 }
 
+/// Print the effective resident size of each process. Only that
+/// measure is computed, which skips most of the sizing work.
+static void print_effective(const list<ProcessPtr> &procs,
+			    const SizeUnits &units)
+{
+    list<ProcessPtr>::const_iterator it;
+    cout << "PID\t" << units.size_name(Sizes::EFFECTIVE_RESIDENT)
+	 << "\tCMD\n";
+    for (it = procs.begin(); it != procs.end(); ++it) {
+	Sizes sizes;
+	(*it)->add_sizes<Sizes::EFFECTIVE_RESIDENT_BIT>(sizes);
+	cout << (*it)->pid()
+	     << "\t" << units.sval(sizes, Sizes::EFFECTIVE_RESIDENT)
+	     << "\t" << (*it)->cmdline() << "\n";
+    }
+}
+
 static int do_procs(SnapshotPtr &snap, char *args[])
 {
     list<ProcessPtr> procs;
     list<ProcessPtr>::iterator it;
+    SizeUnits units = SizeUnits::kbytes();
 
     procs = snap->procs();
-    Sizes::scale_kbytes();
+    if (args[0] != NULL && strcmp(args[0], "-e") == 0) {
+	print_effective(procs, units);
+	return 0;
+    }
     cout << "PID";
     for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
-	cout << "\t" << Sizes::size_name(i);
+	cout << "\t" << units.size_name(i);
     }
     cout << "\t" << "CMD";
     cout << "\n";
     
     for (it = procs.begin(); it != procs.end(); ++it) {
 	ProcessPtr proc = *it;
-	SizesPtr sizes = proc->sizes();
+	Sizes sizes;
+	proc->add_sizes<Sizes::ALL_MEASURES>(sizes);
 	cout << proc->pid();
 	for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
-	    cout << "\t" << sizes->sval(i);
+	    cout << "\t" << units.sval(sizes, i);
 	}
 	cout << "\t" << proc->cmdline();
 	cout << "\n";
@@ -109,19 +141,20 @@ static int do_files(SnapshotPtr &snap, char *args[])
 {
     list<FilePtr> files;
     list<FilePtr>::iterator it;
+    SizeUnits units = SizeUnits::kbytes();
 
     files = snap->files();
-    Sizes::scale_kbytes();
     for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
-	cout << Sizes::size_name(i) << "\t";
+	cout << units.size_name(i) << "\t";
     }
     cout << "NAME\n";
     
     for (it = files.begin(); it != files.end(); ++it) {
 	FilePtr file = *it;
-	SizesPtr sizes = file->sizes();
+	Sizes sizes;
+	file->add_sizes<Sizes::ALL_MEASURES>(sizes);
 	for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
-	    cout << sizes->sval(i) << "\t";
+	    cout << units.sval(sizes, i) << "\t";
 	}
 	cout << file->name();
 	cout << "\n";
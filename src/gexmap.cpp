@@ -12,6 +12,7 @@
 #include <sstream>
 #include <iostream>
 #include <list>
+#include <vector>
 
 
 namespace Gexmap
@@ -41,7 +42,7 @@ namespace Gexmap
 	/// When creating a new Row, call this to add in the values
 	/// for the Sizes.
 	void add_row_sizes(Gtk::TreeModel::Row &row,
-			   Exmap::SizesPtr &sizes);
+			   const Exmap::Sizes &sizes);
 
 	/// Show the list view (hiding the label), and clear the store
 	void show_and_clear_list();
@@ -71,6 +72,8 @@ namespace Gexmap
 	Gtk::TreeModel::ColumnRecord _columns;
     private:
 	Gtk::TreeModelColumn<float> _size_columns[Exmap::Sizes::NUM_SIZES];
+	/// The units the size columns are shown in
+	Exmap::SizeUnits _units;
 	void _make_all_sortable_and_resizeable();
 	static std::string SIZES_PRINTF_FORMAT;
 	Gtk::ScrolledWindow _scrolled_window;
@@ -88,7 +91,7 @@ namespace Gexmap
     protected:
 	void add_row(pid_t pid,
 		     const std::string &cmdline,
-		     Exmap::SizesPtr &sizes);
+		     const Exmap::Sizes &sizes);
 	Gtk::TreeModelColumn<pid_t> _pid;
 	Gtk::TreeModelColumn<Glib::ustring> _cmdline;
     };
@@ -99,8 +102,6 @@ namespace Gexmap
     public:
 	AllProcList();
 	void set_data(const std::list<Exmap::ProcessPtr> &procs);
-    private:
-	Exmap::SizesPtr calc_totals(const std::list<Exmap::ProcessPtr> &procs);
     };
     
     /// Concrete subclass for showing the list of process which map a file
@@ -358,6 +359,8 @@ void BottomBar::set_status(SnapshotPtr &snapshot)
 SizeListView::SizeListView(const std::string &frame_name)
     : Gtk::Frame(frame_name),
       showing_list(true),
+      // If you change the scale you may want to change SIZES_PRINTF_FORMAT
+      _units(Exmap::SizeUnits::kbytes()),
       _saved_sort_id(Gtk::TreeSortable::DEFAULT_UNSORTED_COLUMN_ID),
       _saved_sort_order(Gtk::SORT_DESCENDING)
 {
@@ -398,7 +401,7 @@ void SizeListView::init_columns()
 
     int sort_colid = -1;
     for (int i = 0; i < Exmap::Sizes::NUM_SIZES; ++i) {
-	int colid = _treeview.append_column_numeric(Exmap::Sizes::size_name(i),
+	int colid = _treeview.append_column_numeric(_units.size_name(i),
 						    _size_columns[i],
 						    SIZES_PRINTF_FORMAT);
 	
@@ -435,10 +438,10 @@ void SizeListView::init_store_and_view()
 }
 
 void SizeListView::add_row_sizes(Gtk::TreeModel::Row &row,
-				 Exmap::SizesPtr &sizes)
+				 const Exmap::Sizes &sizes)
 {
     for (int i = 0; i < Exmap::Sizes::NUM_SIZES; ++i) {
-	row[_size_columns[i]] = sizes->sval(i);
+	row[_size_columns[i]] = _units.sval(sizes, i);
     }
 }
 
@@ -502,7 +505,7 @@ pid_t ProcList::currently_selected()
     return pid;
 }
 
-void ProcList::add_row(pid_t pid, const string &cmdline, SizesPtr &sizes)
+void ProcList::add_row(pid_t pid, const string &cmdline, const Sizes &sizes)
 {
 
     Gtk::TreeModel::Row row = *(_store->append());
@@ -529,30 +532,22 @@ void AllProcList::set_data(const list<ProcessPtr> &procs)
 
     show_and_clear_list();
 
+    // Total up as we go, rather than sizing every process twice
+    Sizes totals;
     start_mass_insert();
     for (it = procs.begin(); it != procs.end(); ++it) {
-	SizesPtr sizes = (*it)->sizes();
+	Sizes sizes;
+	(*it)->add_sizes<Sizes::ALL_MEASURES>(sizes);
 	add_row((*it)->pid(),
 		(*it)->cmdline(),
 		sizes);
+	totals.add(sizes);
     }
 
-    SizesPtr totals = calc_totals(procs);
     add_row(0, "TOTALS", totals);
     finished_mass_insert();
 }
 
-SizesPtr AllProcList::calc_totals(const list<ProcessPtr> &procs)
-{
-    list<ProcessPtr>::const_iterator it;
-    SizesPtr totals (new Sizes);
-    for (it = procs.begin(); it != procs.end(); ++it) {
-	SizesPtr sizes = (*it)->sizes();
-	totals->add(sizes);
-    }
-    return totals;
-}
-
 // ------------------------------------------------------------
     
 PerFileProcList::PerFileProcList()
@@ -581,7 +576,8 @@ void PerFileProcList::set_data(const Exmap::FilePtr &file)
 
     start_mass_insert();
     for (it = procs.begin(); it != procs.end(); ++it) {
-	SizesPtr sizes = (*it)->sizes(file);
+	Sizes sizes;
+	(*it)->add_sizes<Sizes::ALL_MEASURES>(file, sizes);
 	add_row((*it)->pid(),
 		(*it)->cmdline(),
 		sizes);
@@ -620,7 +616,8 @@ void PerProcFileList::set_data(const Exmap::ProcessPtr &proc)
     for (it = files.begin(); it != files.end(); ++it) {
 	Gtk::TreeModel::Row row = *(_store->append());
 	row[_filename] = (*it)->name();
-	Exmap::SizesPtr sizes = proc->sizes(*it);
+	Exmap::Sizes sizes;
+	proc->add_sizes<Exmap::Sizes::ALL_MEASURES>(*it, sizes);
 	add_row_sizes(row, sizes);
     }
     finished_mass_insert();
@@ -671,7 +668,8 @@ void AllFileList::set_data(const list<FilePtr> &files)
 	Gtk::TreeModel::Row row = *(_store->append());
 	row[_filename] = (*it)->name();
 	row[_nprocs] = (*it)->procs().size();
-	Exmap::SizesPtr sizes = (*it)->sizes();
+	Exmap::Sizes sizes;
+	(*it)->add_sizes<Exmap::Sizes::ALL_MEASURES>(sizes);
 	add_row_sizes(row, sizes);
     }
     finished_mass_insert();
@@ -714,7 +712,6 @@ void ElfSectionList::set_data(const Exmap::ProcessPtr &proc,
 {
     list<Elf::SectionPtr> sections;
     list<Elf::SectionPtr>::const_iterator it;
-    Exmap::SizesPtr sizes;
     Elf::FilePtr elf;
     string err_label;
 
@@ -744,19 +741,27 @@ void ElfSectionList::set_data(const Exmap::ProcessPtr &proc,
 
     show_and_clear_list();
 
+    // Size all the sections in one go
     sections = elf->mappable_sections();
-    start_mass_insert();
+    vector<Range> ranges;
     for (it = sections.begin(); it != sections.end(); ++it) {
+	ranges.push_back(*(*it)->mem_range());
+    }
+    vector<Exmap::Sizes> sizes;
+    if (show_all_procs) {
+	file->sizes(ranges, sizes);
+    }
+    else {
+	proc->sizes(file, ranges, sizes);
+    }
+
+    start_mass_insert();
+    vector<Exmap::Sizes>::iterator sizes_it = sizes.begin();
+    for (it = sections.begin(); it != sections.end(); ++it, ++sizes_it) {
 	Gtk::TreeModel::Row row = *(_store->append());
 	row[_name] = (*it)->name();
 	row[_file_offset] = (*it)->file_range()->start();
-	if (show_all_procs) {
-	    sizes = file->sizes((*it)->mem_range());
-	}
-	else {
-	    sizes = proc->sizes(file, (*it)->mem_range());
-	}
-	add_row_sizes(row, sizes);
+	add_row_sizes(row, *sizes_it);
     }
     finished_mass_insert();
 }
@@ -836,19 +841,26 @@ void ElfSymbolList::set_data(const Exmap::ProcessPtr &proc,
 
     show_and_clear_list();
 
-    Exmap::SizesPtr sizes;
-    start_mass_insert();
+    // Size all the symbols in one go, rather than a query per row
+    vector<Range> ranges;
     for (it = symbols.begin(); it != symbols.end(); ++it) {
+	ranges.push_back(*(*it)->range());
+    }
+    vector<Exmap::Sizes> sizes;
+    if (proc) {
+	proc->sizes(file, ranges, sizes);
+    }
+    else {
+	// Null proc means across all processes
+	file->sizes(ranges, sizes);
+    }
+
+    start_mass_insert();
+    vector<Exmap::Sizes>::iterator sizes_it = sizes.begin();
+    for (it = symbols.begin(); it != symbols.end(); ++it, ++sizes_it) {
 	Gtk::TreeModel::Row row = *(_store->append());
 	row[_name] = (*it)->name();
-	if (proc) {
-	    sizes = proc->sizes(file, (*it)->range());
-	}
-	else {
-	    // Null proc means across all processes
-	    sizes = file->sizes((*it)->range());
-	}
-	add_row_sizes(row, sizes);
+	add_row_sizes(row, *sizes_it);
     }
     finished_mass_insert();
 }
@@ -1049,9 +1061,7 @@ int main(int argc, char *argv[])
 {
     Gtk::Main kit(argc, argv);
 
-    // If you change the scale you may want to change SIZES_PRINTF_FORMAT
-    Sizes::scale_kbytes();
-    SysInfoPtr sysinfo(new LinuxSysInfo);
+    SysInfoPtr sysinfo = make_sysinfo();
     SnapshotPtr snapshot(new Snapshot(sysinfo));
     TopWin topwin(snapshot);
 
@@ -3,8 +3,13 @@
  */
 #include <Trun.hpp>
 #include "Exmap.hpp"
+#include "ElfCache.hpp"
+#include "SizesKernel.hpp"
 
 #include <sstream>
+#include <math.h>
+#include <stdlib.h>
+#include <sys/sysmacros.h>
 
 class TestSysInfo : public Exmap::LinuxSysInfo
 {
@@ -14,33 +19,87 @@ public:
 	std::string cmdline;
 	std::list<std::string> vma_lines;
     };
+    TestSysInfo()
+	: _guard_vma_start(0), _mapped_pages(false), _overlong_runs(false),
+	  _max_pfn(0), _num_mapped_pages(0) { }
     ~TestSysInfo();
     std::list<pid_t> accessible_pids();
     bool sanity_check();
-    bool read_page_info(pid_t pid,
-			    std::map<Elf::Address, std::list<Exmap::Page> >&pi);
+    bool read_page_info(pid_t pid, Exmap::PageSink &sink);
     std::string read_cmdline(pid_t pid);
     bool read_vmas(const Exmap::PagePoolPtr &pp,
 		       pid_t pid,
-		       std::list<Exmap::VmaPtr> &vmas);
+		       std::vector<Exmap::VmaPtr> &vmas);
+    bool read_vma_sizes(pid_t pid,
+			std::map<Elf::Address, Exmap::SizesPtr> &vs);
+    bool is_thread_safe();
+    Exmap::PageCookie max_pfn() { return _max_pfn; }
+    Exmap::PageCookie mapped_pages() { return _num_mapped_pages; }
     
     void set_pid_info(const std::map<pid_t, struct pidinfo> &info);
+    /// Report the pages of the vma starting at start from the page
+    /// below, as for a stack vma with its guard page trimmed
+    void set_guard_vma(Elf::Address start) { _guard_vma_start = start; }
+    /// Give every page a cookie from its address, so pages at the
+    /// same address in different processes are shared
+    void set_mapped_pages(bool mapped) { _mapped_pages = mapped; }
+    /// Report one page past the end of each vma, with OVERLONG_COOKIE
+    void set_overlong_runs(bool overlong) { _overlong_runs = overlong; }
+    static const Exmap::PageCookie OVERLONG_COOKIE = 0x7fffff;
+    /// Report a pfn range and how many pages are mapped in it
+    void set_pfns(Exmap::PageCookie max_pfn, Exmap::PageCookie mapped) {
+	_max_pfn = max_pfn;
+	_num_mapped_pages = mapped;
+    }
 private:
     void random_page_info(bool *resident,
 			  bool *writable,
 			  Exmap::PageCookie *cookie);
     std::map<pid_t, struct pidinfo> _info;
-    std::map<pid_t, std::list<Exmap::VmaPtr> > _vmas;
+    std::map<pid_t, std::vector<Exmap::VmaPtr> > _vmas;
+    Elf::Address _guard_vma_start;
+    bool _mapped_pages;
+    bool _overlong_runs;
+    Exmap::PageCookie _max_pfn;
+    Exmap::PageCookie _num_mapped_pages;
 };
 
 typedef boost::shared_ptr<TestSysInfo> TestSysInfoPtr;
 
+/// One thread's share of the concurrent counting test
+struct CountingThread
+{
+    const std::vector<Exmap::Page> *pages;
+    /// Count into the pool, or the shard if there is one
+    Exmap::PagePool *pool;
+    Exmap::PageCountTable *shard;
+    /// Where the pool's non-dense counts go, as for COUNT_ATOMIC loads
+    Exmap::PageCountTable *overflow;
+};
+
 class ArtsdTest : public Test
 {
 public:
     bool setup();
     bool run();
 private:
+    void parsed_vmas(TestSysInfoPtr &tsi);
+    void threaded_load();
+    void summary_load();
+    void page_packing();
+    void page_store();
+    void page_pool();
+    void dense_choice();
+    void concurrent_counting();
+    void rejected_pages();
+    void snapshot_teardown();
+    void vma_lookup();
+    void file_map_index();
+    void file_identity();
+    void range_sizes();
+    void batch_sizes();
+    void visit_pages();
+    void measure_sets();
     static std::map<pid_t, struct TestSysInfo::pidinfo> info;
 };
 
@@ -48,6 +107,374 @@ using namespace std;
 using namespace Exmap;
 using namespace jutil;
 
+void ArtsdTest::vma_lookup()
+{
+    TestSysInfoPtr tsi(new TestSysInfo);
+    tsi->set_pid_info(info);
+    // The third artsd vma has a gap below it
+    tsi->set_guard_vma(0x08076000);
+    SysInfoPtr si(tsi);
+    Snapshot snap(si);
+    snap.load();
+    ProcessPtr proc = snap.proc(1234);
+
+    const vector<VmaPtr> &vmas = proc->vmas();
+    vector<VmaPtr>::const_iterator it;
+    bool all_found = true;
+    for (it = vmas.begin(); it != vmas.end(); ++it) {
+	all_found = all_found
+	    && proc->vma_at((*it)->start()) == *it
+	    && proc->vma_at((*it)->end() - 1) == *it;
+    }
+    ok(all_found, "vma_at finds the first and last byte of each vma");
+    ok(proc->vma_at(0x08050123) == vmas[0], "vma_at within a vma");
+    notok(proc->vma_at(0), "vma_at below the first vma");
+    notok(proc->vma_at(0x08046fff), "vma_at just below the first vma");
+    notok(proc->vma_at(0x08074000), "vma_at in a gap between vmas");
+    notok(proc->vma_at(0x081b7000), "vma_at at the end of the last vma");
+
+    is(vmas[2]->num_pages(), (int) ((0x080bf000 - 0x08076000) / Elf::page_size()),
+       "pages from below a trimmed guard page go to the vma");
+}
+
+void ArtsdTest::file_map_index()
+{
+    TestSysInfoPtr tsi(new TestSysInfo);
+    tsi->set_pid_info(info);
+    SysInfoPtr si(tsi);
+    Snapshot snap(si);
+    snap.load();
+
+    // The per-process index must hold exactly the maps the file and
+    // process have in common
+    bool same = true;
+    list<FilePtr> files = snap.files();
+    list<FilePtr>::iterator file_it;
+    list<ProcessPtr> procs = snap.procs();
+    list<ProcessPtr>::iterator proc_it;
+    for (file_it = files.begin(); file_it != files.end(); ++file_it) {
+	for (proc_it = procs.begin(); proc_it != procs.end(); ++proc_it) {
+	    list<MapPtr> indexed = (*file_it)->maps((*proc_it)->pid());
+	    indexed.sort();
+	    list<MapPtr> common = Map::intersect_lists((*file_it)->maps(),
+						       (*proc_it)->maps());
+	    same = same && indexed == common;
+	}
+    }
+    ok(same, "file maps by pid match the maps shared with the process");
+    ok(snap.file("./munged-ls-threeloads")->maps(-1).empty(),
+       "no maps for an unknown pid");
+}
+
+void ArtsdTest::file_identity()
+{
+    NamePool pool;
+    NamePtr name = pool.intern("libfoo.so");
+    ok(pool.intern(string("libfoo.so")) == name
+       && pool.intern("libbar.so") != name,
+       "interned names are shared");
+    pool.intern("unused");
+    pool.prune();
+    ok(pool.size() == 1 && pool.intern("libfoo.so") == name,
+       "pruning keeps only the names in use");
+
+    // The same file seen by another process under another path, as
+    // from inside a container
+    map<pid_t, struct TestSysInfo::pidinfo> aliased = info;
+    struct TestSysInfo::pidinfo pi;
+    pi.cmdline = "./contained";
+    pi.vma_lines.push_back("08047000-08070000 r-xp 00000000 16:0a 29616899   ././munged-ls-threeloads");
+    pi.vma_lines.push_back("08070000-08074000 rw-p 00028000 16:0a 29616899   ././munged-ls-threeloads");
+    pi.vma_lines.push_back("08076000-080bf000 rw-p 0002b000 16:0a 29616899   ././munged-ls-threeloads");
+    aliased[1238] = pi;
+
+    TestSysInfoPtr tsi(new TestSysInfo);
+    tsi->set_pid_info(aliased);
+    vector<VmaPtr> vmas;
+    tsi->read_vmas(PagePoolPtr(), 1234, vmas);
+    ok(vmas[0]->shared_name() == vmas[1]->shared_name(),
+       "vmas of one file share their name");
+
+    SysInfoPtr si(tsi);
+    Snapshot snap(si);
+    ok(snap.load(), "can load with a file under two paths");
+    FilePtr file = snap.file("./munged-ls-threeloads");
+    ok(file && snap.file("././munged-ls-threeloads") == file,
+       "a file under two paths is one file");
+    bool all_procs = true;
+    for (pid_t pid = 1234; pid <= 1238; pid += 4) {
+	all_procs = all_procs && file && !file->maps(pid).empty();
+    }
+    ok(all_procs, "the file has the maps of both paths");
+}
+
+/// Size a range the slow way, a page at a time
+static SizesPtr walk_range_sizes(VmaPtr &vma,
+				 PagePoolPtr &pp,
+				 const Range &mrange)
+{
+    if (mrange.size() == 0 || !vma->range()->contains(mrange)) {
+	return SizesPtr();
+    }
+    SizesPtr sizes(new Sizes);
+    const Elf::Address page_size = Elf::page_size();
+    Elf::Address addr;
+    for (addr = Elf::page_align_down(mrange.start());
+	 addr < mrange.end();
+	 addr += page_size) {
+	Range page_range(addr, addr + page_size);
+	Range overlap;
+	page_range.intersect(mrange, overlap);
+	double bytes = overlap.size();
+	Page page = vma->page_at(addr);
+	sizes->increase(Sizes::VM, bytes);
+	if (!page.is_mapped()) {
+	    continue;
+	}
+	int count = pp->count(page);
+	sizes->increase(Sizes::MAPPED, bytes);
+	sizes->increase(Sizes::EFFECTIVE_MAPPED, bytes / count);
+	if (count == 1) {
+	    sizes->increase(Sizes::SOLE_MAPPED, bytes);
+	}
+	if (page.is_resident()) {
+	    sizes->increase(Sizes::RESIDENT, bytes);
+	    sizes->increase(Sizes::EFFECTIVE_RESIDENT, bytes / count);
+	    if (page.is_writable()) {
+		sizes->increase(Sizes::WRITABLE, bytes);
+	    }
+	}
+    }
+    return sizes;
+}
+
+/// Records what Vma::visit_pages hands out
+class RecordingVisitor : public PageVisitor
+{
+public:
+    RecordingVisitor() : partials(0), spans(0), bytes(0) { }
+    void partial_page(const Page &page, Elf::Address nbytes)
+    {
+	++partials;
+	bytes += nbytes;
+	pages.push_back(page);
+    }
+    void whole_pages(const Page *p, size_t count)
+    {
+	++spans;
+	bytes += count * Elf::page_size();
+	pages.insert(pages.end(), p, p + count);
+    }
+    void contiguous_pages(const Page &first, size_t count)
+    {
+	++spans;
+	bytes += count * Elf::page_size();
+	for (size_t i = 0; i < count; ++i) {
+	    pages.push_back(first.offset_by(i));
+	}
+    }
+    void unmapped_pages(size_t count)
+    {
+	bytes += count * Elf::page_size();
+	pages.insert(pages.end(), count, Page(0, false, false));
+    }
+    int partials;
+    int spans;
+    Elf::Address bytes;
+    vector<Page> pages;
+};
+
+void ArtsdTest::visit_pages()
+{
+    const Elf::Address page_size = Elf::page_size();
+    const Elf::Address start = 0x30000000;
+
+    // 4 scattered pages, a hole of 4, then a contiguous run of 12
+    vector<Page> pages;
+    int i;
+    for (i = 0; i < 4; ++i) {
+	pages.push_back(Page(0x100 + 7 * i, true, false));
+    }
+    for (i = 0; i < 4; ++i) {
+	pages.push_back(Page(0, false, false));
+    }
+    for (i = 0; i < 12; ++i) {
+	pages.push_back(Page(0x900 + i, true, true));
+    }
+    VmaPtr vma(new Vma(start, start + pages.size() * page_size, 0, "[anon]"));
+    vma->add_pages(start, &pages[0], pages.size());
+
+    RecordingVisitor whole;
+    ok(vma->visit_pages(*vma->range(), whole), "can visit whole vma");
+    is(whole.partials, 0, "aligned range has no partial pages");
+    is(whole.spans, 2, "one span for each page extent");
+    bool same = whole.pages.size() == pages.size();
+    for (size_t j = 0; same && j < pages.size(); ++j) {
+	same = whole.pages[j].cookie() == pages[j].cookie();
+    }
+    ok(same, "visited pages are the vma pages in order");
+
+    RecordingVisitor part;
+    Range mrange(start + 100, start + 10 * page_size + 5);
+    vma->visit_pages(mrange, part);
+    is(part.partials, 2, "unaligned range has a partial page at each end");
+    is(part.bytes, mrange.size(), "visited bytes add up to the range");
+    is(part.pages.front().cookie(), pages[0].cookie(), "head page");
+    is(part.pages.back().cookie(), pages[10].cookie(), "tail page");
+
+    RecordingVisitor one;
+    vma->visit_pages(Range(start + 10, start + 20), one);
+    ok(one.partials == 1 && one.spans == 0 && one.bytes == 10,
+       "range within a page is one partial page");
+
+    Vma::set_check_ranges(true);
+    RecordingVisitor outside;
+    notok(vma->visit_pages(Range(start - page_size, start + 1), outside),
+	  "checked visit rejects a range outside the vma");
+    Vma::set_check_ranges(false);
+}
+
+void ArtsdTest::range_sizes()
+{
+    const Elf::Address page_size = Elf::page_size();
+    const Elf::Address start = 0x20000000;
+    const int npages = 300;
+
+    // Runs of random length: holes, contiguous runs and scattered
+    // pages, with assorted flags and share counts
+    srand(3);
+    vector<Page> pages;
+    PageCookie cookie = 0x1000;
+    while ((int) pages.size() < npages) {
+	int len = rand() % 20 + 1;
+	int kind = rand() % 3;
+	bool resident = rand() % 4 != 0;
+	bool writable = rand() % 2 != 0;
+	for (int i = 0; i < len && (int) pages.size() < npages; ++i) {
+	    if (kind == 0) {
+		pages.push_back(Page(0, false, false));
+	    }
+	    else {
+		cookie += kind == 1 ? 1 : rand() % 100 + 2;
+		pages.push_back(Page(cookie, resident, writable));
+	    }
+	}
+    }
+
+    PagePoolPtr pp(new PagePool);
+    vector<Page>::iterator page_it;
+    for (page_it = pages.begin(); page_it != pages.end(); ++page_it) {
+	if (page_it->is_mapped()) {
+	    int shares = rand() % 3 + 1;
+	    for (int i = 0; i < shares; ++i) {
+		pp->inc_page_count(*page_it);
+	    }
+	}
+    }
+    VmaPtr vma(new Vma(start, start + npages * page_size, 0, "[anon]"));
+    vma->add_pages(start, &pages[0], pages.size());
+
+    bool all_same = true;
+    for (int iter = 0; iter < 500; ++iter) {
+	Elf::Address a = rand() % (npages * page_size);
+	Elf::Address b = rand() % (npages * page_size);
+	if (a > b) {
+	    swap(a, b);
+	}
+	Range mrange(start + a, start + b);
+	SizesPtr slow = walk_range_sizes(vma, pp, mrange);
+	Sizes fast;
+	if (!vma->add_range_sizes(pp, mrange, fast)) {
+	    all_same = all_same && mrange.size() == 0;
+	    continue;
+	}
+	for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
+	    double slow_val = slow ? slow->val(i) : 0;
+	    if (fabs(fast.val(i) - slow_val) > 1e-6) {
+		all_same = false;
+	    }
+	}
+    }
+    ok(all_same, "range sizes from running totals match a page walk");
+
+    // A whole vma is sized by visiting its pages with each kernel
+    VmaPtr fresh(new Vma(start, start + npages * page_size, 0, "[anon]"));
+    fresh->add_pages(start, &pages[0], pages.size());
+    SizesPtr slow = walk_range_sizes(fresh, pp, *fresh->range());
+    SizesKernel::Kind kind = SizesKernel::chosen();
+    all_same = true;
+    for (int k = 0; k < SizesKernel::NUM_KINDS; ++k) {
+	if (!SizesKernel::choose((SizesKernel::Kind) k)) {
+	    continue;
+	}
+	Sizes fast;
+	fresh->add_range_sizes(pp, *fresh->range(), fast);
+	for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
+	    if (fabs(fast.val(i) - slow->val(i)) > 1e-6) {
+		all_same = false;
+	    }
+	}
+    }
+    SizesKernel::choose(kind);
+    ok(all_same, "whole vma sizes match a page walk with every kernel");
+
+    Sizes whole;
+    ok(vma->add_range_sizes(pp, *vma->range(), whole), "can size whole vma");
+    notok(vma->add_range_sizes(pp, Range(start - 1, start + 1), whole),
+	  "can't size a range outside the vma");
+}
+
+static bool same_sizes(const SizesPtr &a, Sizes &b)
+{
+    for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
+	double aval = a ? a->val(i) : 0;
+	if (fabs(aval - b.val(i)) > 1e-6) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+void ArtsdTest::batch_sizes()
+{
+    TestSysInfoPtr tsi(new TestSysInfo);
+    tsi->set_pid_info(info);
+    tsi->set_mapped_pages(true);
+    SysInfoPtr si(tsi);
+    Snapshot snap(si);
+    snap.load();
+    ProcessPtr proc = snap.proc(1234);
+    FilePtr file = snap.file("./munged-ls-threeloads");
+
+    // Random, overlapping, unsorted ranges over the elf address
+    // space of the file, some reaching beyond it
+    srand(5);
+    vector<Range> ranges;
+    for (int i = 0; i < 300; ++i) {
+	Elf::Address start = 0x08040000 + rand() % 0x80000;
+	ranges.push_back(Range(start, start + rand() % 0x3000));
+    }
+
+    vector<Sizes> results;
+    ok(proc->sizes(file, ranges, results), "can batch size for a process");
+    bool same = results.size() == ranges.size();
+    bool any_mapped = false;
+    for (size_t i = 0; same && i < ranges.size(); ++i) {
+	RangePtr range(new Range(ranges[i]));
+	same = same_sizes(proc->sizes(file, range), results[i]);
+	any_mapped = any_mapped || results[i].val(Sizes::MAPPED) > 0;
+    }
+    ok(same && any_mapped, "process batch sizes match single range sizes");
+
+    ok(file->sizes(ranges, results), "can batch size for a file");
+    same = results.size() == ranges.size();
+    for (size_t i = 0; same && i < ranges.size(); ++i) {
+	RangePtr range(new Range(ranges[i]));
+	same = same_sizes(file->sizes(range), results[i]);
+    }
+    ok(same, "file batch sizes match single range sizes");
+}
+
 RUN_TEST_CLASS(ArtsdTest);
 
 // ------------------------------------------------------------
@@ -70,9 +497,7 @@ void TestSysInfo::set_pid_info(const std::map<pid_t, struct pidinfo> &info)
 	for (line_it = vma_lines.begin();
 	     line_it != vma_lines.end();
 	     ++line_it) {
-	    VmaPtr vma = parse_vma_line(*line_it);
-	    vma->selfptr(vma);
-	    _vmas[it->first].push_back(vma);
+	    _vmas[it->first].push_back(parse_vma_line(*line_it));
 	}
     }
 }
@@ -83,26 +508,37 @@ bool TestSysInfo::sanity_check()
 }
 
 // Make up some random page data
-bool TestSysInfo::read_page_info(pid_t pid,
-				 map<Elf::Address, list<Page> > &pi)
+bool TestSysInfo::read_page_info(pid_t pid, PageSink &sink)
 {
-    list<VmaPtr>::iterator vma_it;
-    stringstream sstr;
-    pi.clear();
+    vector<VmaPtr>::iterator vma_it;
 
-    list<VmaPtr> vmas = _vmas[pid];
+    vector<VmaPtr> vmas = _vmas.find(pid)->second;
 
     for(vma_it = vmas.begin(); vma_it != vmas.end(); ++vma_it) {
 	Elf::Address addr;
 	Elf::Address vma_start = (*vma_it)->start();
 	Elf::Address vma_end = (*vma_it)->end();
+	vector<Page> pages;
 	for (addr = vma_start; addr < vma_end; addr += Elf::page_size()) {
 	    bool resident, writable;
 	    PageCookie cookie;
 	    random_page_info(&resident, &writable, &cookie);
+	    if (_mapped_pages || vma_start == _guard_vma_start) {
+		// Mapped, so the vma stores them
+		cookie = addr / Elf::page_size();
+		resident = cookie % 3 != 0;
+		writable = (*vma_it)->is_writable();
+	    }
 	    Page p(cookie, resident, writable);
-	    pi[vma_start].push_back(p);
+	    pages.push_back(p);
+	}
+	if (_overlong_runs) {
+	    pages.push_back(Page(OVERLONG_COOKIE, true, false));
 	}
+	if (vma_start == _guard_vma_start) {
+	    vma_start -= Elf::page_size();
+	}
+	sink.add_pages(vma_start, &pages[0], pages.size());
     }
 
     return true;
@@ -119,25 +555,59 @@ void TestSysInfo::random_page_info(bool *resident,
 
 string TestSysInfo::read_cmdline(pid_t pid)
 {
-    return _info[pid].cmdline;
+    return _info.find(pid)->second.cmdline;
 }
 
 bool TestSysInfo::read_vmas(const PagePoolPtr &pp,
 			    pid_t pid,
-			    list<VmaPtr> &vmas)
+			    vector<VmaPtr> &vmas)
 {
     vmas.clear();
-    vmas = _vmas[pid];
+    vmas = _vmas.find(pid)->second;
     return !vmas.empty();
 }
 
+// Make up an smaps file with the same usage for every vma
+bool TestSysInfo::read_vma_sizes(pid_t pid,
+				 map<Elf::Address, SizesPtr> &vs)
+{
+    stringstream smaps;
+    const list<string> &vma_lines = _info.find(pid)->second.vma_lines;
+    list<string>::const_iterator it;
+    for (it = vma_lines.begin(); it != vma_lines.end(); ++it) {
+	smaps << *it << "\n"
+	      << "Rss:                   8 kB\n"
+	      << "Pss:                   4 kB\n"
+	      << "Shared_Clean:          4 kB\n"
+	      << "Private_Dirty:         4 kB\n"
+	      << "Anonymous:             4 kB\n"
+	      << "Swap:                  4 kB\n"
+	      << "SwapPss:               2 kB\n"
+	      << "VmFlags: rd wr mr mw me ac\n";
+    }
+
+    MapsScanner scanner;
+    string text = smaps.str();
+    scanner.set_text(text.data(), text.size());
+    return scan_vma_sizes(scanner, vs);
+}
+
+// We only read from our maps once set_pid_info is done
+bool TestSysInfo::is_thread_safe()
+{
+    return true;
+}
+
 // ------------------------------------------------------------
 
 map<pid_t, struct TestSysInfo::pidinfo> ArtsdTest::info;
 
 bool ArtsdTest::setup()
 {
-    plan(16);
+    plan(16 + 10 + 2 + 4 * Sizes::NUM_SIZES + 9 + 6 + 4 + 3 + 2 + 3 + 7 + 2 + 6 + 4 + 4 + 10 + 6 + 4 + 1 + 4);
+
+    // Don't write a header cache into the home directory
+    Elf::HeaderCache::use_dir("");
 
     struct TestSysInfo::pidinfo pi;
 
@@ -209,6 +679,422 @@ bool ArtsdTest::run()
 	ok(sizes != 0, "can get some sizes");
     }
 
+    parsed_vmas(tsi);
+    threaded_load();
+    summary_load();
+    page_packing();
+    page_store();
+    page_pool();
+    dense_choice();
+    concurrent_counting();
+    rejected_pages();
+    snapshot_teardown();
+    vma_lookup();
+    file_map_index();
+    file_identity();
+    range_sizes();
+    batch_sizes();
+    visit_pages();
+    measure_sets();
+
     return true;
 }
 
+void ArtsdTest::parsed_vmas(TestSysInfoPtr &tsi)
+{
+    vector<VmaPtr> vmas;
+    ok(tsi->read_vmas(PagePoolPtr(), 1234, vmas), "can read artsd vmas");
+    VmaPtr vma = vmas.front();
+    is(vma->start(), 0x08047000UL, "vma start parsed");
+    is(vma->end(), 0x08070000UL, "vma end parsed");
+    is(vma->perms(), (unsigned int) (Vma::PERM_READ | Vma::PERM_EXEC),
+       "vma perms parsed");
+    is(vma->dev(), makedev(0x16, 0x0a), "vma dev parsed");
+    is(vma->inode(), (ino_t) 29616899, "vma inode parsed");
+    is(vma->fname(), string("./munged-ls-threeloads"), "vma name parsed");
+
+    vma = vmas.back();
+    ok(vma->is_writable() && !vma->is_shared(), "heap is private writable");
+
+    ok(tsi->read_vmas(PagePoolPtr(), 1236, vmas), "can read libc vmas");
+    is(vmas.back()->fname(), string("[anon]"), "nameless vma is anon");
+}
+
+void ArtsdTest::threaded_load()
+{
+    // Vmas are owned by the sysinfo, so each snapshot needs its own
+    TestSysInfoPtr serial_tsi(new TestSysInfo);
+    serial_tsi->set_pid_info(info);
+    SysInfoPtr serial_si(serial_tsi);
+    Snapshot serial(serial_si);
+    serial.set_num_threads(1);
+
+    TestSysInfoPtr threaded_tsi(new TestSysInfo);
+    threaded_tsi->set_pid_info(info);
+    SysInfoPtr threaded_si(threaded_tsi);
+    Snapshot threaded(threaded_si);
+    threaded.set_num_threads(3);
+
+    ok(serial.load(), "can load serially");
+    ok(threaded.load(), "can load with threads");
+
+    map<pid_t, struct TestSysInfo::pidinfo>::iterator it;
+    for (it = info.begin(); it != info.end(); ++it) {
+	SizesPtr serial_sizes = serial.proc(it->first)->sizes();
+	SizesPtr threaded_sizes = threaded.proc(it->first)->sizes();
+	for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
+	    is(threaded_sizes->val(i), serial_sizes->val(i),
+	       "threaded load gives same " + Sizes::size_name(i));
+	}
+    }
+}
+
+
+void ArtsdTest::measure_sets()
+{
+    TestSysInfoPtr tsi(new TestSysInfo);
+    tsi->set_pid_info(info);
+    tsi->set_mapped_pages(true);
+    SysInfoPtr si(tsi);
+    Snapshot snap(si);
+    ok(snap.load(), "can load for measure sets");
+
+    // Only the asked for measure is filled in, and it matches the
+    // full sizing
+    bool same = true, others_zero = true;
+    map<pid_t, struct TestSysInfo::pidinfo>::iterator it;
+    for (it = info.begin(); it != info.end(); ++it) {
+	ProcessPtr proc = snap.proc(it->first);
+	Sizes all, effective;
+	proc->add_sizes<Sizes::ALL_MEASURES>(all);
+	proc->add_sizes<Sizes::EFFECTIVE_RESIDENT_BIT>(effective);
+	same = same
+	    && fabs(all.val(Sizes::EFFECTIVE_RESIDENT)
+		    - effective.val(Sizes::EFFECTIVE_RESIDENT)) < 1e-6
+	    && all.val(Sizes::EFFECTIVE_RESIDENT) > 0;
+	for (int i = 0; i < Sizes::NUM_SIZES; ++i) {
+	    if (i != Sizes::EFFECTIVE_RESIDENT && effective.val(i) != 0) {
+		others_zero = false;
+	    }
+	}
+    }
+    ok(same, "effective resident alone matches full process sizes");
+    ok(others_zero, "measures not asked for stay zero");
+
+    FilePtr file = snap.file("./munged-ls-threeloads");
+    Sizes all, effective;
+    ok(file->add_sizes<Sizes::ALL_MEASURES>(all)
+       && file->add_sizes<Sizes::EFFECTIVE_RESIDENT_BIT>(effective)
+       && fabs(all.val(Sizes::EFFECTIVE_RESIDENT)
+	       - effective.val(Sizes::EFFECTIVE_RESIDENT)) < 1e-6
+       && effective.val(Sizes::VM) == 0,
+       "effective resident alone matches full file sizes");
+
+    Sizes sizes;
+    sizes.increase(Sizes::VM, 3 * 1024.0);
+    SizeUnits kbytes = SizeUnits::kbytes();
+    is(kbytes.sval(sizes, Sizes::VM), 3.0, "kbytes scale a view's sizes");
+    string bytes_name = SizeUnits::bytes().size_name(Sizes::VM);
+    ok(kbytes.size_name(Sizes::VM) == "VM (K)"
+       && bytes_name == Sizes::size_name(Sizes::VM),
+       "units name their sizes");
+}
+
+void ArtsdTest::summary_load()
+{
+    TestSysInfoPtr tsi(new TestSysInfo);
+    tsi->set_pid_info(info);
+    SysInfoPtr si(tsi);
+    Snapshot snap(si);
+    snap.set_summary_only(true);
+
+    ok(snap.load(), "can load summary");
+
+    // Four vmas, three of them private writable
+    SizesPtr sizes = snap.proc(1234)->sizes();
+    is(sizes->val(Sizes::VM), (double) (0x081b7000 - 0x08047000 - 0x2000),
+       "summary vm size");
+    is(sizes->val(Sizes::RESIDENT), 4 * 8 * 1024.0, "summary resident");
+    is(sizes->val(Sizes::EFFECTIVE_RESIDENT), 4 * 4 * 1024.0,
+       "summary effective resident");
+    is(sizes->val(Sizes::MAPPED), 4 * 12 * 1024.0, "summary mapped");
+    is(sizes->val(Sizes::EFFECTIVE_MAPPED), 4 * 6 * 1024.0,
+       "summary effective mapped");
+    is(sizes->val(Sizes::SOLE_MAPPED), 4 * 4 * 1024.0, "summary sole mapped");
+    is(sizes->val(Sizes::WRITABLE), 3 * 4 * 1024.0, "summary writable");
+
+    FilePtr file = snap.file("./munged-ls-threeloads");
+    is(file->sizes()->val(Sizes::RESIDENT), 3 * 8 * 1024.0,
+       "summary file resident");
+}
+
+void ArtsdTest::page_packing()
+{
+    is((int) sizeof(Page), 8, "page is one 64-bit word");
+
+    PageCookie big = (1ULL << (Page::COOKIE_BITS - 1)) | 0x1234;
+    Page page(big, true, false);
+    is(page.cookie(), big, "largest cookie survives packing");
+    ok(page.is_resident() && !page.is_writable(), "flags survive packing");
+
+    page = Page(0x1234, false, true);
+    ok(!page.is_resident() && page.is_writable(), "flags are independent");
+
+    page = Page(0, true, true);
+    notok(page.is_mapped(), "flags don't make a page mapped");
+
+    page = Page(1ULL << Page::COOKIE_BITS, false, false);
+    notok(page.is_mapped(), "cookie bits above COOKIE_BITS are dropped");
+}
+
+void ArtsdTest::page_store()
+{
+    const Elf::Address page_size = Elf::page_size();
+    const Elf::Address start = 0x10000000;
+    const int npages = 100;
+
+    // A hole, some unrelated pages, a long contiguous run, a run
+    // with different flags, another hole and a short run.
+    vector<Page> pages;
+    int i;
+    for (i = 0; i < 5; ++i) {
+	pages.push_back(Page(0, false, false));
+    }
+    for (i = 0; i < 10; ++i) {
+	pages.push_back(Page(0x9000 - i * 3, true, false));
+    }
+    for (i = 0; i < 40; ++i) {
+	pages.push_back(Page(0x1000 + i, true, true));
+    }
+    for (i = 0; i < 20; ++i) {
+	pages.push_back(Page(0x1000 + 40 + i, true, false));
+    }
+    for (i = 0; i < 15; ++i) {
+	pages.push_back(Page(0, false, false));
+    }
+    for (i = 0; i < 10; ++i) {
+	pages.push_back(Page(0x5000 + i, false, false));
+    }
+
+    VmaPtr vma(new Vma(start, start + npages * page_size, 0, "[anon]"));
+    // Add in two goes, split in the middle of the contiguous run
+    vma->add_pages(start, &pages[0], 30);
+    vma->add_pages(start + 30 * page_size, &pages[30], pages.size() - 30);
+    vma->shrink_pages();
+
+    bool all_same = true;
+    for (i = 0; i < npages; ++i) {
+	Page page = vma->page_at(start + i * page_size);
+	if (page.cookie() != pages[i].cookie()
+	    || page.is_resident() != pages[i].is_resident()
+	    || page.is_writable() != pages[i].is_writable()) {
+	    all_same = false;
+	}
+    }
+    ok(all_same, "page store gives back the pages it was given");
+    is(vma->num_pages(), 10 + 40 + 20 + 10, "page store counts mapped pages");
+    ok(!vma->page_at(start + 80 * page_size).is_mapped(), "hole is unmapped");
+    ok(vma->page_storage_bytes() < npages * sizeof(Page) / 2,
+       "page store is smaller than a dense array");
+}
+
+void ArtsdTest::page_pool()
+{
+    // Enough cookies to make the hash table grow several times,
+    // spread either side of the dense limit
+    map<PageCookie, int> expected;
+    PagePool hashed, dense;
+    dense.set_dense_limit(5000);
+    srand(1);
+    for (int i = 0; i < 50000; ++i) {
+	Page page(1 + rand() % 10000, true, false);
+	++expected[page.cookie()];
+	hashed.inc_page_count(page);
+	dense.inc_page_count(page);
+    }
+
+    bool hashed_same = true, dense_same = true;
+    map<PageCookie, int>::iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it) {
+	Page page(it->first, true, false);
+	hashed_same = hashed_same && hashed.count(page) == it->second;
+	dense_same = dense_same && dense.count(page) == it->second;
+    }
+    ok(hashed_same, "hashed page pool counts match");
+    ok(dense_same, "dense page pool counts match");
+    is(hashed.count(Page(20000, true, false)), 0, "unseen page has no count");
+}
+
+void ArtsdTest::dense_choice()
+{
+    ok(PagePool::dense_is_smaller(40000, 20000)
+       && !PagePool::dense_is_smaller(1 << 30, 20000)
+       && !PagePool::dense_is_smaller(40000, 0),
+       "dense counts only when most of the range is counted");
+
+    // The test pages have cookies from their addresses, below 40000
+    const PageCookie sparse_limit = 1 << 30, dense_limit = 40000;
+    // Snapshots refer to their SysInfoPtr, so it must outlive them
+    vector<TestSysInfoPtr> tsis;
+    vector<SysInfoPtr> sis(3);
+    vector<SnapshotPtr> snaps;
+    for (int i = 0; i < 3; ++i) {
+	TestSysInfoPtr tsi(new TestSysInfo);
+	tsi->set_pid_info(info);
+	tsi->set_mapped_pages(true);
+	tsis.push_back(tsi);
+	sis[i] = tsi;
+	snaps.push_back(SnapshotPtr(new Snapshot(sis[i])));
+    }
+    tsis[1]->set_pfns(sparse_limit, 20000);
+    tsis[2]->set_pfns(dense_limit, 20000);
+    for (int i = 0; i < 3; ++i) {
+	snaps[i]->load();
+    }
+
+    is(snaps[1]->proc(1234)->page_pool()->dense_limit(), (PageCookie) 0,
+       "sparse pfn range is hashed");
+    is(snaps[2]->proc(1234)->page_pool()->dense_limit(), dense_limit,
+       "well used pfn range is dense");
+    bool same = true;
+    map<pid_t, struct TestSysInfo::pidinfo>::iterator it;
+    for (it = info.begin(); it != info.end(); ++it) {
+	SizesPtr hashed = snaps[0]->proc(it->first)->sizes();
+	for (int i = 1; i < 3; ++i) {
+	    same = same && same_sizes(hashed, *snaps[i]->proc(it->first)->sizes());
+	}
+    }
+    ok(same, "dense and hashed counts give the same sizes");
+}
+
+// Count the pages a run at a time, as Process::add_pages does
+static void *counting_thread(void *arg)
+{
+    CountingThread *ct = (CountingThread *) arg;
+    const vector<Page> &pages = *ct->pages;
+    const size_t run = 64;
+    for (size_t i = 0; i < pages.size(); i += run) {
+	size_t n = min(run, pages.size() - i);
+	if (ct->shard) {
+	    ct->shard->add_pages(&pages[i], n);
+	}
+	else if (ct->overflow) {
+	    ct->pool->inc_pages_count(&pages[i], n, *ct->overflow);
+	}
+	else {
+	    ct->pool->inc_pages_count(&pages[i], n);
+	}
+    }
+    return NULL;
+}
+
+void ArtsdTest::concurrent_counting()
+{
+    const int nthreads = 4;
+    const PageCookie dense_limit = 10000;
+    const PageCookie max_cookie = 2 * dense_limit;
+
+    // Every thread gets a different mix of the same cookies, half of
+    // them beyond the dense limit
+    vector<vector<Page> > pages(nthreads);
+    srand(2);
+    for (int t = 0; t < nthreads; ++t) {
+	for (int i = 0; i < 200000; ++i) {
+	    pages[t].push_back(Page(rand() % max_cookie, true, false));
+	}
+    }
+
+    PagePool serial;
+    for (int t = 0; t < nthreads; ++t) {
+	serial.inc_pages_count(&pages[t][0], pages[t].size());
+    }
+
+    // The third lot count atomically into a pool with no dense limit,
+    // so every page goes to their overflow tables
+    PagePool atomic, sharded, undense;
+    atomic.set_dense_limit(dense_limit);
+    sharded.set_dense_limit(dense_limit);
+    vector<PageCountTable> shards(nthreads), overflows(nthreads);
+
+    vector<CountingThread> cts(3 * nthreads);
+    vector<pthread_t> threads(3 * nthreads);
+    for (int t = 0; t < 3 * nthreads; ++t) {
+	int lot = t / nthreads;
+	cts[t].pages = &pages[t % nthreads];
+	cts[t].pool = lot == 2 ? &undense : &atomic;
+	cts[t].shard = lot == 1 ? &shards[t % nthreads] : NULL;
+	cts[t].overflow = lot == 2 ? &overflows[t % nthreads] : NULL;
+	pthread_create(&threads[t], NULL, counting_thread, &cts[t]);
+    }
+    for (int t = 0; t < 3 * nthreads; ++t) {
+	pthread_join(threads[t], NULL);
+    }
+    for (int t = 0; t < nthreads; ++t) {
+	sharded.merge(shards[t]);
+	undense.merge(overflows[t]);
+    }
+
+    bool atomic_same = true, sharded_same = true, undense_same = true;
+    for (PageCookie cookie = 1; cookie < max_cookie; ++cookie) {
+	Page page(cookie, true, false);
+	atomic_same = atomic_same && atomic.count(page) == serial.count(page);
+	sharded_same = sharded_same && sharded.count(page) == serial.count(page);
+	undense_same = undense_same && undense.count(page) == serial.count(page);
+    }
+    ok(atomic_same, "atomic counts from threads match serial counts");
+    ok(sharded_same, "sharded counts from threads match serial counts");
+    ok(undense_same,
+       "atomic counts with no dense limit match serial counts");
+}
+
+void ArtsdTest::rejected_pages()
+{
+    const Elf::Address page_size = Elf::page_size();
+    const Elf::Address start = 0x40000000;
+
+    vector<Page> pages;
+    for (int i = 0; i < 6; ++i) {
+	pages.push_back(Page(0x500 + i, true, false));
+    }
+    VmaPtr vma(new Vma(start, start + 4 * page_size, 0, "[anon]"));
+    is(vma->add_pages(start, &pages[0], pages.size()), (size_t) 4,
+       "vma takes only the pages within it");
+    is(vma->add_pages(start, &pages[0], 1), (size_t) 0,
+       "vma takes no pages added out of order");
+    is(vma->add_pages(start - page_size, &pages[0], 1), (size_t) 0,
+       "vma takes no pages from before its start");
+
+    // The page past each vma mustn't be counted, as it isn't stored
+    TestSysInfoPtr tsi(new TestSysInfo);
+    tsi->set_pid_info(info);
+    tsi->set_mapped_pages(true);
+    tsi->set_overlong_runs(true);
+    SysInfoPtr si(tsi);
+    Snapshot snap(si);
+    snap.load();
+    ProcessPtr proc = snap.proc(1234);
+    is(proc->page_pool()->count(Page(TestSysInfo::OVERLONG_COOKIE,
+				     true,
+				     false)),
+       0,
+       "pages a vma doesn't take aren't counted");
+}
+
+void ArtsdTest::snapshot_teardown()
+{
+    boost::weak_ptr<Process> weak_proc;
+    boost::weak_ptr<File> weak_file;
+    {
+	TestSysInfoPtr tsi(new TestSysInfo);
+	tsi->set_pid_info(info);
+	SysInfoPtr si(tsi);
+	Snapshot snap(si);
+	snap.load();
+	weak_proc = snap.proc(1234);
+	weak_file = snap.file("./munged-ls-threeloads");
+	ok(!weak_proc.expired() && !weak_file.expired(),
+	   "snapshot holds its procs and files");
+    }
+    ok(weak_proc.expired(), "procs are freed with the snapshot");
+    ok(weak_file.expired(), "files are freed with the snapshot");
+}
@@ -6,9 +6,11 @@
 #include "jutil.hpp"
 #include "Pcre.hpp"
 
+#include <fstream>
 #include <list>
 #include <string>
 #include <stdlib.h> // For strtol
+#include <sys/stat.h>
 
 class ElfTest : public Test
 {
@@ -16,6 +18,9 @@ public:
     bool setup();
     bool run();
     bool maintests();
+    bool index_matches_scans();
+    bool header_cache();
+    bool mapping_pool();
     bool mix32_64();
     bool teardown();
 private:
@@ -40,12 +45,16 @@ using namespace Pcre;
 
 bool ElfTest::run()
 {
-    return maintests() && mix32_64();
+    return maintests()
+	&& index_matches_scans()
+	&& header_cache()
+	&& mapping_pool()
+	&& mix32_64();
 }
 
 bool ElfTest::maintests()
 {
-    plan(114);
+    plan(134 + 2 * _testdat.size());
 
     Elf::File e;
 
@@ -230,6 +239,186 @@ bool ElfTest::teardown()
     return false;
 }
 
+/// The defined symbols which overlap mrange, the slow way
+static list<Elf::SymbolPtr> scan_symbols(const list<Elf::SymbolPtr> &syms,
+					 const RangePtr &mrange)
+{
+    list<Elf::SymbolPtr> result;
+    list<Elf::SymbolPtr>::const_iterator it;
+    for (it = syms.begin(); it != syms.end(); ++it) {
+	if ((*it)->is_defined() && mrange->overlaps(*(*it)->range())) {
+	    result.push_back(*it);
+	}
+    }
+    return result;
+}
+
+bool ElfTest::index_matches_scans()
+{
+    srand(1);
+    map<string, struct testdat>::iterator it;
+    for (it = _testdat.begin(); it != _testdat.end(); ++it) {
+	const string &fname = it->first;
+	Elf::File e;
+	e.load(fname, false);
+	list<Elf::SymbolPtr> syms = e.all_symbols();
+	list<Elf::SymbolPtr>::iterator sym_it;
+
+	// Each section, and ranges around and between the symbols
+	list<RangePtr> ranges;
+	list<Elf::SectionPtr> sections = e.sections();
+	list<Elf::SectionPtr>::iterator sect_it;
+	for (sect_it = sections.begin(); sect_it != sections.end(); ++sect_it) {
+	    ranges.push_back((*sect_it)->mem_range());
+	}
+	for (sym_it = syms.begin(); sym_it != syms.end(); ++sym_it) {
+	    Elf::Address start = (*sym_it)->range()->start();
+	    start += rand() % 64 - 32;
+	    ranges.push_back(RangePtr(new Range(start,
+						start + rand() % 256)));
+	    ranges.push_back(RangePtr(new Range(start, start)));
+	}
+
+	bool same = true;
+	list<RangePtr>::iterator range_it;
+	for (range_it = ranges.begin(); range_it != ranges.end(); ++range_it) {
+	    same = same && e.find_symbols_in_mem_range(*range_it)
+		== scan_symbols(syms, *range_it);
+	}
+	ok(same, "indexed symbol ranges match a scan in " + fname);
+
+	// The first symbol of each name, as a scan finds it
+	same = true;
+	for (sym_it = syms.begin(); sym_it != syms.end(); ++sym_it) {
+	    list<Elf::SymbolPtr>::iterator first = syms.begin();
+	    while ((*first)->name() != (*sym_it)->name()) {
+		++first;
+	    }
+	    same = same && e.symbol((*sym_it)->name()) == *first;
+	}
+	same = same && !e.symbol("no such symbol in " + fname);
+	ok(same, "indexed symbol names match a scan in " + fname);
+    }
+    return true;
+}
+
+/// Segments with the same ranges and flags
+static bool same_segments(Elf::File &e1, Elf::File &e2)
+{
+    list<Elf::SegmentPtr> segs1 = e1.segments(), segs2 = e2.segments();
+    if (segs1.size() != segs2.size()) {
+	return false;
+    }
+    list<Elf::SegmentPtr>::iterator it1, it2;
+    for (it1 = segs1.begin(), it2 = segs2.begin();
+	 it1 != segs1.end();
+	 ++it1, ++it2) {
+	if (*(*it1)->mem_range() != *(*it2)->mem_range()
+	    || *(*it1)->file_range() != *(*it2)->file_range()
+	    || (*it1)->is_load() != (*it2)->is_load()
+	    || (*it1)->is_writable() != (*it2)->is_writable()) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+bool ElfTest::header_cache()
+{
+    char dir_template[] = "/tmp/t_elf_cache.XXXXXX";
+    const string dir = mkdtemp(dir_template);
+    const string cached = "/bin/ls";
+    // One of ours, so it is there on any system
+    const string nonelf = "mandriva.artsd.maps";
+
+    Elf::HeaderCache::use_dir(dir);
+    Elf::File cold, cold_nonelf;
+    ok(cold.load(cached), "load file with empty cache");
+    notok(cold_nonelf.load(nonelf, false), "non-elf file with empty cache");
+    is((int) Elf::HeaderCache::instance().hits(), 0, "empty cache misses");
+    ok(Elf::HeaderCache::instance().save(), "can save cache");
+
+    // Start again, from the saved file
+    Elf::HeaderCache::use_dir(dir);
+    Elf::File warm, warm_nonelf;
+    ok(warm.load(cached), "load file from cache");
+    notok(warm_nonelf.load(nonelf, false), "non-elf file from cache");
+    is((int) Elf::HeaderCache::instance().hits(), 2, "cache hits");
+    ok(warm.elf_file_type() == cold.elf_file_type()
+       && same_segments(warm, cold),
+       "cached headers match the file");
+    is(warm.num_sections(), cold.num_sections(),
+       "sections of cached file can be loaded");
+
+    // Keys which differ in any way mustn't match
+    Elf::HeaderCache cache(dir);
+    Elf::FileKey key;
+    key.dev = 1;
+    key.inode = 2;
+    key.size = 3;
+    key.mtime = key.ctime = 1000000000;
+    cache.add(key, "headers", 7);
+    Elf::FileKey touched(key), changed(key);
+    touched.mtime++;
+    changed.ctime++;
+    const char *headers;
+    unsigned long len;
+    ok(cache.save()
+       && Elf::HeaderCache(dir).find(key, headers, len)
+       == Elf::HeaderCache::ELF
+       && string(headers, len) == "headers",
+       "cache finds saved key");
+    ok(cache.find(touched, headers, len) == Elf::HeaderCache::MISSING
+       && cache.find(changed, headers, len) == Elf::HeaderCache::MISSING,
+       "cache misses changed keys");
+
+    // A file which has only just changed might change again unseen
+    const string copy = dir + "/copy";
+    {
+	ofstream out(copy.c_str());
+	out << "not elf\n";
+    }
+    struct stat st;
+    stat(copy.c_str(), &st);
+    Elf::FileKey fresh(st);
+    cache.add(fresh, NULL, 0);
+    cache.save();
+    ok(Elf::HeaderCache(dir).find(fresh, headers, len)
+       == Elf::HeaderCache::MISSING,
+       "just changed file isn't cached");
+
+    unlink(copy.c_str());
+    unlink((dir + "/elf-headers").c_str());
+    rmdir(dir.c_str());
+    Elf::HeaderCache::use_dir("");
+    return true;
+}
+
+bool ElfTest::mapping_pool()
+{
+    Elf::MappingPool &pool = Elf::MappingPool::instance();
+    unsigned long orig_limit = pool.limit();
+    pool.set_limit(1);
+    {
+	Elf::File e1, e2;
+	ok(e1.load("./t_elf"), "load first file");
+	int num_sections = e1.num_sections();
+	Elf::SymbolPtr sym = e1.symbol("main");
+	ok(sym, "find symbol in first file");
+	is((int) pool.size(), 1, "first file is mapped");
+
+	ok(e2.load("/bin/ls") && e2.num_sections() > 0,
+	   "load second file");
+	is((int) pool.size(), 1, "only one file mapped at once");
+	ok(sym->name() == "main", "symbol outlives its file's mapping");
+	ok(e1.num_sections() == num_sections && e1.symbol("main"),
+	   "first file is mapped again when needed");
+    }
+    is((int) pool.size(), 0, "files leave pool when freed");
+    pool.set_limit(orig_limit);
+    return true;
+}
+
 bool ElfTest::mix32_64()
 {
     return true;
@@ -3,6 +3,7 @@
  */
 #include <Trun.hpp>
 #include "Exmap.hpp"
+#include "ElfCache.hpp"
 #include "Pcre.hpp"
 
 #include <sstream>
@@ -81,7 +82,7 @@ int ExmapTest::num_initialised_arrays()
 
 bool ExmapTest::run()
 {
-    SysInfoPtr sysinfo(new LinuxSysInfo);
+    SysInfoPtr sysinfo = make_sysinfo();
     Snapshot snap(sysinfo);
 
     is(snap.num_procs(), 0, "zero procs before load");
@@ -359,6 +360,9 @@ bool ExmapTest::run()
 bool ExmapTest::setup()
 {
     plan(198);
+
+    // Don't write a header cache into the home directory
+    Elf::HeaderCache::use_dir("");
     
     const string ld_path_env = "LD_LIBRARY_PATH";
     const char *cp = getenv(ld_path_env.c_str());
@@ -7,11 +7,16 @@
 
 #include <sstream>
 #include <list>
+#include <vector>
+#include <stdlib.h>
 
 class RangeTest : public Test
 {
 public:
     bool run();
+private:
+    void value_ops();
+    void vector_ops();
 };
 
 using namespace std;
@@ -19,7 +24,7 @@ using namespace jutil;
 
 bool RangeTest::run()
 {
-    plan(133);
+    plan(133 + 19 + 12);
 
     Range r1(3, 3);
     is(r1.start(), 3UL, "check start");
@@ -323,8 +328,116 @@ bool RangeTest::run()
     is(*l.front(), Range(2, 3), "sorted pointer list 1");
     is(*l.back(), Range(6, 8), "sorted pointer list 2");
 
+    value_ops();
+    vector_ops();
     return true;
 }
 
+void RangeTest::value_ops()
+{
+    Range r(2, 6);
+    Range result(99, 99);
+
+    is(Range().size(), 0UL, "default range is empty");
+    notok(r.intersect(Range(6, 8), result), "value intersect disjoint");
+    ok(result == Range(99, 99), "failed intersect leaves result alone");
+    ok(r.intersect(Range(2, 2), result), "value intersect zero length");
+    is(result, Range(2, 2), "value intersect zero length result");
+    ok(r.intersect(Range(1, 3), result), "value intersect overlap");
+    is(result, Range(2, 3), "value intersect overlap result");
+
+    is(r.shifted(3), Range(5, 9), "shifted up");
+    is(r.shifted(-2UL), Range(0, 4), "shifted down");
+    is(r, Range(2, 6), "shifted doesn't modify range");
+
+    is(r.clamp(0, 10), r, "clamp to containing range");
+    is(r.clamp(3, 5), Range(3, 5), "clamp to contained range");
+    is(r.clamp(8, 10), Range(8, 8), "clamp above the range");
+    is(r.clamp(0, 1), Range(1, 1), "clamp below the range");
+
+    notok(Range(1, 2).merge(Range(3, 5), result), "value merge gap");
+    ok(Range(5, 7).merge(Range(3, 5), result), "value merge adjacent");
+    is(result, Range(3, 7), "value merge adjacent result");
+    ok(Range(2, 4).merge(Range(1, 3), result), "value merge overlap");
+    is(result, Range(1, 4), "value merge overlap result");
+}
+
+static vector<Range> to_vector(const list<RangePtr> &l)
+{
+    vector<Range> v;
+    list<RangePtr>::const_iterator it;
+    for (it = l.begin(); it != l.end(); ++it) {
+	v.push_back(**it);
+    }
+    return v;
+}
+
+static bool same_ranges(const vector<Range> &a, const vector<Range> &b)
+{
+    return a.size() == b.size() && equal(a.begin(), a.end(), b.begin());
+}
+
+void RangeTest::vector_ops()
+{
+    vector<Range> v;
+    vector<Range> result;
+
+    Range::merge_in_place(v);
+    ok(v.empty(), "merge_in_place of empty vector");
+
+    v.push_back(Range(5, 7));
+    v.push_back(Range(1, 2));
+    v.push_back(Range(3, 5));
+    v.push_back(Range(2, 2));
+    Range::merge_in_place(v);
+    is((int) v.size(), 2, "merge_in_place count");
+    is(v.front(), Range(1, 2), "merge_in_place first");
+    is(v.back(), Range(3, 7), "merge_in_place second");
+
+    Range(0, 10).invert_sorted(v, result);
+    is((int) result.size(), 3, "invert_sorted count");
+    ok(result[0] == Range(0, 1) && result[1] == Range(2, 3)
+       && result[2] == Range(7, 10), "invert_sorted holes");
+    Range(4, 6).invert_sorted(v, result);
+    ok(result.empty(), "invert_sorted fully covered");
+
+    Range(1, 5).restrict_sorted(v, result);
+    is((int) result.size(), 2, "restrict_sorted count");
+    ok(result[0] == Range(1, 2) && result[1] == Range(3, 5),
+       "restrict_sorted clips");
+
+    // The vector forms must agree with the list forms on random lists
+    // which have overlaps, adjacent ranges and empty ranges
+    srand(1);
+    bool merge_same = true, restrict_same = true, invert_same = true;
+    for (int iter = 0; iter < 200; ++iter) {
+	list<RangePtr> l;
+	int n = rand() % 12;
+	for (int i = 0; i < n; ++i) {
+	    unsigned long start = rand() % 50;
+	    unsigned long len = rand() % 4 == 0 ? 0 : rand() % 10;
+	    l.push_back(RangePtr(new Range(start, start + len)));
+	}
+	unsigned long start = rand() % 60;
+	Range outer(start, start + rand() % 30);
+
+	v = to_vector(l);
+	Range::merge_in_place(v);
+	merge_same = merge_same
+	    && same_ranges(v, to_vector(Range::merge_list(l)));
+
+	outer.restrict_sorted(v, result);
+	restrict_same = restrict_same
+	    && same_ranges(result, to_vector(outer.restrict(l)));
+
+	outer.invert_sorted(v, result);
+	invert_same = invert_same
+	    && same_ranges(result, to_vector(outer.invert_list(l)));
+    }
+    ok(merge_same, "merge_in_place agrees with merge_list");
+    ok(restrict_same, "restrict_sorted agrees with restrict");
+    ok(invert_same, "invert_sorted agrees with invert_list");
+}
+
 
 RUN_TEST_CLASS(RangeTest);
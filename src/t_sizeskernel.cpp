@@ -0,0 +1,147 @@
+/*
+ * (c) John Berthels 2005 <jjberthels@gmail.com>. See COPYING for license.
+ */
+#include "SizesKernel.hpp"
+#include <jutil.hpp>
+#include <Trun.hpp>
+
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+
+using namespace std;
+using namespace jutil;
+using namespace Exmap;
+
+class SizesKernelTest : public Test
+{
+public:
+    bool run();
+private:
+    void known_pages();
+    void random_equivalence();
+};
+
+static const int NUM_RANDOM_RUNS = 200;
+
+bool SizesKernelTest::run()
+{
+    plan(8 + 2 * (SizesKernel::NUM_KINDS - 1) + 2);
+
+    known_pages();
+    random_equivalence();
+
+    SizesKernel::Kind kind = SizesKernel::chosen();
+    ok(SizesKernel::supported(kind), "chosen kernel is supported");
+    ok(SizesKernel::choose(SizesKernel::SCALAR)
+       && SizesKernel::chosen() == SizesKernel::SCALAR
+       && SizesKernel::choose(kind),
+       "can switch kernels");
+    return true;
+}
+
+static bool same_span(const SpanSizes &a, const SpanSizes &b)
+{
+    return a.mapped == b.mapped
+	&& a.sole_mapped == b.sole_mapped
+	&& a.resident == b.resident
+	&& a.writable == b.writable
+	&& fabs(a.effective_mapped - b.effective_mapped)
+	    <= 1e-9 * (1 + b.effective_mapped)
+	&& fabs(a.effective_resident - b.effective_resident)
+	    <= 1e-9 * (1 + b.effective_resident);
+}
+
+void SizesKernelTest::known_pages()
+{
+    vector<Page> pages;
+    vector<int32_t> counts;
+    pages.push_back(Page(1, true, true));	counts.push_back(1);
+    pages.push_back(Page(2, true, false));	counts.push_back(2);
+    pages.push_back(Page(3, false, true));	counts.push_back(4);
+    pages.push_back(Page(0, false, false));	counts.push_back(0);
+    pages.push_back(Page(5, true, true));	counts.push_back(-1);
+
+    SpanSizes sizes;
+    SizesKernel::add(&pages[0], &counts[0], pages.size(), sizes);
+    is(sizes.mapped, (uint64_t) 3, "bad and unmapped pages aren't mapped");
+    is(sizes.sole_mapped, (uint64_t) 1, "one sole mapped page");
+    is(sizes.resident, (uint64_t) 2, "two resident pages");
+    is(sizes.writable, (uint64_t) 1, "writable needs resident too");
+    is_approx(sizes.effective_mapped, 1.75, 1e-12, "effective mapped");
+    is_approx(sizes.effective_resident, 1.5, 1e-12, "effective resident");
+
+    Sizes total;
+    sizes.add_to(total, 4096);
+    is_approx(total.val(Sizes::MAPPED), 3.0 * 4096, 1e-6,
+	      "span adds whole pages to sizes");
+    is_approx(total.val(Sizes::EFFECTIVE_RESIDENT), 1.5 * 4096, 1e-6,
+	      "span adds effective sizes to sizes");
+}
+
+/// Pages with random flags and counts, with the odd unmapped page
+/// and bad count thrown in
+static void random_pages(size_t n, vector<Page> &pages, vector<int32_t> &counts)
+{
+    pages.clear();
+    counts.clear();
+    for (size_t i = 0; i < n; ++i) {
+	int r = rand();
+	bool mapped = r % 8 != 0;
+	pages.push_back(Page(mapped ? rand() + 1 : 0, r & 16, r & 32));
+	int count = 0;
+	if (mapped) {
+	    switch ((r >> 6) % 4) {
+	    case 0:
+		count = 1;
+		break;
+	    case 1:
+		count = rand() % 1000 + 1;
+		break;
+	    case 2:
+		count = rand() % 4 + 1;
+		break;
+	    default:
+		count = (r >> 8) % 16 == 0 ? -1 : rand() % 2 + 1;
+		break;
+	    }
+	}
+	counts.push_back(count);
+    }
+}
+
+void SizesKernelTest::random_equivalence()
+{
+    srand(1);
+    for (int k = SizesKernel::SCALAR + 1; k < SizesKernel::NUM_KINDS; ++k) {
+	SizesKernel::Kind kind = (SizesKernel::Kind) k;
+	string name = SizesKernel::name(kind);
+	if (!SizesKernel::supported(kind)) {
+	    ok(SizesKernel::function(kind) == NULL,
+	       "no function for unsupported " + name);
+	    pass("skipping " + name + " equivalence, unsupported");
+	    continue;
+	}
+	ok(SizesKernel::function(kind) != NULL, "have function for " + name);
+
+	SizesKernel::Function scalar
+	    = SizesKernel::function(SizesKernel::SCALAR);
+	SizesKernel::Function vector_kernel = SizesKernel::function(kind);
+	bool same = true;
+	vector<Page> pages;
+	vector<int32_t> counts;
+	for (int run = 0; same && run < NUM_RANDOM_RUNS; ++run) {
+	    // Odd lengths and offsets leave tails and unaligned loads
+	    size_t n = rand() % 300 + 1;
+	    random_pages(n, pages, counts);
+	    size_t offset = rand() % n;
+	    SpanSizes expected, got;
+	    scalar(&pages[offset], &counts[offset], n - offset, expected);
+	    vector_kernel(&pages[offset], &counts[offset], n - offset, got);
+	    same = same_span(got, expected);
+	}
+	ok(same, name + " kernel matches scalar on random pages");
+    }
+}
+
+RUN_TEST_CLASS(SizesKernelTest);